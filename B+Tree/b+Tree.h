@@ -15,9 +15,13 @@ private:
     BPlusTreeNode<KeyType, ValueType> *root;
     int order; // Order of the B+ tree
 
+    bool concurrent;                   // Latch nodes so that several threads can use the tree at once
+    std::shared_timed_mutex rootLatch; // Guards the root pointer itself in concurrent mode
+
 public:
-    // Constructor
-     BPlusTree(int order) : root(nullptr), order(order) {}
+    // Constructor. In concurrent mode insert, find, iterate_range and map_range may be called from several
+    // threads at once; levelOrderTraversal and remove still need the tree to themselves.
+     BPlusTree(int order, bool concurrent = false) : root(nullptr), order(order), concurrent(concurrent) {}
 
     // Destructor
     ~BPlusTree()
@@ -31,6 +35,12 @@ public:
     // Public method to insert a key-value pair into the tree
     void insert(const KeyType &key, const ValueType &value)
     {
+        if (concurrent)
+        {
+            insertConcurrent(key, value);
+            return;
+        }
+
         if (root == nullptr)
         {
             // Create the root if it doesn't exist
@@ -95,6 +105,11 @@ public:
     // Function to find the smallest key greater than or equal to the given search key
     BPlusTreeNode<KeyType, ValueType> *find(const KeyType &searchKey)
     {
+        if (concurrent)
+        {
+            return findConcurrent(searchKey);
+        }
+
         if (root == nullptr)
         {
             cout << "Tree is empty." << endl;
@@ -150,6 +165,12 @@ public:
     // Function to iterate over a range of elements in order (by key)
     void iterate_range(const KeyType &start, int length, std::function<void(const KeyType &, ValueType &)> f)
     {
+        if (concurrent)
+        {
+            iterateRangeConcurrent(start, length, f);
+            return;
+        }
+
         if (root == nullptr)
         {
             cout << "Tree is empty." << endl;
@@ -177,10 +198,190 @@ public:
     // Public method to apply a function to all elements with keys in the range [start, end)
     void map_range(const KeyType &start, const KeyType &end, std::function<void(const KeyType &, ValueType &)> f)
     {
+        if (concurrent)
+        {
+            mapRangeConcurrent(start, end, f);
+            return;
+        }
+
         map_range_recursive(root, start, end, f);
     }
 
 private:
+    // Latch crabbing: exclusive latches from the root down, letting go of everything above a node that has room
+    // for one more key, since a split below it cannot reach further up. Only the part of the path a split can
+    // change stays latched while the leaf is updated.
+    void insertConcurrent(const KeyType &key, const ValueType &value)
+    {
+        std::vector<std::shared_timed_mutex *> held;
+        rootLatch.lock();
+        held.push_back(&rootLatch);
+
+        if (root == nullptr)
+        {
+            root = new BPlusTreeNode<KeyType, ValueType>(true);
+            root->keys.push_back(key);
+            root->values.push_back(value);
+            rootLatch.unlock();
+            return;
+        }
+
+        BPlusTreeNode<KeyType, ValueType> *current = root;
+        while (true)
+        {
+            current->latch.lock();
+            if ((int) current->keys.size() + 1 < order)
+            {
+                releaseLatches(held); // Safe node, nothing above it changes
+            }
+            held.push_back(&current->latch);
+
+            if (current->isLeaf)
+            {
+                break;
+            }
+
+            // Same routing as insertRecursive
+            size_t i = 0;
+            while (i < current->keys.size() && key > current->keys[i])
+            {
+                ++i;
+            }
+            current = current->children[i];
+        }
+
+        insertIntoLeaf(current, key, value);
+        releaseLatches(held);
+    }
+
+    void releaseLatches(std::vector<std::shared_timed_mutex *> &held)
+    {
+        for (std::shared_timed_mutex *latch : held)
+        {
+            latch->unlock();
+        }
+        held.clear();
+    }
+
+    // Descends to the leaf for searchKey with shared latches, hand over hand, and returns it still latched:
+    // exclusively if exclusiveLeaf is set, shared otherwise. Returns nullptr for an empty tree.
+    BPlusTreeNode<KeyType, ValueType> *findLeafLatched(const KeyType &searchKey, bool exclusiveLeaf)
+    {
+        rootLatch.lock_shared();
+        BPlusTreeNode<KeyType, ValueType> *current = root;
+        if (current == nullptr)
+        {
+            rootLatch.unlock_shared();
+            return nullptr;
+        }
+        (exclusiveLeaf && current->isLeaf) ? current->latch.lock() : current->latch.lock_shared();
+        rootLatch.unlock_shared();
+
+        while (!current->isLeaf)
+        {
+            // Same routing as findLeafNode
+            size_t index = 0;
+            while (index < current->keys.size() && searchKey >= current->keys[index])
+            {
+                index++;
+            }
+            BPlusTreeNode<KeyType, ValueType> *child = current->children[index];
+            (exclusiveLeaf && child->isLeaf) ? child->latch.lock() : child->latch.lock_shared();
+            current->latch.unlock_shared();
+            current = child;
+        }
+        return current;
+    }
+
+    // The node returned is no longer latched, so in concurrent mode it may change under the caller
+    BPlusTreeNode<KeyType, ValueType> *findConcurrent(const KeyType &searchKey)
+    {
+        BPlusTreeNode<KeyType, ValueType> *current = findLeafLatched(searchKey, false);
+        if (current == nullptr)
+        {
+            return nullptr;
+        }
+
+        int index = findKeyIndex(current, searchKey);
+        if (index == -1)
+        {
+            // Key not found in the leaf node, move to the next leaf node
+            BPlusTreeNode<KeyType, ValueType> *next = current->next;
+            if (next != nullptr)
+            {
+                next->latch.lock_shared();
+            }
+            current->latch.unlock_shared();
+            current = next;
+            index = 0;
+        }
+
+        bool found = current != nullptr && (size_t) index < current->keys.size();
+        if (current != nullptr)
+        {
+            current->latch.unlock_shared();
+        }
+        return found ? current : nullptr;
+    }
+
+    // f may change the values, so leaves are latched exclusively, hand over hand from left to right
+    void iterateRangeConcurrent(const KeyType &start, int length, std::function<void(const KeyType &, ValueType &)> f)
+    {
+        BPlusTreeNode<KeyType, ValueType> *current = findLeafLatched(start, true);
+        if (current == nullptr)
+        {
+            return;
+        }
+        int index = findKeyIndex(current, start);
+
+        while (current != nullptr)
+        {
+            for (int i = index; i >= 0 && (size_t) i < current->keys.size() && length > 0; ++i)
+            {
+                f(current->keys[i], current->values[i]);
+                --length;
+            }
+
+            BPlusTreeNode<KeyType, ValueType> *next = (length > 0) ? current->next : nullptr;
+            if (next != nullptr)
+            {
+                next->latch.lock();
+            }
+            current->latch.unlock();
+            current = next;
+            index = 0;
+        }
+    }
+
+    // Same latching as iterateRangeConcurrent, walking leaves until the first key at or past end
+    void mapRangeConcurrent(const KeyType &start, const KeyType &end, std::function<void(const KeyType &, ValueType &)> f)
+    {
+        BPlusTreeNode<KeyType, ValueType> *current = findLeafLatched(start, true);
+        if (current == nullptr)
+        {
+            return;
+        }
+        auto keyIt = std::lower_bound(current->keys.begin(), current->keys.end(), start);
+
+        while (current != nullptr)
+        {
+            while (keyIt != current->keys.end() && *keyIt < end)
+            {
+                f(*keyIt, current->values[std::distance(current->keys.begin(), keyIt)]);
+                ++keyIt;
+            }
+
+            BPlusTreeNode<KeyType, ValueType> *next = (keyIt == current->keys.end()) ? current->next : nullptr;
+            if (next != nullptr)
+            {
+                next->latch.lock();
+                keyIt = next->keys.begin();
+            }
+            current->latch.unlock();
+            current = next;
+        }
+    }
+
     // Private method to perform the recursive insertion
     void
     insertRecursive(BPlusTreeNode<KeyType, ValueType> *node, const KeyType &key, const ValueType &value)
@@ -213,8 +414,8 @@ private:
         leaf->keys.insert(it, key);
         leaf->values.insert(leaf->values.begin() + index, value);
 
-        // Update the linked list pointers
-        if (leaf->next != nullptr)
+        // Update the linked list pointers. The neighbour is not latched in concurrent mode, and nothing follows prev.
+        if (!concurrent && leaf->next != nullptr)
         {
             leaf->next->prev = leaf;
         }
@@ -278,8 +479,10 @@ private:
             // Check if the parent node needs to be split
             if (parent->keys.size() >= order)
             {
+                // The middle key moves up; it stays in neither half
+                KeyType separator = parent->keys[parent->keys.size() / 2];
                 BPlusTreeNode<KeyType, ValueType> *newInternalNode = splitInternal(parent);
-                insertIntoParent(parent, newInternalNode->keys[0], newInternalNode);
+                insertIntoParent(parent, separator, newInternalNode);
             }
         }
     }
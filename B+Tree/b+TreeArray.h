@@ -0,0 +1,511 @@
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <shared_mutex>
+#include <type_traits>
+
+using namespace std;
+
+// Node of a BPlusTreeArray. Keys, values and children sit in arrays of fixed capacity allocated once with the
+// node, so a search touches one contiguous run of keys and an insert shifts with memmove instead of growing
+// three vectors.
+template <typename KeyType, typename ValueType>
+struct BPlusTreeArrayNode
+{
+    bool isLeaf;
+    int count;                     // Keys in use
+    KeyType *keys;                 // order slots
+    ValueType *values;             // order slots, leaves only
+    BPlusTreeArrayNode **children; // order + 1 slots, internal nodes only
+
+    BPlusTreeArrayNode *parent;
+    BPlusTreeArrayNode *next; // Next leaf (only in leaf nodes)
+    BPlusTreeArrayNode *prev; // Previous leaf (only in leaf nodes)
+
+    std::shared_timed_mutex latch; // Only taken when the tree runs in concurrent mode
+
+    BPlusTreeArrayNode(bool leaf, int order) : isLeaf(leaf), count(0), values(nullptr), children(nullptr), parent(nullptr), next(nullptr), prev(nullptr)
+    {
+        keys = new KeyType[order];
+        if (leaf)
+        {
+            values = new ValueType[order];
+        }
+        else
+        {
+            children = new BPlusTreeArrayNode *[order + 1];
+        }
+    }
+
+    // Destructor to recursively delete nodes
+    ~BPlusTreeArrayNode()
+    {
+        if (!isLeaf)
+        {
+            for (int i = 0; i <= count; i++)
+            {
+                delete children[i];
+            }
+        }
+        delete[] keys;
+        delete[] values;
+        delete[] children;
+    }
+};
+
+// BPlusTree with the same API and behaviour, built on BPlusTreeArrayNode. Searches within a node are
+// branchless binary searches, so the baseline stays fair at the large orders test.cpp uses.
+template <typename KeyType, typename ValueType>
+class BPlusTreeArray
+{
+private:
+    typedef BPlusTreeArrayNode<KeyType, ValueType> Node;
+
+    Node *root;
+    int order; // Order of the B+ tree
+
+    bool concurrent;                   // Latch nodes so that several threads can use the tree at once
+    std::shared_timed_mutex rootLatch; // Guards the root pointer itself in concurrent mode
+
+public:
+    // Constructor. In concurrent mode insert, find, remove, iterate_range and map_range may be called from
+    // several threads at once; only levelOrderTraversal needs the tree to itself.
+    BPlusTreeArray(int order, bool concurrent = false) : root(nullptr), order(max(order, 3)), concurrent(concurrent) {}
+
+    // Destructor
+    ~BPlusTreeArray()
+    {
+        delete root;
+    }
+
+    // Public method to insert a key-value pair into the tree
+    void insert(const KeyType &key, const ValueType &value)
+    {
+        if (concurrent)
+        {
+            insertConcurrent(key, value);
+            return;
+        }
+
+        if (root == nullptr)
+        {
+            root = new Node(true, order);
+        }
+
+        Node *current = root;
+        while (!current->isLeaf)
+        {
+            current = current->children[upperBound(current, key)];
+        }
+        insertIntoLeaf(current, key, value);
+    }
+
+    void levelOrderTraversal() const
+    {
+        if (root == nullptr)
+        {
+            return;
+        }
+
+        std::queue<Node *> nodeQueue;
+        nodeQueue.push(root);
+        while (!nodeQueue.empty())
+        {
+            size_t levelSize = nodeQueue.size();
+            for (size_t i = 0; i < levelSize; ++i)
+            {
+                Node *currentNode = nodeQueue.front();
+                nodeQueue.pop();
+
+                for (int j = 0; j < currentNode->count; ++j)
+                {
+                    if (currentNode->isLeaf)
+                    {
+                        std::cout << "(" << currentNode->keys[j] << ", " << currentNode->values[j] << ") ";
+                    }
+                    else
+                    {
+                        std::cout << "(" << currentNode->keys[j] << ") ";
+                    }
+                }
+
+                if (!currentNode->isLeaf)
+                {
+                    for (int j = 0; j <= currentNode->count; ++j)
+                    {
+                        nodeQueue.push(currentNode->children[j]);
+                    }
+                }
+            }
+            std::cout << std::endl; // Move to the next level
+        }
+    }
+
+    // Returns the leaf holding the smallest key greater than or equal to searchKey, or nullptr if there is none.
+    // In concurrent mode the node is no longer latched once returned.
+    Node *find(const KeyType &searchKey)
+    {
+        Node *current = concurrent ? findLeafLatched(searchKey, false) : findLeafNode(searchKey);
+        if (current == nullptr)
+        {
+            return nullptr;
+        }
+
+        int index = lowerBound(current, searchKey);
+        while (index == current->count && current->next != nullptr)
+        {
+            // Every key here is smaller, or remove emptied the leaf, so the key can only be further right
+            Node *next = current->next;
+            if (concurrent)
+            {
+                next->latch.lock_shared();
+                current->latch.unlock_shared();
+            }
+            current = next;
+            index = lowerBound(current, searchKey);
+        }
+
+        bool found = index < current->count;
+        if (concurrent)
+        {
+            current->latch.unlock_shared();
+        }
+        return found ? current : nullptr;
+    }
+
+    // Removes one entry with key from its leaf. Leaves are not merged, an emptied leaf simply stays in the chain.
+    void remove(const KeyType &key)
+    {
+        Node *leaf = concurrent ? findLeafLatched(key, true) : findLeafNode(key);
+        if (leaf == nullptr)
+        {
+            return;
+        }
+
+        int index = lowerBound(leaf, key);
+        while (index == leaf->count && leaf->next != nullptr)
+        {
+            // Every key here is smaller, the key can only be further right
+            Node *next = leaf->next;
+            if (concurrent)
+            {
+                next->latch.lock();
+                leaf->latch.unlock();
+            }
+            leaf = next;
+            index = lowerBound(leaf, key);
+        }
+        if (index < leaf->count && !(key < leaf->keys[index]))
+        {
+            shiftLeft(leaf->keys, index, leaf->count);
+            shiftLeft(leaf->values, index, leaf->count);
+            leaf->count--;
+        }
+        if (concurrent)
+        {
+            leaf->latch.unlock();
+        }
+    }
+
+    // Function to iterate over a range of elements in order (by key)
+    void iterate_range(const KeyType &start, int length, std::function<void(const KeyType &, ValueType &)> f)
+    {
+        // f may change the values, so in concurrent mode leaves are latched exclusively, hand over hand
+        Node *current = concurrent ? findLeafLatched(start, true) : findLeafNode(start);
+        int index = (current != nullptr) ? lowerBound(current, start) : 0;
+
+        while (current != nullptr)
+        {
+            for (int i = index; i < current->count && length > 0; ++i)
+            {
+                f(current->keys[i], current->values[i]);
+                --length;
+            }
+
+            Node *next = (length > 0) ? current->next : nullptr;
+            if (concurrent)
+            {
+                if (next != nullptr)
+                {
+                    next->latch.lock();
+                }
+                current->latch.unlock();
+            }
+            current = next;
+            index = 0;
+        }
+    }
+
+    // Public method to apply a function to all elements with keys in the range [start, end)
+    void map_range(const KeyType &start, const KeyType &end, std::function<void(const KeyType &, ValueType &)> f)
+    {
+        Node *current = concurrent ? findLeafLatched(start, true) : findLeafNode(start);
+        int index = (current != nullptr) ? lowerBound(current, start) : 0;
+
+        while (current != nullptr)
+        {
+            int i = index;
+            for (; i < current->count && current->keys[i] < end; ++i)
+            {
+                f(current->keys[i], current->values[i]);
+            }
+
+            Node *next = (i == current->count) ? current->next : nullptr;
+            if (concurrent)
+            {
+                if (next != nullptr)
+                {
+                    next->latch.lock();
+                }
+                current->latch.unlock();
+            }
+            current = next;
+            index = 0;
+        }
+    }
+
+private:
+    // Number of keys in node not greater than key, which is also the child key is routed to. Branch free, so
+    // the compiler turns the loop into conditional moves.
+    static int upperBound(const Node *node, const KeyType &key)
+    {
+        const KeyType *base = node->keys;
+        int len = node->count;
+        if (len == 0)
+        {
+            return 0;
+        }
+        while (len > 1)
+        {
+            int half = len / 2;
+            base = (key < base[half]) ? base : base + half;
+            len -= half;
+        }
+        return (base - node->keys) + !(key < *base);
+    }
+
+    // Number of keys in node smaller than key
+    static int lowerBound(const Node *node, const KeyType &key)
+    {
+        const KeyType *base = node->keys;
+        int len = node->count;
+        if (len == 0)
+        {
+            return 0;
+        }
+        while (len > 1)
+        {
+            int half = len / 2;
+            base = (base[half] < key) ? base + half : base;
+            len -= half;
+        }
+        return (base - node->keys) + (*base < key);
+    }
+
+    // Opens slot index in an array holding count entries
+    template <typename T>
+    static void shiftRight(T *arr, int index, int count)
+    {
+        if constexpr (std::is_trivially_copyable<T>::value)
+        {
+            memmove(arr + index + 1, arr + index, (count - index) * sizeof(T));
+        }
+        else
+        {
+            std::move_backward(arr + index, arr + count, arr + count + 1);
+        }
+    }
+
+    // Closes slot index in an array holding count entries
+    template <typename T>
+    static void shiftLeft(T *arr, int index, int count)
+    {
+        if constexpr (std::is_trivially_copyable<T>::value)
+        {
+            memmove(arr + index, arr + index + 1, (count - index - 1) * sizeof(T));
+        }
+        else
+        {
+            std::move(arr + index + 1, arr + count, arr + index);
+        }
+    }
+
+    template <typename T>
+    static void copyRun(T *dest, const T *src, int n)
+    {
+        if constexpr (std::is_trivially_copyable<T>::value)
+        {
+            memcpy(dest, src, n * sizeof(T));
+        }
+        else
+        {
+            std::copy(src, src + n, dest);
+        }
+    }
+
+    // Leftmost leaf that can hold searchKey. A split can leave copies of a key on both sides of a separator equal
+    // to it, so searches go left on a tie and move right along the leaves from there.
+    Node *findLeafNode(const KeyType &searchKey)
+    {
+        Node *current = root;
+        while (current != nullptr && !current->isLeaf)
+        {
+            current = current->children[lowerBound(current, searchKey)];
+        }
+        return current;
+    }
+
+    // Inserts before any equal key and splits the leaf once it reaches order keys
+    void insertIntoLeaf(Node *leaf, const KeyType &key, const ValueType &value)
+    {
+        int index = lowerBound(leaf, key);
+        shiftRight(leaf->keys, index, leaf->count);
+        shiftRight(leaf->values, index, leaf->count);
+        leaf->keys[index] = key;
+        leaf->values[index] = value;
+        leaf->count++;
+
+        if (leaf->count >= order)
+        {
+            Node *newLeaf = splitLeaf(leaf);
+            insertIntoParent(leaf, newLeaf->keys[0], newLeaf);
+        }
+    }
+
+    Node *splitLeaf(Node *leaf)
+    {
+        int splitIndex = leaf->count / 2;
+        Node *newLeaf = new Node(true, order);
+
+        newLeaf->count = leaf->count - splitIndex;
+        copyRun(newLeaf->keys, leaf->keys + splitIndex, newLeaf->count);
+        copyRun(newLeaf->values, leaf->values + splitIndex, newLeaf->count);
+        leaf->count = splitIndex;
+
+        newLeaf->next = leaf->next;
+        newLeaf->prev = leaf;
+        leaf->next = newLeaf;
+        return newLeaf;
+    }
+
+    void insertIntoParent(Node *leftChild, const KeyType &key, Node *rightChild)
+    {
+        Node *parent = leftChild->parent;
+        if (parent == nullptr)
+        {
+            // Create a new root if the current node is the root
+            Node *newRoot = new Node(false, order);
+            newRoot->keys[0] = key;
+            newRoot->children[0] = leftChild;
+            newRoot->children[1] = rightChild;
+            newRoot->count = 1;
+
+            leftChild->parent = newRoot;
+            rightChild->parent = newRoot;
+            root = newRoot;
+            return;
+        }
+
+        // rightChild goes right after leftChild; with duplicate keys that is not always where key sorts
+        int index = lowerBound(parent, key);
+        while (parent->children[index] != leftChild)
+        {
+            index++;
+        }
+        shiftRight(parent->keys, index, parent->count);
+        shiftRight(parent->children, index + 1, parent->count + 1);
+        parent->keys[index] = key;
+        parent->children[index + 1] = rightChild;
+        parent->count++;
+        rightChild->parent = parent;
+
+        if (parent->count >= order)
+        {
+            // The middle key moves up; it stays in neither half
+            int splitIndex = parent->count / 2;
+            KeyType separator = parent->keys[splitIndex];
+
+            Node *newInternalNode = new Node(false, order);
+            newInternalNode->count = parent->count - splitIndex - 1;
+            copyRun(newInternalNode->keys, parent->keys + splitIndex + 1, newInternalNode->count);
+            copyRun(newInternalNode->children, parent->children + splitIndex + 1, newInternalNode->count + 1);
+            parent->count = splitIndex;
+
+            for (int i = 0; i <= newInternalNode->count; i++)
+            {
+                newInternalNode->children[i]->parent = newInternalNode;
+            }
+            insertIntoParent(parent, separator, newInternalNode);
+        }
+    }
+
+    // Latch crabbing, as in BPlusTree: exclusive latches from the root down, letting go of everything above a
+    // node that has room for one more key
+    void insertConcurrent(const KeyType &key, const ValueType &value)
+    {
+        std::vector<std::shared_timed_mutex *> held;
+        rootLatch.lock();
+        held.push_back(&rootLatch);
+
+        if (root == nullptr)
+        {
+            root = new Node(true, order);
+        }
+
+        Node *current = root;
+        while (true)
+        {
+            current->latch.lock();
+            if (current->count + 1 < order)
+            {
+                releaseLatches(held); // Safe node, nothing above it changes
+            }
+            held.push_back(&current->latch);
+
+            if (current->isLeaf)
+            {
+                break;
+            }
+            current = current->children[upperBound(current, key)];
+        }
+
+        insertIntoLeaf(current, key, value);
+        releaseLatches(held);
+    }
+
+    void releaseLatches(std::vector<std::shared_timed_mutex *> &held)
+    {
+        for (std::shared_timed_mutex *latch : held)
+        {
+            latch->unlock();
+        }
+        held.clear();
+    }
+
+    // Descends to the leaf findLeafNode would return with shared latches, hand over hand, and returns it still latched:
+    // exclusively if exclusiveLeaf is set, shared otherwise. Returns nullptr for an empty tree.
+    Node *findLeafLatched(const KeyType &searchKey, bool exclusiveLeaf)
+    {
+        rootLatch.lock_shared();
+        Node *current = root;
+        if (current == nullptr)
+        {
+            rootLatch.unlock_shared();
+            return nullptr;
+        }
+        (exclusiveLeaf && current->isLeaf) ? current->latch.lock() : current->latch.lock_shared();
+        rootLatch.unlock_shared();
+
+        while (!current->isLeaf)
+        {
+            Node *child = current->children[lowerBound(current, searchKey)];
+            (exclusiveLeaf && child->isLeaf) ? child->latch.lock() : child->latch.lock_shared();
+            current->latch.unlock_shared();
+            current = child;
+        }
+        return current;
+    }
+};
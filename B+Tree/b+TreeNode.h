@@ -1,6 +1,7 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <shared_mutex>
 
 using namespace std;
 
@@ -18,6 +19,8 @@ struct BPlusTreeNode
     BPlusTreeNode *next;   // Pointer to the next node in the linked list (only in leaf nodes)
     BPlusTreeNode *prev;   // Points to the previous leaf node
 
+    std::shared_timed_mutex latch; // Only taken when the tree runs in concurrent mode
+
     // Constructor with an optional parameter to specify whether the node is a leaf
     BPlusTreeNode(bool leaf = false) : isLeaf(leaf), parent(nullptr), next(nullptr) {}
 
@@ -0,0 +1,455 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "b+Tree.h"
+#include "bp_tree.cpp"
+#include "workload.cpp"
+#include "latency_histogram.cpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Multi-threaded mixed workload driver. For every thread count on the curve it builds a fresh tree, preloads it
+// with a workload's records, lets each thread run a warm-up of the same workload, then releases all threads at
+// once for the timed part and reports aggregate throughput and speedup over one thread.
+//
+//   bench_mt [--workload=A..F] [--distribution=uniform|zipfian|latest|hotspot] [--theta=T] [--ordered]
+//            [--read=P] [--update=P] [--insert=P] [--scan=P] [--rmw=P] [--scan-length=N]
+//            [--threads=N] [--preload=N] [--ops=N] [--warmup=N] [--seed=N] [--tree=bp|bplus|both] [--csv=PATH]
+//            [--record=PATH] [--filter-bits=N] [--filter-hashes=N]
+//
+// Without --workload the mix is 50 insert / 40 read / 10 scan over uniformly chosen keys. --workload starts
+// from one of the YCSB mixes, and the flags after it adjust it. The operation percentages are normalised, so
+// --insert=1 --read=1 is a 50/50 mix. --ops and --warmup are per thread. The curve is 1, 2, 4, ... threads up
+// to --threads, which defaults to the number of hardware threads. Every operation of the timed part is timed
+// into a per-thread histogram; each point prints the percentiles per operation type, and --csv writes the merged
+// histograms as tree,threads,op,latency_ns,count,percentile rows for plotting. --record=PATH traces every
+// operation of the BPTree at the last point of the curve, preload and warm-up included, for replay_trace.
+// --filter-bits gives every BPTree leaf a Bloom filter of that many bits probed --filter-hashes times (3 by
+// default), and each point then reports how many finds it answered and its false-positive rate.
+
+struct BenchConfig
+{
+    int max_threads = max(1, (int) thread::hardware_concurrency());
+    WorkloadSpec workload = default_workload();
+    long preload = 1000000;
+    long ops_per_thread = 200000;
+    long warmup_per_thread = 20000;
+    uint64_t seed = 42;
+    bool run_bp = true;
+    bool run_bplus = true;
+    string csv_path;
+    string record_path;
+
+    // BPTree and BPlusTree shapes, the same as the first experiment of test.cpp
+    int bp_order = 16;
+    int bp_log_size = 3;
+    int bp_num_blocks = 4;
+    int bp_block_size = 4;
+    int bplus_order = 256;
+    int filter_bits = 0;
+    int filter_hashes = 3;
+
+    static WorkloadSpec default_workload() {
+        WorkloadSpec spec;
+        spec.insert = 50;
+        spec.read = 40;
+        spec.update = 0;
+        spec.scan = 10;
+        spec.distribution = KeyDistribution::Uniform;
+        return spec;
+    }
+};
+
+const int num_op_kinds = 5;
+const char* op_names[num_op_kinds] = {"read", "update", "insert", "scan", "read-modify-write"};
+
+// What one thread did during the timed part, one histogram per WorkloadOp
+struct ThreadResult
+{
+    LatencyHistogram latency[num_op_kinds];
+    long scanned = 0;
+
+    long count(WorkloadOp op) const {
+        return (long) latency[(int) op].count();
+    }
+
+    void merge(const ThreadResult& other) {
+        for (int i = 0; i < num_op_kinds; i++)
+            latency[i].merge(other.latency[i]);
+        scanned += other.scanned;
+    }
+};
+
+struct RunResult
+{
+    int threads = 0;
+    double seconds = 0;
+    ThreadResult totals;
+
+    long ops() const {
+        long ops = 0;
+        for (int i = 0; i < num_op_kinds; i++)
+            ops += (long) totals.latency[i].count();
+        return ops;
+    }
+};
+
+// The same operations on either tree. Updates rewrite the value of the first element at or after the key in
+// place, scans only read and count the elements they visit. BPlusTree::find returns the leaf a key would be in
+// rather than a value, so finds are only counted, not checked.
+inline void bench_insert(BPTree<int, int>& tree, int key, int value) {
+    tree.insert(key, value);
+}
+
+inline void bench_find(BPTree<int, int>& tree, int key) {
+    tree.find(key);
+}
+
+inline void bench_update(BPTree<int, int>& tree, int key, int value) {
+    tree.iterate_range(key, 1, [value](int) { return value; });
+}
+
+// Copies the elements into per-thread scratch columns with scan_into, the read-only scan of a BPTree. A batch
+// that stops early on empty leaves is continued from its resume key.
+inline int bench_scan(BPTree<int, int>& tree, int start, int length) {
+    thread_local vector<int> keys, values;
+    if (keys.size() < (size_t) length) {
+        keys.resize(length);
+        values.resize(length);
+    }
+    int visited = 0;
+    while (visited < length) {
+        BPTreeScanBatch<int> batch = tree.scan_into(start, length - visited, keys.data(), values.data());
+        visited += (int) batch.count;
+        if (!batch.more)
+            break;
+        start = batch.resume;
+    }
+    return visited;
+}
+
+inline void bench_insert(BPlusTree<int, int>& tree, int key, int value) {
+    tree.insert(key, value);
+}
+
+inline void bench_find(BPlusTree<int, int>& tree, int key) {
+    tree.find(key);
+}
+
+inline void bench_update(BPlusTree<int, int>& tree, int key, int value) {
+    tree.iterate_range(key, 1, [value](const int&, int& old) { old = value; });
+}
+
+inline int bench_scan(BPlusTree<int, int>& tree, int start, int length) {
+    int visited = 0;
+    tree.iterate_range(start, length, [&visited](const int&, int&) { visited++; });
+    return visited;
+}
+
+// Zeroes a BPTree's latch profile and leaf filter counters once the warm-up is over, so that they cover the
+// timed part only
+inline void reset_tree_profile(BPTree<int, int>& tree) {
+    tree.reset_leaf_filter_stats();
+#ifdef BPTREE_LOCK_PROFILE
+    tree.reset_lock_profile();
+#endif
+}
+
+inline void reset_tree_profile(BPlusTree<int, int>&) {}
+
+// Attaches recorder to a BPTree, BPlusTree has no trace hook
+inline void attach_recorder(BPTree<int, int>& tree, BPTreeTraceRecorder<int, int>* recorder) {
+    tree.attach_trace(recorder);
+}
+
+inline void attach_recorder(BPlusTree<int, int>&, BPTreeTraceRecorder<int, int>*) {}
+
+// Internals of a BPTree after a run, preload included. The event counts need BPTREE_STATS, the latch profile
+// BPTREE_LOCK_PROFILE.
+inline void print_tree_stats(BPTree<int, int>& tree) {
+    BPTreeStats stats = tree.stats();
+    cout << "  height " << stats.height << ", " << stats.leaf_count << " leaves " << stats.average_fill * 100
+         << "% full, log " << stats.average_log_fill * 100 << "% full, " << stats.redistributions << " redistributions";
+    if (stats.counters_enabled) {
+        cout << " (" << stats.overflow_redistributions << " for lack of room), " << stats.log_flushes << " log flushes, "
+             << stats.leaf_splits << " leaf splits, " << stats.internal_splits << " internal splits, "
+             << stats.leaf_move_rights << " move-rights, " << stats.split_link_retries << " split link retries";
+    }
+    cout << endl;
+    LeafFilterStats filter = tree.leaf_filter_stats();
+    if (filter.lookups > 0) {
+        cout << "  leaf filters: " << filter.lookups << " finds, " << filter.rejected << " rejected, "
+             << filter.false_positives << " false positives, false-positive rate "
+             << filter.false_positive_rate() * 100 << "%" << endl;
+    }
+#ifdef BPTREE_LOCK_PROFILE
+    tree.lock_profile(5).print(cout);
+#endif
+}
+
+inline void print_tree_stats(BPlusTree<int, int>&) {}
+
+template <typename Tree>
+void run_ops(Tree& tree, WorkloadStream& stream, long count, ThreadResult& result) {
+    for (long i = 0; i < count; i++) {
+        WorkloadRequest request = stream.next();
+        int value = (int) i;
+        LatencyHistogram& latency = result.latency[(int) request.op];
+        switch (request.op) {
+        case WorkloadOp::Read:
+            time_op(latency, [&]() { bench_find(tree, request.key); });
+            break;
+        case WorkloadOp::Update:
+            time_op(latency, [&]() { bench_update(tree, request.key, value); });
+            break;
+        case WorkloadOp::Insert:
+            time_op(latency, [&]() { bench_insert(tree, request.key, value); });
+            break;
+        case WorkloadOp::Scan:
+            result.scanned += time_op(latency, [&]() { return bench_scan(tree, request.key, request.scan_length); });
+            break;
+        case WorkloadOp::ReadModifyWrite:
+            time_op(latency, [&]() {
+                bench_find(tree, request.key);
+                bench_update(tree, request.key, value);
+            });
+            break;
+        }
+    }
+}
+
+// One point of the scaling curve. Thread t always draws from seed + t + 1, so a given thread count replays the
+// same operations from run to run.
+template <typename Tree>
+RunResult run_threads(Tree& tree, WorkloadGenerator& workload, const BenchConfig& config, int num_threads) {
+    vector<ThreadResult> results(num_threads);
+    atomic<int> ready{0};
+    atomic<bool> go{false};
+
+    vector<thread> workers;
+    for (int t = 0; t < num_threads; t++) {
+        workers.emplace_back([&, t]() {
+            WorkloadStream stream(workload, config.seed + t + 1);
+            ThreadResult warmup;
+            run_ops(tree, stream, config.warmup_per_thread, warmup);
+
+            ready.fetch_add(1);
+            while (!go.load(memory_order_acquire))
+                this_thread::yield();
+            run_ops(tree, stream, config.ops_per_thread, results[t]);
+        });
+    }
+
+    while (ready.load() < num_threads)
+        this_thread::yield();
+    reset_tree_profile(tree);
+    auto start = steady_clock::now();
+    go.store(true, memory_order_release);
+    for (thread& worker : workers)
+        worker.join();
+    auto stop = steady_clock::now();
+
+    RunResult run;
+    run.threads = num_threads;
+    run.seconds = duration<double>(stop - start).count();
+    for (const ThreadResult& r : results)
+        run.totals.merge(r);
+    return run;
+}
+
+// Inserts the first config.preload records of the workload
+template <typename Tree>
+void preload(Tree& tree, WorkloadGenerator& workload, const BenchConfig& config) {
+    for (long i = 0; i < config.preload; i++)
+        bench_insert(tree, workload.key_of(workload.next_record()), (int) i);
+}
+
+vector<int> thread_counts(int max_threads) {
+    vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(max_threads);
+    return counts;
+}
+
+void print_run(const char* name, const RunResult& run, double base_throughput) {
+    double throughput = run.ops() / run.seconds;
+    cout << " " << name << " threads: " << run.threads
+         << " ops/s: " << (long) throughput
+         << " speedup: " << (base_throughput > 0 ? throughput / base_throughput : 1.0)
+         << " (" << run.totals.count(WorkloadOp::Scan) << " scans over " << run.totals.scanned << " elements, "
+         << (long) (run.seconds * 1000000) << " microseconds)" << endl;
+    for (int i = 0; i < num_op_kinds; i++) {
+        if (run.totals.latency[i].count() > 0)
+            run.totals.latency[i].print(cout, string("  ") + op_names[i]);
+    }
+}
+
+void write_run_csv(ostream& csv, const char* name, const RunResult& run) {
+    for (int i = 0; i < num_op_kinds; i++)
+        run.totals.latency[i].write_csv(csv, string(name) + "," + to_string(run.threads) + "," + op_names[i]);
+}
+
+// make_tree builds the tree for each point of the curve, so every point starts from the same preloaded state
+template <typename Tree, typename MakeTree>
+void run_curve(const char* name, const BenchConfig& config, ostream* csv, MakeTree make_tree) {
+    cout << "Scaling of " << name << ":" << endl;
+    double base_throughput = 0;
+    for (int n : thread_counts(config.max_threads)) {
+        Tree* tree = make_tree();
+        BPTreeTraceRecorder<int, int> recorder;
+        if (n == config.max_threads && !config.record_path.empty()) {
+            if (recorder.open(config.record_path.c_str()))
+                attach_recorder(*tree, &recorder);
+            else
+                cerr << "Cannot write " << config.record_path << endl;
+        }
+        WorkloadGenerator workload(config.workload);
+        preload(*tree, workload, config);
+        RunResult run = run_threads(*tree, workload, config, n);
+        attach_recorder(*tree, nullptr);
+
+        if (n == 1)
+            base_throughput = run.ops() / run.seconds;
+        print_run(name, run, base_throughput);
+        print_tree_stats(*tree);
+        delete tree;
+        if (csv != nullptr)
+            write_run_csv(*csv, name, run);
+    }
+}
+
+static bool parse_flag(const char* arg, const char* name, long& out) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    out = atol(arg + len + 1);
+    return true;
+}
+
+static const char* distribution_name(KeyDistribution distribution) {
+    switch (distribution) {
+    case KeyDistribution::Zipfian:
+        return "zipfian";
+    case KeyDistribution::Latest:
+        return "latest";
+    case KeyDistribution::Hotspot:
+        return "hotspot";
+    default:
+        return "uniform";
+    }
+}
+
+static bool parse_args(int argc, char** argv, BenchConfig& config) {
+    WorkloadSpec& spec = config.workload;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        long v;
+        if (strncmp(arg, "--workload=", 11) == 0 && strlen(arg) == 12)
+            spec = WorkloadSpec::ycsb(arg[11]);
+        else if (strncmp(arg, "--distribution=", 15) == 0) {
+            if (!parse_distribution(arg + 15, spec.distribution)) {
+                cerr << "Unknown distribution: " << arg + 15 << endl;
+                return false;
+            }
+        }
+        else if (strncmp(arg, "--theta=", 8) == 0)
+            spec.zipf_theta = atof(arg + 8);
+        else if (strcmp(arg, "--ordered") == 0)
+            spec.ordered_keys = true;
+        else if (parse_flag(arg, "--threads", v))
+            config.max_threads = (int) max(1l, v);
+        else if (parse_flag(arg, "--read", v))
+            spec.read = (int) max(0l, v);
+        else if (parse_flag(arg, "--update", v))
+            spec.update = (int) max(0l, v);
+        else if (parse_flag(arg, "--insert", v))
+            spec.insert = (int) max(0l, v);
+        else if (parse_flag(arg, "--scan", v))
+            spec.scan = (int) max(0l, v);
+        else if (parse_flag(arg, "--rmw", v))
+            spec.read_modify_write = (int) max(0l, v);
+        else if (parse_flag(arg, "--preload", v))
+            config.preload = max(0l, v);
+        else if (parse_flag(arg, "--ops", v))
+            config.ops_per_thread = max(0l, v);
+        else if (parse_flag(arg, "--warmup", v))
+            config.warmup_per_thread = max(0l, v);
+        else if (parse_flag(arg, "--scan-length", v))
+            spec.max_scan_length = (int) max(1l, v);
+        else if (parse_flag(arg, "--filter-bits", v))
+            config.filter_bits = (int) max(0l, v);
+        else if (parse_flag(arg, "--filter-hashes", v))
+            config.filter_hashes = (int) max(1l, v);
+        else if (parse_flag(arg, "--seed", v))
+            config.seed = (uint64_t) v;
+        else if (strncmp(arg, "--csv=", 6) == 0)
+            config.csv_path = arg + 6;
+        else if (strncmp(arg, "--record=", 9) == 0)
+            config.record_path = arg + 9;
+        else if (strcmp(arg, "--tree=bp") == 0)
+            config.run_bplus = false;
+        else if (strcmp(arg, "--tree=bplus") == 0)
+            config.run_bp = false;
+        else if (strcmp(arg, "--tree=both") != 0) {
+            cerr << "Unknown argument: " << arg << endl;
+            return false;
+        }
+    }
+    if (spec.read + spec.update + spec.insert + spec.scan + spec.read_modify_write == 0) {
+        cerr << "The operation mix is empty" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config))
+        return 1;
+
+    const WorkloadSpec& spec = config.workload;
+    cout << "Mix: " << spec.read << " read / " << spec.update << " update / " << spec.insert << " insert / "
+         << spec.scan << " scan of up to " << spec.max_scan_length << " / " << spec.read_modify_write
+         << " read-modify-write, " << distribution_name(spec.distribution) << " keys";
+    if (spec.distribution == KeyDistribution::Zipfian || spec.distribution == KeyDistribution::Latest)
+        cout << " (theta " << spec.zipf_theta << ")";
+    cout << ", preload " << config.preload << ", " << config.ops_per_thread << " ops per thread after "
+         << config.warmup_per_thread << " warm-up, seed " << config.seed << endl;
+
+    ofstream csv_file;
+    ostream* csv = nullptr;
+    if (!config.csv_path.empty()) {
+        csv_file.open(config.csv_path);
+        if (!csv_file) {
+            cerr << "Cannot write " << config.csv_path << endl;
+            return 1;
+        }
+        csv_file << "tree,threads,op," << LatencyHistogram::csv_columns() << "\n";
+        csv = &csv_file;
+    }
+
+    if (config.run_bp) {
+        run_curve<BPTree<int, int>>("BP Tree", config, csv, [&config]() {
+            BPTree<int, int>* tree = new BPTree<int, int>(config.bp_order, config.bp_log_size, config.bp_num_blocks, config.bp_block_size);
+            if (config.filter_bits > 0)
+                tree->set_leaf_filter(config.filter_bits, config.filter_hashes);
+            return tree;
+        });
+    }
+    if (config.run_bplus) {
+        run_curve<BPlusTree<int, int>>("B+ Tree", config, csv, [&config]() {
+            return new BPlusTree<int, int>(config.bplus_order, true);
+        });
+    }
+    return 0;
+}
@@ -1,9 +1,27 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <functional>
 #include <mutex>
 #include <shared_mutex> //Thread safety capabilities
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <type_traits>
+#include <climits>
 #include "../BPA/bpa.cpp"
+#include "../BPA/packed_keys.cpp"
+#include "bp_tree_snapshot.cpp"
+#include "bp_tree_wal.cpp"
+#include "work_stealing_pool.cpp"
+#include "bp_tree_filter.cpp"
+#include "bp_tree_keys.cpp"
+#include "bp_tree_geometry.cpp"
+#include "bp_tree_mvcc.cpp"
+#include "bp_tree_stats.cpp"
+#include "bp_tree_lock_profile.cpp"
+#include "bp_tree_trace.cpp"
+#include "bp_tree_space.cpp"
 
 using namespace std;
 
@@ -11,7 +29,7 @@ template <typename KeyType, typename ValueType>
 class BPTreeNode
 {
 public:
-    mutable shared_timed_mutex rw_lock; //R/W mutex for handling thread safety
+    mutable NodeLatch rw_lock; //R/W mutex for handling thread safety, a ProfiledLatch with BPTREE_LOCK_PROFILE
 
     virtual ~BPTreeNode() = default;
 };
@@ -21,9 +39,85 @@ class BPTreeNode_Internal: public BPTreeNode<KeyType, ValueType>
 {
 public:
     vector<BPTreeNode<KeyType, ValueType>*> children;
-    BPTreeNode_Internal<KeyType, ValueType>* parent = nullptr;
+    atomic<BPTreeNode_Internal<KeyType, ValueType>*> parent{nullptr}; // Followed without a lock to invalidate summaries
     
-    vector<KeyType> keys;
+    // Separators, held only as a packed run of narrow offsets for integral keys and as a plain vector otherwise.
+    // Read and changed through the members below; a change re-encodes the run, which splits and merges can afford.
+    typename conditional<is_integral<KeyType>::value, PackedKeyRun<KeyType>, vector<KeyType>>::type keys;
+
+    size_t num_keys() const {
+        return keys.size();
+    }
+
+    KeyType key_at(size_t i) const {
+        if constexpr (is_integral<KeyType>::value)
+            return keys.at(i);
+        else
+            return keys[i];
+    }
+
+    vector<KeyType> decoded_keys() const {
+        if constexpr (is_integral<KeyType>::value) {
+            vector<KeyType> out(keys.size());
+            keys.decode(out.data(), 0, keys.size());
+            return out;
+        } else {
+            return keys;
+        }
+    }
+
+    // Replaces the separators with sorted, under the write lock
+    void assign_keys(const vector<KeyType>& sorted) {
+        if constexpr (is_integral<KeyType>::value)
+            keys.encode(sorted.data(), sorted.size());
+        else
+            keys = sorted;
+    }
+
+    void insert_key(size_t pos, const KeyType& key) {
+        vector<KeyType> all = decoded_keys();
+        all.insert(all.begin() + pos, key);
+        assign_keys(all);
+    }
+
+    void erase_key(size_t pos) {
+        vector<KeyType> all = decoded_keys();
+        all.erase(all.begin() + pos);
+        assign_keys(all);
+    }
+
+    // Index of the child key is routed to
+    size_t route(const KeyType& key) const {
+        if constexpr (is_integral<KeyType>::value)
+            return keys.upper_bound_of(key);
+        else
+            return upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+    }
+
+    // Position of the first separator not below key
+    size_t key_position(const KeyType& key) const {
+        if constexpr (is_integral<KeyType>::value)
+            return keys.lower_bound_of(key);
+        else
+            return lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    }
+
+    size_t key_bytes() const {
+        if constexpr (is_integral<KeyType>::value)
+            return keys.bytes() - sizeof(keys);
+        else
+            return keys.capacity() * sizeof(KeyType);
+    }
+
+    // Cached aggregate of the subtree, computed for the key range given by the bounds. Writers below this node
+    // set summary_dirty; a range_aggregate covering the whole node recomputes it from the children if it is set.
+    atomic<bool> summary_dirty{true};
+    mutex summary_mutex;
+    RangeAggregate<ValueType> summary;
+    bool summary_has_low = false;
+    bool summary_has_high = false;
+    KeyType summary_low;
+    KeyType summary_high;
 
     virtual ~BPTreeNode_Internal() = default;
 };
@@ -40,283 +134,1930 @@ public:
 
     int num_elts = 0; //Size of the number of elements in the array, including duplicates
 
+    // Every key in this leaf is below high_key, unless this is the rightmost leaf. A lookup that reaches a leaf
+    // just split by another thread finds its key has moved right by checking this.
+    bool has_high = false;
+    KeyType high_key;
+
+    LeafBloomFilter<KeyType> filter; // Keys held, so that misses can skip the BPA; unused unless configured
+    KeyArena arena; // Bytes of the out-of-line keys stored in bpa, stays empty for plain keys
+
+    // Operations seen since the geometry was last chosen, only counted while the tree has a geometry policy
+    atomic<uint32_t> inserts{0};
+    atomic<uint32_t> finds{0};
+    atomic<uint32_t> scans{0};
+
+    // A leaf no one has inserted into for a while is frozen: its contents move to cold, a compact sorted copy,
+    // and bpa gives up its arrays until the next insert thaws it. The methods below work on either form.
+    unique_ptr<ColdLeaf<KeyType, ValueType>> cold;
+    RangeAggregate<ValueType> cold_summary;
+    uint64_t last_insert = 0; // Maintenance round of the last insert
+
+    // For read views: when the leaf was split off its left neighbour and when its contents last changed, with
+    // the older contents still visible to some view
+    uint64_t created_ts = 0;
+    uint64_t mod_ts = 0;
+    LeafVersion<KeyType, ValueType>* versions = nullptr;
+
+    // When compaction merged the leaf into its right neighbour, 0 while it is live. A retired leaf stays on the
+    // leaf chain, empty, for operations that reached it before and for read views older than the merge.
+    atomic<uint64_t> retired_ts{0};
+
     //Constructor
-    BPTreeNode_Leaf(int log_size, int num_blocks, int block_size) : bpa(log_size, num_blocks, block_size) {}
+    BPTreeNode_Leaf(int log_size, int num_blocks, int block_size, MemoryPolicy* memory = nullptr) : bpa(log_size, num_blocks, block_size, NULL, memory) {}
+
+    virtual ~BPTreeNode_Leaf() {
+        drop_versions(versions);
+    }
+
+    static void drop_versions(LeafVersion<KeyType, ValueType>* version) {
+        while (version != nullptr) {
+            LeafVersion<KeyType, ValueType>* older = version->older;
+            delete version;
+            version = older;
+        }
+    }
+
+    // True if prune_versions would drop anything
+    bool has_stale_versions(uint64_t oldest_view) const {
+        LeafVersion<KeyType, ValueType>* version = versions;
+        while (version != nullptr && version->older != nullptr)
+            version = version->older;
+        return version != nullptr && version->end_ts <= oldest_view;
+    }
+
+    // Drops the versions that ended at or before oldest_view, under the write lock
+    void prune_versions(uint64_t oldest_view) {
+        LeafVersion<KeyType, ValueType>** link = &versions;
+        while (*link != nullptr && (*link)->end_ts > oldest_view)
+            link = &(*link)->older;
+        drop_versions(*link);
+        *link = nullptr;
+    }
+
+    // Appends the contents as a view taken at ts sees them, under the read lock. The leaf must have existed then.
+    void collect_at(uint64_t ts, vector<ElementBPA<KeyType, ValueType>>& out) {
+        if (mod_ts <= ts) {
+            collect_sorted(out);
+            return;
+        }
+        for (LeafVersion<KeyType, ValueType>* version = versions; version != nullptr; version = version->older) {
+            if (version->start_ts <= ts && ts < version->end_ts) {
+                out.insert(out.end(), version->elts.begin(), version->elts.end());
+                return;
+            }
+        }
+    }
+
+    bool frozen() const {
+        return cold != nullptr;
+    }
+
+    bool retired() const {
+        return retired_ts.load(memory_order_acquire) != 0;
+    }
 
-    virtual ~BPTreeNode_Leaf() = default;
+    // Empties the leaf once its contents were merged elsewhere, under the write lock and after stamp_write. It is
+    // left frozen with nothing in it, so every read finds it empty, and its BPA arrays are freed right away.
+    void retire() {
+        bpa.release();
+        cold.reset(new ColdLeaf<KeyType, ValueType>());
+        cold_summary = RangeAggregate<ValueType>();
+        num_elts = 0;
+        filter.configure(0, 0);
+        retired_ts.store(mod_ts, memory_order_release);
+    }
+
+    // Bytes of the old contents kept for read views
+    size_t version_bytes() const {
+        size_t bytes = 0;
+        for (LeafVersion<KeyType, ValueType>* version = versions; version != nullptr; version = version->older)
+            bytes += sizeof(*version) + version->elts.capacity() * sizeof(ElementBPA<KeyType, ValueType>);
+        return bytes;
+    }
+
+    // Everything the leaf holds, itself included
+    size_t footprint() const {
+        return sizeof(*this) + bpa.allocated_bytes() + (frozen() ? cold->bytes() : 0) + version_bytes()
+            + arena.bytes_reserved() + filter.bytes();
+    }
+
+    // Moves the contents into the cold form, under the write lock
+    void freeze() {
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        bpa.collect_sorted(elts);
+        cold.reset(new ColdLeaf<KeyType, ValueType>());
+        cold->build(elts.data(), elts.size(), bpa.block_size);
+        num_elts = elts.size();
+        summarize_cold();
+        bpa.release();
+    }
+
+    // Moves the contents back into a BPA of the geometry the leaf had, under the write lock
+    void thaw() {
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        cold->unpack(elts);
+        bpa.reset(bpa.log_size, bpa.num_blocks, bpa.block_size);
+        bpa.load_sorted(elts.data(), elts.size());
+        num_elts = elts.size();
+        cold.reset();
+    }
+
+    void summarize_cold() {
+        if constexpr (is_arithmetic<ValueType>::value) {
+            cold_summary = RangeAggregate<ValueType>();
+            KeyType first;
+            if (cold->min_key(first))
+                cold->scan_from(first, cold->size(), [&](const KeyType&, ValueType& value) { cold_summary.add(value); });
+        }
+    }
+
+    ValueType* find(const KeyType& key) {
+        return frozen() ? cold->find(key) : bpa.find(key);
+    }
+
+    void collect_sorted(vector<ElementBPA<KeyType, ValueType>>& out) {
+        if (frozen())
+            cold->unpack(out);
+        else
+            bpa.collect_sorted(out);
+    }
+
+    bool min_key(KeyType& out) {
+        return frozen() ? cold->min_key(out) : bpa.min_key(out);
+    }
+
+    // Writes up to limit live elements with a key of at least start to keys and values, under the read lock
+    int copy_from(const KeyType& start, int limit, KeyType* keys, ValueType* values, vector<ElementBPA<KeyType, ValueType>>& scratch) {
+        if (frozen())
+            return (int) cold->copy_from(start, limit, keys, values);
+        return bpa.copy_from(start, limit, keys, values, scratch);
+    }
+
+    // Values are rewritten in place, a frozen leaf stays frozen
+    int iterate_range(KeyType start, int length, function<ValueType(KeyType)> f) {
+        if (!frozen())
+            return bpa.iterate_range(start, length, f);
+        int visited = cold->scan_from(start, length, [&](const KeyType& key, ValueType& value) { value = f(key); });
+        if (visited > 0)
+            summarize_cold();
+        return visited;
+    }
+
+    int map_between(KeyType low, KeyType high, function<ValueType(KeyType)> f) {
+        if (!frozen())
+            return bpa.map_between(low, high, f);
+        int touched = cold->scan(low, high, [&](const KeyType& key, ValueType& value) { value = f(key); });
+        if (touched > 0)
+            summarize_cold();
+        return touched;
+    }
+
+    RangeAggregate<ValueType> summary() {
+        return frozen() ? cold_summary : bpa.summary();
+    }
+
+    // Aggregate over the values with a key in [*low, *high), a null bound leaves that side open
+    RangeAggregate<ValueType> aggregate_between(const KeyType* low, const KeyType* high) {
+        if (!frozen())
+            return bpa.aggregate_between(low, high);
+
+        RangeAggregate<ValueType> result;
+        KeyType first;
+        if ((low == nullptr && high == nullptr) || !cold->min_key(first))
+            return cold_summary;
+        if (low != nullptr)
+            first = *low;
+        auto add = [&](const KeyType&, ValueType& value) { result.add(value); };
+        if (high == nullptr)
+            cold->scan_from(first, cold->size(), add);
+        else
+            cold->scan(first, *high, add);
+        return result;
+    }
+};
+
+// What one BPTree::scan_into call wrote
+template <typename KeyType>
+struct BPTreeScanBatch
+{
+    size_t count = 0;  // Entries written to the caller's arrays
+    bool more = false; // False if the scan reached the end of the tree
+    KeyType resume;    // Start of the next batch if more is set: the first key not written, or a bound below it
 };
 
 
 template <typename KeyType, typename ValueType>
 class BPTree {
 private:
-    BPTreeNode<KeyType, ValueType> *root;
+    atomic<BPTreeNode<KeyType, ValueType>*> root; // Swapped without a lock when a split grows the tree
     int order; // Order of the B+ tree
 
     int bpa_log_size;
     int bpa_num_blocks;
     int bpa_block_size;
 
+    MemoryPolicy* memory; // Where leaves get their BPA arrays, the heap if null
+
+    vector<pair<KeyType, BPTreeNode<KeyType, ValueType>*>> bulk_nodes; // Nodes of the level being built bottom-up, with their minimum keys
+    vector<ElementBPA<KeyType, ValueType>> bulk_pending; // Appended elements not yet making up a full leaf
+
+    BPTreeSnapshot<KeyType, ValueType>* snapshot = nullptr; // Mapped snapshot serving reads until the first write
+    atomic<bool> snapshot_active{false};
+    mutex snapshot_mutex;
+
+    BPTreeWAL<KeyType, ValueType>* wal = nullptr; // Optional log every insert is written to before it is applied
+    BPTreeTraceRecorder<KeyType, ValueType>* trace = nullptr; // Optional recorder of inserts, finds and ranges
+
+    atomic<BPAGeometryPolicy*> geometry_policy{nullptr}; // Picks each leaf's geometry from its workload, or null for a fixed one
+
+    // Bloom filter size per leaf, 0 if leaves carry no filter. set_leaf_filter may change them while splits read
+    // them; a leaf that picks up a stale pair still holds a filter of all its keys, just not of the new size.
+    atomic<int> filter_bits{0};
+    atomic<int> filter_hashes{0};
+    atomic<uint64_t> filter_lookups{0};
+    atomic<uint64_t> filter_rejected{0};
+    atomic<uint64_t> filter_false_positives{0};
+
+    atomic<uint64_t> maintenance_round{0}; // Number of maintenance passes run, the clock leaves freeze by
+
+    ReadViewRegistry read_views;
+
+    // Leaves compact_leaves merged away go through three lists: retired, still on the leaf chain for older read
+    // views; unlinked, off the chain; draining, waiting for every operation that might still hold them to end.
+    OperationPhases phases;
+    mutex compaction_mutex; // One compaction at a time, guards the lists
+    vector<BPTreeNode_Leaf<KeyType, ValueType>*> retired_leaves;
+    vector<BPTreeNode_Leaf<KeyType, ValueType>*> unlinked_leaves;
+    vector<BPTreeNode_Leaf<KeyType, ValueType>*> draining_leaves;
+    vector<KeyArena> replaced_arenas; // Key arenas compaction rebuilt, freed along with the leaves
+    vector<KeyArena> draining_arenas;
+    bool drained[2] = {false, false}; // Phases seen quiet since draining_leaves was filled
+
+    SplitLatch split_mutex; // Serializes changes to internal nodes, so pess_descent sees stable node sizes
+
+#ifdef BPTREE_STATS
+    BPTreeEventCounters events;
+#endif
+
+    mutex separator_mutex;
+    KeyArena separator_arena; // Out-of-line bytes of separators and leaf high keys, which outlive any one leaf
+
     // Helper method to traverse tree until you reach a leaf node
     BPTreeNode_Leaf<KeyType, ValueType>* traverse(KeyType key) {
-        if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(root) != nullptr) //check if the root is a leaf node already
-            return dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(root);
+        BPTreeNode<KeyType, ValueType>* probe_node = root.load(memory_order_acquire);
+        if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node) != nullptr) //check if the root is a leaf node already
+            return dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node);
         
-        BPTreeNode_Internal<KeyType, ValueType>* curr_node = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(root) ;
-        BPTreeNode<KeyType, ValueType>* probe_node = root;
-        curr_node->rw_lock.lock_shared();
+        BPTreeNode_Internal<KeyType, ValueType>* curr_node;
+        probe_node->rw_lock.lock_shared();
 
         while (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node) == nullptr) {
             curr_node = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(probe_node);
-            probe_node = curr_node->children[curr_node->children.size() - 1];
-            for (int i = 0; i < curr_node->keys.size(); i++) {
-                if (key < curr_node->keys[i]) {
-                    probe_node = curr_node->children[i];
-                    probe_node->rw_lock.lock_shared(); // Hand-over-hand locking
-                    curr_node->rw_lock.unlock_shared();
+            probe_node = curr_node->children[curr_node->route(key)];
+            probe_node->rw_lock.lock_shared(); // Hand-over-hand locking
+            curr_node->rw_lock.unlock_shared();
+        }
 
+        probe_node->rw_lock.unlock_shared();
+        return dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node);
+    }
+
+    // Same as traverse, but always follows the leftmost child
+    BPTreeNode_Leaf<KeyType, ValueType>* leftmost_leaf() {
+        BPTreeNode<KeyType, ValueType>* probe_node = root.load(memory_order_acquire);
+        probe_node->rw_lock.lock_shared();
+
+        while (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node) == nullptr) {
+            BPTreeNode_Internal<KeyType, ValueType>* curr_node = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(probe_node);
+            probe_node = curr_node->children[0];
+            probe_node->rw_lock.lock_shared(); // Hand-over-hand locking
+            curr_node->rw_lock.unlock_shared();
+        }
+
+        probe_node->rw_lock.unlock_shared();
+        return dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node);
+    }
+
+    // Finds the leaf for key and returns it locked, moving right past any leaf that was split or merged away
+    // after traverse left it but before the lock was taken
+    BPTreeNode_Leaf<KeyType, ValueType>* lock_leaf(KeyType key, bool exclusive) {
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(key);
+        (exclusive) ? leaf->rw_lock.lock() : leaf->rw_lock.lock_shared();
+        while (leaf->retired() || (leaf->has_high && !(key < leaf->high_key))) {
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            BPTREE_STAT(events.add(BPTreeEvent::LeafMoveRight));
+            (exclusive) ? next->rw_lock.lock() : next->rw_lock.lock_shared(); // Hand-over-hand locking
+            (exclusive) ? leaf->rw_lock.unlock() : leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        return leaf;
+    }
+
+    // Refills the filter of leaf from its contents, leaf must be write-locked
+    void rebuild_filter(BPTreeNode_Leaf<KeyType, ValueType>* leaf, const vector<ElementBPA<KeyType, ValueType>>& elts) {
+        int bits = filter_bits.load(memory_order_relaxed);
+        if (bits == 0) {
+            if (leaf->filter.enabled())
+                leaf->filter.configure(0, 0);
+            return;
+        }
+        leaf->filter.configure(bits, filter_hashes.load(memory_order_relaxed));
+        for (const ElementBPA<KeyType, ValueType>& elt : elts)
+            leaf->filter.add(elt.key);
+    }
+
+    // Asks the policy for leaf's next geometry and starts a new sample. Leaf must be write-locked.
+    BPAGeometry choose_geometry(BPTreeNode_Leaf<KeyType, ValueType>* leaf) {
+        BPAGeometry current = {leaf->bpa.log_size, leaf->bpa.num_blocks, leaf->bpa.block_size};
+        BPAGeometryPolicy* policy = geometry_policy.load(memory_order_acquire);
+        if (policy == nullptr)
+            return current;
+
+        LeafWorkloadSample sample;
+        sample.inserts = leaf->inserts.exchange(0, memory_order_relaxed);
+        sample.finds = leaf->finds.exchange(0, memory_order_relaxed);
+        sample.scans = leaf->scans.exchange(0, memory_order_relaxed);
+        sample.num_elts = leaf->num_elts;
+        BPAGeometry chosen = policy->choose(current, sample);
+        if (chosen.log_size < 1 || chosen.num_blocks < 1 || chosen.block_size < 0)
+            return current;
+        return chosen;
+    }
+
+    // Called with leaf write-locked before its contents change. Stamps the change with the current time and, if
+    // a read view taken since the last change is open, first saves the contents that view has to keep seeing.
+    void stamp_write(BPTreeNode_Leaf<KeyType, ValueType>* leaf) {
+        uint64_t now = read_views.now();
+        if (now > leaf->mod_ts && read_views.any_active()) {
+            LeafVersion<KeyType, ValueType>* version = new LeafVersion<KeyType, ValueType>();
+            version->start_ts = leaf->mod_ts;
+            version->end_ts = now;
+            leaf->collect_sorted(version->elts);
+            version->older = leaf->versions;
+            leaf->versions = version;
+        }
+        leaf->mod_ts = now;
+        if (leaf->versions != nullptr)
+            leaf->prune_versions(read_views.oldest_active());
+    }
+
+    // Copy of key that stays valid for the life of the tree, for use as a separator
+    KeyType stable_key(const KeyType& key) {
+        if constexpr (KeyTraits<KeyType>::out_of_line) {
+            lock_guard<mutex> guard(separator_mutex);
+            return KeyTraits<KeyType>::intern(key, separator_arena);
+        }
+        return key;
+    }
+
+    // Marks the cached summaries of node and its ancestors stale after a write below them. Called with the leaf
+    // that changed still locked, so that a summary computed from its old contents is always marked.
+    void invalidate_summaries(BPTreeNode_Internal<KeyType, ValueType>* node) {
+        while (node != nullptr) {
+            if (!node->summary_dirty.load())
+                node->summary_dirty.store(true);
+            node = node->parent.load();
+        }
+    }
+
+    // Lower and upper bounds of two key ranges intersected, a null bound is open
+    static const KeyType* max_bound(const KeyType* a, const KeyType* b) {
+        return (a == nullptr || (b != nullptr && *a < *b)) ? b : a;
+    }
+
+    static const KeyType* min_bound(const KeyType* a, const KeyType* b) {
+        return (a == nullptr || (b != nullptr && *b < *a)) ? b : a;
+    }
+
+    // Aggregates the values in [*low, *high) held by leaf and by the leaves split off it that its parent does not
+    // list yet. leaf_low is the lowest key the parent routes to leaf; a leaf lying wholly inside the range is
+    // summed from its block summaries.
+    RangeAggregate<ValueType> aggregate_leaves(BPTreeNode_Leaf<KeyType, ValueType>* leaf, const KeyType* leaf_low, const KeyType* low, const KeyType* high) {
+        RangeAggregate<ValueType> result;
+        bool has_leaf_low = leaf_low != nullptr;
+        KeyType leaf_low_key{};
+        if (has_leaf_low)
+            leaf_low_key = *leaf_low;
+
+        leaf->rw_lock.lock_shared();
+        while (true) {
+            bool covers_low = low == nullptr || (has_leaf_low && !(leaf_low_key < *low));
+            bool covers_high = high == nullptr || (leaf->has_high && !(*high < leaf->high_key));
+            result.merge((covers_low && covers_high) ? leaf->summary() : leaf->aggregate_between(low, high));
+
+            // A retired leaf was merged into the next one, which now starts where it did
+            if (!leaf->retired()) {
+                if (!leaf->has_high || (high != nullptr && !(leaf->high_key < *high)))
                     break;
+                has_leaf_low = true;
+                leaf_low_key = leaf->high_key;
+            }
+
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            next->rw_lock.lock_shared(); // Hand-over-hand locking
+            leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        leaf->rw_lock.unlock_shared();
+        return result;
+    }
+
+    // Summary of everything below node, which routes the keys in [*low, *high). Uses the cached summary if nothing
+    // changed below since it was computed for the same bounds. node must be locked shared.
+    RangeAggregate<ValueType> subtree_summary(BPTreeNode_Internal<KeyType, ValueType>* node, const KeyType* low, const KeyType* high) {
+        lock_guard<mutex> guard(node->summary_mutex);
+        bool same_bounds = node->summary_has_low == (low != nullptr) && node->summary_has_high == (high != nullptr)
+            && (low == nullptr || node->summary_low == *low) && (high == nullptr || node->summary_high == *high);
+        if (same_bounds && !node->summary_dirty.load())
+            return node->summary;
+
+        // Cleared before the children are read, so a write landing while they are summed leaves it set again
+        node->summary_dirty.store(false);
+        RangeAggregate<ValueType> result;
+        vector<KeyType> separators = node->decoded_keys();
+        for (size_t i = 0; i < node->children.size(); i++) {
+            const KeyType* child_low = (i > 0) ? &separators[i-1] : low;
+            const KeyType* child_high = (i < separators.size()) ? &separators[i] : high;
+
+            BPTreeNode<KeyType, ValueType>* child = node->children[i];
+            if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child) != nullptr) {
+                result.merge(aggregate_leaves(dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child), child_low, child_low, child_high));
+            } else {
+                BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(child);
+                internal->rw_lock.lock_shared();
+                result.merge(subtree_summary(internal, child_low, child_high));
+                internal->rw_lock.unlock_shared();
+            }
+        }
+
+        node->summary = result;
+        node->summary_has_low = low != nullptr;
+        node->summary_has_high = high != nullptr;
+        if (low != nullptr)
+            node->summary_low = *low;
+        if (high != nullptr)
+            node->summary_high = *high;
+        return result;
+    }
+
+    // Aggregates the values in [lo, hi) below node, which routes the keys in [*low, *high). Children lying wholly
+    // inside the range are answered from their summaries, only the boundary leaves are read element by element.
+    RangeAggregate<ValueType> aggregate_node(BPTreeNode<KeyType, ValueType>* node, const KeyType* low, const KeyType* high, const KeyType& lo, const KeyType& hi) {
+        if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(node) != nullptr)
+            return aggregate_leaves(dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(node), low, max_bound(low, &lo), min_bound(high, &hi));
+
+        BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(node);
+        RangeAggregate<ValueType> result;
+        internal->rw_lock.lock_shared();
+        if (low != nullptr && !(*low < lo) && high != nullptr && !(hi < *high)) {
+            result = subtree_summary(internal, low, high);
+        } else {
+            vector<KeyType> separators = internal->decoded_keys();
+            for (size_t i = 0; i < internal->children.size(); i++) {
+                const KeyType* child_low = (i > 0) ? &separators[i-1] : low;
+                const KeyType* child_high = (i < separators.size()) ? &separators[i] : high;
+                if ((child_high != nullptr && !(lo < *child_high)) || (child_low != nullptr && !(*child_low < hi)))
+                    continue;
+                result.merge(aggregate_node(internal->children[i], child_low, child_high, lo, hi));
+            }
+        }
+        internal->rw_lock.unlock_shared();
+        return result;
+    }
+
+    // Number of elements placed in each leaf by a bottom-up build, half of a BPA so that later inserts have room
+    int leaf_fill() {
+        return max(1, (bpa_num_blocks * bpa_block_size) / 2);
+    }
+
+    // Bottom-up build: appends a new rightmost leaf holding n sorted elements, all above any key appended before
+    void bulk_append_leaf(const ElementBPA<KeyType, ValueType>* elts, int n) {
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = allocate_leaf(bpa_log_size, bpa_num_blocks, bpa_block_size);
+        if constexpr (KeyTraits<KeyType>::out_of_line) {
+            vector<ElementBPA<KeyType, ValueType>> interned(elts, elts + n);
+            for (ElementBPA<KeyType, ValueType>& elt : interned)
+                elt.key = KeyTraits<KeyType>::intern(elt.key, leaf->arena);
+            leaf->bpa.load_sorted(interned.data(), n);
+        } else {
+            leaf->bpa.load_sorted(elts, n);
+        }
+        leaf->num_elts = n;
+        int bits = filter_bits.load(memory_order_relaxed);
+        if (bits > 0) {
+            leaf->filter.configure(bits, filter_hashes.load(memory_order_relaxed));
+            for (int i = 0; i < n; i++)
+                leaf->filter.add(elts[i].key);
+        }
+
+        KeyType low = stable_key(elts[0].key);
+        if (!bulk_nodes.empty()) {
+            BPTreeNode_Leaf<KeyType, ValueType>* prev = dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(bulk_nodes.back().second);
+            prev->next = leaf;
+            prev->has_high = true;
+            prev->high_key = low;
+            leaf->prev = prev;
+        }
+        bulk_nodes.push_back({low, leaf});
+    }
+
+    // Bottom-up build: stacks internal levels over the appended leaves and installs the result as the root
+    void bulk_build_levels() {
+        if (bulk_nodes.empty()) {
+            root = allocate_leaf(bpa_log_size, bpa_num_blocks, bpa_block_size);
+            return;
+        }
+
+        // Internal nodes start about half full, like the ones produced by split_internal_node
+        size_t fanout = max(2, order / 2 + 1);
+        while (bulk_nodes.size() > 1) {
+            vector<pair<KeyType, BPTreeNode<KeyType, ValueType>*>> parents;
+            size_t i = 0;
+            while (i < bulk_nodes.size()) {
+                size_t end = min(bulk_nodes.size(), i + fanout);
+                if (bulk_nodes.size() - end == 1) // Never leave a single child for the last node
+                    end++;
+
+                BPTreeNode_Internal<KeyType, ValueType>* node = new BPTreeNode_Internal<KeyType, ValueType>();
+                vector<KeyType> separators;
+                for (size_t j = i; j < end; j++) {
+                    BPTreeNode<KeyType, ValueType>* child = bulk_nodes[j].second;
+                    if (j > i)
+                        separators.push_back(bulk_nodes[j].first);
+                    node->children.push_back(child);
+
+                    if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child) != nullptr)
+                        dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child)->parent = node;
+                    else
+                        dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(child)->parent = node;
                 }
+                node->assign_keys(separators);
+                parents.push_back({bulk_nodes[i].first, node});
+                i = end;
             }
+            bulk_nodes.swap(parents);
         }
 
-        probe_node->rw_lock.unlock_shared();
-        return dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node);
+        root = bulk_nodes[0].second;
+        bulk_nodes.clear();
     }
 
-    // Helper method for gaining all locks down to the internal node being split
+    // Rebuilds the mutable node layout from the mapped snapshot. Runs once, on the first operation that writes.
+    // load_snapshot validated every leaf record, so the walk reads them all and bulk_append gets sorted keys.
+    void materialize() {
+        lock_guard<mutex> guard(snapshot_mutex);
+        if (!snapshot_active.load())
+            return;
+
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        snapshot->for_each_leaf([&](const KeyType* keys, const ValueType* values, uint64_t count) {
+            elts.resize(count);
+            for (uint64_t i = 0; i < count; i++) {
+                elts[i].isNull = false;
+                elts[i].key = keys[i];
+                elts[i].value = values[i];
+            }
+            bulk_append(elts.data(), count);
+        });
+        bulk_finish();
+
+        snapshot_active.store(false, memory_order_release);
+    }
+
+    // Leaf objects come from memory as well when one is given, so that a leaf sits on the same pages as its
+    // BPA arrays. Internal nodes stay on the heap.
+    BPTreeNode_Leaf<KeyType, ValueType>* allocate_leaf(int log_size, int num_blocks, int block_size) {
+        if (memory == nullptr)
+            return new BPTreeNode_Leaf<KeyType, ValueType>(log_size, num_blocks, block_size);
+        static_assert(alignof(BPTreeNode_Leaf<KeyType, ValueType>) <= 64, "MemoryPolicy aligns to 64 bytes");
+        void* place = memory->allocate(sizeof(BPTreeNode_Leaf<KeyType, ValueType>));
+        try {
+            return new (place) BPTreeNode_Leaf<KeyType, ValueType>(log_size, num_blocks, block_size, memory);
+        } catch (...) {
+            memory->deallocate(place, sizeof(BPTreeNode_Leaf<KeyType, ValueType>));
+            throw;
+        }
+    }
+
+    void free_leaf(BPTreeNode_Leaf<KeyType, ValueType>* leaf) {
+        if (memory == nullptr) {
+            delete leaf;
+            return;
+        }
+        leaf->~BPTreeNode_Leaf();
+        memory->deallocate(leaf, sizeof(BPTreeNode_Leaf<KeyType, ValueType>));
+    }
+
+    // Frees node and every node below it. A leaf compaction merged away is no longer below any node.
+    void free_subtree(BPTreeNode<KeyType, ValueType>* node) {
+        BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(node);
+        if (internal == nullptr) {
+            free_leaf(dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(node));
+            return;
+        }
+        for (BPTreeNode<KeyType, ValueType>* child : internal->children)
+            free_subtree(child);
+        delete internal;
+    }
+
+    // Helper method for gaining all locks down to the internal node being split, called under split_mutex
     void pess_descent(BPTreeNode_Internal<KeyType, ValueType>* node) {
         if (node->parent != nullptr && node->children.size() == order - 1) //Only have to take this node's parent's lock if a split is going to happen
             pess_descent(node->parent);
         node->rw_lock.lock();
     }
 
+    // Rewrites leaf to hold exactly elts, sorted and without duplicates, in whichever form it is in. Called under
+    // the write lock, after stamp_write if elts differ from what the leaf holds.
+    void repack_leaf(BPTreeNode_Leaf<KeyType, ValueType>* leaf, const vector<ElementBPA<KeyType, ValueType>>& elts) {
+        if (leaf->frozen()) {
+            leaf->cold.reset(new ColdLeaf<KeyType, ValueType>()); // A fresh one, so that no spare capacity is kept
+            leaf->cold->build(elts.data(), elts.size(), leaf->bpa.block_size);
+            leaf->summarize_cold();
+        } else {
+            leaf->bpa.load_sorted(elts.data(), elts.size());
+        }
+        leaf->num_elts = elts.size();
+        rebuild_filter(leaf, elts);
+        invalidate_summaries(leaf->parent);
+    }
+
+    // Empties leaf into its right neighbour and drops it from their parent, if the two still share a parent and
+    // the neighbour's BPA can take both at no more than max_fill. Locks split_mutex, the parent and then both
+    // leaves left to right, like a split. Returns the neighbour, or null without changing anything if the leaves
+    // no longer qualify.
+    BPTreeNode_Leaf<KeyType, ValueType>* merge_into_next(BPTreeNode_Leaf<KeyType, ValueType>* leaf, double max_fill) {
+        unique_lock<SplitLatch> guard(split_mutex);
+        leaf->rw_lock.lock_shared();
+        BPTreeNode_Internal<KeyType, ValueType>* parent = leaf->parent; // Only changes under split_mutex once set
+        leaf->rw_lock.unlock_shared();
+        if (parent == nullptr)
+            return nullptr;
+
+        parent->rw_lock.lock();
+        leaf->rw_lock.lock();
+        size_t i = std::find(parent->children.begin(), parent->children.end(), leaf) - parent->children.begin();
+        BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+        // A next that is not the parent's following child was split off and is not linked yet
+        if (leaf->retired() || i + 1 >= parent->children.size() || parent->children[i + 1] != next) {
+            leaf->rw_lock.unlock();
+            parent->rw_lock.unlock();
+            return nullptr;
+        }
+        next->rw_lock.lock();
+
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        leaf->collect_sorted(elts);
+        size_t moved = elts.size();
+        next->collect_sorted(elts);
+        if (elts.size() > min(max_fill, 1.0) * next->bpa.total_size) {
+            next->rw_lock.unlock();
+            leaf->rw_lock.unlock();
+            parent->rw_lock.unlock();
+            return nullptr;
+        }
+
+        // Both change at the same timestamp, so a read view sees either both old contents or both new ones
+        stamp_write(leaf);
+        stamp_write(next);
+        if constexpr (KeyTraits<KeyType>::out_of_line) {
+            for (size_t j = 0; j < moved; j++)
+                elts[j].key = KeyTraits<KeyType>::intern(elts[j].key, next->arena);
+        }
+        repack_leaf(next, elts);
+        next->last_insert = max(next->last_insert, leaf->last_insert);
+        leaf->retire();
+
+        // next now takes the keys routed to leaf; leaf stays on the chain for anyone who already reached it
+        parent->children.erase(parent->children.begin() + i);
+        parent->erase_key(i);
+        invalidate_summaries(parent);
+        BPTREE_STAT(events.add(BPTreeEvent::LeafMerge));
+
+        next->rw_lock.unlock();
+        leaf->rw_lock.unlock();
+        parent->rw_lock.unlock();
+        return next;
+    }
+
+    // Takes the retired leaves no read view can see any more off the leaf chain. Called under compaction_mutex.
+    int unlink_retired() {
+        uint64_t oldest_view = read_views.oldest_active();
+        int unlinked = 0;
+        for (size_t i = 0; i < retired_leaves.size();) {
+            BPTreeNode_Leaf<KeyType, ValueType>* leaf = retired_leaves[i];
+            if (leaf->retired_ts.load() > oldest_view) {
+                i++;
+                continue;
+            }
+
+            // Left to right like everyone else; prev can only change while prev is unlocked, so check it again
+            BPTreeNode_Leaf<KeyType, ValueType>* prev;
+            while (true) {
+                leaf->rw_lock.lock_shared();
+                prev = leaf->prev;
+                leaf->rw_lock.unlock_shared();
+                if (prev != nullptr)
+                    prev->rw_lock.lock();
+                leaf->rw_lock.lock();
+                if (leaf->prev == prev)
+                    break;
+                leaf->rw_lock.unlock();
+                if (prev != nullptr)
+                    prev->rw_lock.unlock();
+            }
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next; // Never null, the leaf merged into it
+            next->rw_lock.lock();
+            if (prev != nullptr)
+                prev->next = next;
+            next->prev = prev;
+            next->rw_lock.unlock();
+            leaf->rw_lock.unlock();
+            if (prev != nullptr)
+                prev->rw_lock.unlock();
+
+            unlinked_leaves.push_back(leaf);
+            retired_leaves[i] = retired_leaves.back();
+            retired_leaves.pop_back();
+            unlinked++;
+        }
+        return unlinked;
+    }
+
+    // Deletes unlinked leaves once every operation that could still hold one has ended. Each batch waits for both
+    // phases of OperationPhases to be seen empty, flipping the phase once so that new operations stop entering the
+    // one it waits on. Never blocks: whatever is not yet safe is left for the next call. Called under
+    // compaction_mutex and outside any OperationPhases::Scope, or it would wait on itself.
+    int free_drained() {
+        if (draining_leaves.empty() && draining_arenas.empty()) {
+            if (unlinked_leaves.empty() && replaced_arenas.empty())
+                return 0;
+            draining_leaves.swap(unlinked_leaves);
+            draining_arenas.swap(replaced_arenas);
+            drained[0] = drained[1] = false;
+        }
+
+        drained[0] = drained[0] || phases.quiet(0);
+        drained[1] = drained[1] || phases.quiet(1);
+        int current = phases.current();
+        if (!drained[current]) {
+            phases.advance();
+            drained[current] = phases.quiet(current);
+        }
+        if (!drained[0] || !drained[1])
+            return 0;
+
+        int freed = draining_leaves.size();
+        for (BPTreeNode_Leaf<KeyType, ValueType>* leaf : draining_leaves)
+            free_leaf(leaf);
+        draining_leaves.clear();
+        draining_arenas.clear();
+        return freed;
+    }
+
+    // True if more than half of leaf's key arena holds bytes of keys it no longer stores, left behind by splits,
+    // and no older version of the leaf still points into it. elts are the live contents, leaf is locked.
+    bool arena_wasted(BPTreeNode_Leaf<KeyType, ValueType>* leaf, const vector<ElementBPA<KeyType, ValueType>>& elts) {
+        if (!KeyTraits<KeyType>::out_of_line || leaf->versions != nullptr || leaf->arena.bytes_reserved() <= KeyArena::default_chunk)
+            return false;
+        size_t live = 0;
+        for (const ElementBPA<KeyType, ValueType>& elt : elts)
+            live += KeyTraits<KeyType>::arena_bytes(elt.key);
+        return leaf->arena.bytes_used() > 2 * live;
+    }
+
+    // Moves the keys of elts into a fresh arena for leaf, under the write lock. The old one is freed like a
+    // merged leaf, once no operation can still hold a key copied out of it. Called under compaction_mutex.
+    void rebuild_arena(BPTreeNode_Leaf<KeyType, ValueType>* leaf, vector<ElementBPA<KeyType, ValueType>>& elts) {
+        KeyArena fresh;
+        for (ElementBPA<KeyType, ValueType>& elt : elts)
+            elt.key = KeyTraits<KeyType>::intern(elt.key, fresh);
+        swap(leaf->arena, fresh);
+        replaced_arenas.push_back(move(fresh));
+    }
+
 public:
-    //Constructor
-    BPTree (int order, int log_size, int num_blocks, int block_size) : order(order), bpa_log_size(log_size), bpa_num_blocks(num_blocks), bpa_block_size(block_size) {
-        root = new BPTreeNode_Leaf<KeyType, ValueType>(log_size, num_blocks, block_size);
+    //Constructor. Leaf storage comes from memory if one is given, e.g. a PageSlab for huge pages or NUMA
+    //placement; the caller keeps it alive for as long as the tree.
+    BPTree (int order, int log_size, int num_blocks, int block_size, MemoryPolicy* memory = nullptr) : order(order), bpa_log_size(log_size), bpa_num_blocks(num_blocks), bpa_block_size(block_size), memory(memory) {
+        root = allocate_leaf(log_size, num_blocks, block_size);
     }
 
-    void insert(KeyType key, ValueType value) {
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(key);
+    // Frees every node, the leaves compaction merged away and the mapped snapshot. No other thread may still
+    // be using the tree.
+    ~BPTree () {
+        free_subtree(root.load());
+        for (pair<KeyType, BPTreeNode<KeyType, ValueType>*>& node : bulk_nodes)
+            free_subtree(node.second);
+        for (vector<BPTreeNode_Leaf<KeyType, ValueType>*>* list : {&retired_leaves, &unlinked_leaves, &draining_leaves}) {
+            for (BPTreeNode_Leaf<KeyType, ValueType>* leaf : *list)
+                free_leaf(leaf);
+        }
+        delete snapshot;
+    }
+
+    BPTree (const BPTree&) = delete;
+    BPTree& operator= (const BPTree&) = delete;
+
+    // Inserts key, or overwrites its value. Returns false only if an attached WAL failed before the insert was
+    // durable, or with sync_commit off before it was handed to the log; the tree holds the insert either way.
+    bool insert(KeyType key, ValueType value) {
+        uint64_t lsn = apply_insert(key, value);
+        if constexpr (!KeyTraits<KeyType>::out_of_line) {
+            // Waits with the leaf released, so inserts into the same leaf can join the batch being flushed
+            if (lsn != 0)
+                return wal->sync_commit() ? wal->wait_durable(lsn) : !wal->has_failed();
+        }
+        return true;
+    }
 
-        //if (leaf->parent !=nullptr)
-        //    leaf->parent->rw_lock.lock_shared();
-        leaf->rw_lock.lock(); //Write lock
+    // Applies one insert and returns its WAL sequence number, 0 if it was not logged
+    uint64_t apply_insert(KeyType key, ValueType value) {
+        OperationPhases::Scope scope(phases); // Keeps every leaf this call reaches from being freed under it
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(key, true); //Write lock
+        // Logged under the leaf latch, so the log and the trace hold the inserts of each key in the order applied
+        uint64_t lsn = 0;
+        if constexpr (!KeyTraits<KeyType>::out_of_line) {
+            if (wal != nullptr)
+                lsn = wal->log(key, value);
+            if (trace != nullptr)
+                trace->record_insert(key, value);
+        }
+        if (leaf->frozen()) {
+            leaf->thaw();
+            BPTREE_STAT(events.add(BPTreeEvent::Thaw));
+        }
+        if constexpr (KeyTraits<KeyType>::out_of_line) {
+            // An overwrite reuses the copy the leaf already holds, so updates do not grow the arena
+            ElementBPA<KeyType, ValueType>* held = leaf->bpa.find_element(key);
+            key = (held != nullptr) ? held->key : KeyTraits<KeyType>::intern(key, leaf->arena);
+        }
+        leaf->last_insert = maintenance_round.load(memory_order_relaxed);
+        stamp_write(leaf);
+
+        if (geometry_policy != nullptr)
+            leaf->inserts.fetch_add(1, memory_order_relaxed);
 
         //Can insert into the BPA without issues
         if (leaf->num_elts < leaf->bpa.total_size) {
+            int redistributions = leaf->bpa.redistributions;
             leaf->bpa.insert(key, value);
+            leaf->filter.add(key);
             leaf->num_elts++;
-            if (leaf->parent !=nullptr)
-                leaf->parent->rw_lock.unlock_shared();
+            invalidate_summaries(leaf->parent);
+
+            // The BPA just reorganised itself anyway, a good moment to move it to the geometry its workload calls for
+            if (geometry_policy != nullptr && leaf->bpa.redistributions != redistributions) {
+                BPAGeometry chosen = choose_geometry(leaf);
+                if (chosen.capacity() > leaf->num_elts)
+                    leaf->bpa.reshape(chosen.log_size, chosen.num_blocks, chosen.block_size);
+            }
             leaf->rw_lock.unlock(); //Write lock
-            return;
+            return lsn;
         }
 
-        // BPA is full, so must split it
-        
+        // BPA is full, so must split it. The leaf keeps the lower half of its keys and a new leaf to its right
+        // takes the upper half; readers already past the parent find the moved keys through high_key.
         vector<ElementBPA<KeyType, ValueType>> bpa_elts;
-
-        for (int i = 0; i < leaf->num_elts; i++)
-            bpa_elts.push_back(leaf->bpa.header_ptr[i]);
-        sort(bpa_elts.begin(), bpa_elts.end(), greater<ElementBPA<KeyType, ValueType>>());
-
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf_one = new BPTreeNode_Leaf<KeyType, ValueType>(bpa_log_size, bpa_num_blocks, bpa_block_size);
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf_two = new BPTreeNode_Leaf<KeyType, ValueType>(bpa_log_size, bpa_num_blocks, bpa_block_size);
+        leaf->bpa.collect_sorted(bpa_elts);
+        BPTREE_STAT(events.add(BPTreeEvent::LeafSplit));
+
+        ElementBPA<KeyType, ValueType> elt;
+        elt.isNull = false;
+        elt.key = key;
+        elt.value = value;
+        auto spot = lower_bound(bpa_elts.begin(), bpa_elts.end(), elt, [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key < b.key;
+        });
+        if (spot != bpa_elts.end() && spot->key == key)
+            spot->value = value;
+        else
+            bpa_elts.insert(spot, elt);
+
+        int half = bpa_elts.size() / 2;
+        KeyType divider = stable_key(bpa_elts[half].key);
+
+        // Both halves take the geometry the leaf's workload calls for, if it can hold them
+        BPAGeometry geometry = choose_geometry(leaf);
+        if (geometry.capacity() < (int) bpa_elts.size() - half)
+            geometry = {leaf->bpa.log_size, leaf->bpa.num_blocks, leaf->bpa.block_size};
+
+        // The upper half moves to the new leaf's arena; its old bytes stay behind in this leaf's arena until
+        // compact_leaves rebuilds it
+        BPTreeNode_Leaf<KeyType, ValueType>* new_leaf = allocate_leaf(geometry.log_size, geometry.num_blocks, geometry.block_size);
+        if constexpr (KeyTraits<KeyType>::out_of_line) {
+            for (size_t i = half; i < bpa_elts.size(); i++)
+                bpa_elts[i].key = KeyTraits<KeyType>::intern(bpa_elts[i].key, new_leaf->arena);
+        }
+        new_leaf->bpa.load_sorted(bpa_elts.data() + half, bpa_elts.size() - half);
+        new_leaf->num_elts = bpa_elts.size() - half;
+        new_leaf->last_insert = leaf->last_insert;
+        new_leaf->created_ts = new_leaf->mod_ts = leaf->mod_ts;
+        rebuild_filter(new_leaf, vector<ElementBPA<KeyType, ValueType>>(bpa_elts.begin() + half, bpa_elts.end()));
+        new_leaf->has_high = leaf->has_high;
+        new_leaf->high_key = leaf->high_key;
+        new_leaf->parent = leaf->parent;
+        new_leaf->prev = leaf;
+        new_leaf->next = leaf->next;
+
+        bpa_elts.resize(half);
+        if (!(geometry == BPAGeometry{leaf->bpa.log_size, leaf->bpa.num_blocks, leaf->bpa.block_size}))
+            leaf->bpa.reset(geometry.log_size, geometry.num_blocks, geometry.block_size);
+        leaf->bpa.load_sorted(bpa_elts.data(), half);
+        leaf->num_elts = half;
+        rebuild_filter(leaf, bpa_elts);
+        leaf->has_high = true;
+        leaf->high_key = divider;
+        invalidate_summaries(leaf->parent);
+
+        if (leaf->next != nullptr) {
+            leaf->next->rw_lock.lock(); // Left to right, same order as scans
+            leaf->next->prev = new_leaf;
+            leaf->next->rw_lock.unlock();
+        }
+        leaf->next = new_leaf;
 
         // Edge case where leaf is also the root, create a new internal node as the root
         if (leaf->parent == nullptr) {
             BPTreeNode_Internal<KeyType, ValueType>* new_node = new BPTreeNode_Internal<KeyType, ValueType>();
-            new_node->rw_lock.lock();
+            new_node->children.push_back(leaf);
+            new_node->children.push_back(new_leaf);
+            new_node->assign_keys({divider});
+            leaf->parent = new_node;
+            new_leaf->parent = new_node;
             root = new_node;
+            BPTREE_STAT(events.add(BPTreeEvent::RootSplit));
+            leaf->rw_lock.unlock();
+            return lsn;
+        }
 
-            leaf_one->rw_lock.lock();
-            leaf_two->rw_lock.lock();
+        // Normal case, the parent gains the new leaf right after the old one. The leaf is released before any
+        // internal node is locked, so a descent holding the parent and waiting on the leaf cannot deadlock with us.
+        leaf->rw_lock.unlock();
+        unique_lock<SplitLatch> guard(split_mutex);
+
+        // Until the insert that created this leaf has linked it into its parent, the leaf cannot be found there
+        BPTreeNode_Internal<KeyType, ValueType>* parent;
+        size_t split;
+        while (true) {
+            parent = leaf->parent;
+            for (split = 0; split < parent->children.size(); split++) {
+                if (parent->children[split] == leaf)
+                    break;
+            }
+            if (split < parent->children.size())
+                break;
+            BPTREE_STAT(events.add(BPTreeEvent::SplitLinkRetry));
+            guard.unlock();
+            this_thread::yield();
+            guard.lock();
+        }
 
-            leaf_one->next = leaf_two;
-            leaf_one->parent = new_node;
-            leaf_two->prev = leaf_one;
-            leaf_two->parent = new_node;
+        // Another split of the same leaf may have been linked first, so the new leaf goes by its key, not next to the leaf
+        pess_descent(parent);
+        split = parent->key_position(divider);
+        parent->children.insert(parent->children.begin() + split + 1, new_leaf);
+        parent->insert_key(split, divider);
+        set_parent(new_leaf, parent);
+
+        //Uh oh time for a split!!!
+        if ((int) parent->children.size() == order)
+            split_internal_node(parent);
+        else
+            parent->rw_lock.unlock();
+        return lsn;
+    }
 
-            new_node->children.push_back(leaf_one);
-            new_node->children.push_back(leaf_two);
+    // Re-parents child during a split. Leaves read their parent under their own lock, so they are locked for it.
+    void set_parent(BPTreeNode<KeyType, ValueType>* child, BPTreeNode_Internal<KeyType, ValueType>* parent) {
+        if (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child) != nullptr) {
+            BPTreeNode_Leaf<KeyType, ValueType>* leaf = dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(child);
+            leaf->rw_lock.lock();
+            leaf->parent = parent;
+            leaf->rw_lock.unlock();
+        } else {
+            dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(child)->parent = parent;
+        }
+    }
 
-            new_node->keys.push_back(bpa_elts[bpa_elts.size() / 2].key);
+    // Splits a full internal node in two around its middle key. Runs under split_mutex with the node and every
+    // ancestor that will split write-locked by pess_descent, and releases them as it goes.
+    void split_internal_node(BPTreeNode_Internal<KeyType, ValueType>* node) {
+        vector<KeyType> separators = node->decoded_keys();
+        int splitIndex = separators.size() / 2;
+        KeyType divider = separators[splitIndex];
+        BPTREE_STAT(events.add(BPTreeEvent::InternalSplit));
 
-            new_node->rw_lock.unlock();
-            leaf_one->rw_lock.unlock();
-            leaf_two->rw_lock.unlock();
-        }
-        // Normal case, no need to create new root node
-        else {
+        //For  efficiency we just reuse the old node for the left half
+        BPTreeNode_Internal<KeyType, ValueType> *new_node = new BPTreeNode_Internal<KeyType, ValueType>();
+        new_node->assign_keys(vector<KeyType>(separators.begin() + splitIndex + 1, separators.end()));
+        new_node->children.assign(node->children.begin() + splitIndex + 1, node->children.end());
+        separators.resize(splitIndex);
+        node->assign_keys(separators);
+        node->children.erase(node->children.begin() + splitIndex + 1, node->children.end());
 
-            leaf_one->rw_lock.lock();
-            leaf_two->rw_lock.lock();
+        for (BPTreeNode<KeyType, ValueType>* child : new_node->children)
+            set_parent(child, new_node);
 
-            leaf_one->prev = leaf->prev;
-            leaf_one->parent = leaf->parent;
-            leaf_one->next = leaf_two;
-            leaf_one->prev = leaf_one;
-            leaf_one->parent = leaf->parent;
-            leaf_one->next = leaf->next;
+        BPTreeNode_Internal<KeyType, ValueType>* parent = node->parent;
 
-            // Get the index at which the original leaf was at
-            int split;
-            for (split = 0; split < leaf->parent->children.size(); split++) {
-                if (leaf->parent->children[split] == leaf) {
-                    leaf->parent->children.erase(leaf->parent->children.begin() + split);
-                    leaf->parent->children.insert(leaf->parent->children.begin() + split, leaf_one);
-                    leaf->parent->children.insert(leaf->parent->children.begin() + split + 1, leaf_two);
-                    break;
-                }
+        // Root node, need to create a new root
+        if (parent == nullptr) {
+            BPTreeNode_Internal<KeyType, ValueType>* new_root = new BPTreeNode_Internal<KeyType, ValueType>();
+            new_root->children.push_back(node);
+            new_root->children.push_back(new_node);
+            new_root->assign_keys({divider});
+            node->parent = new_root;
+            new_node->parent = new_root;
+            root = new_root;
+            BPTREE_STAT(events.add(BPTreeEvent::RootSplit));
+            node->rw_lock.unlock();
+            return;
+        }
 
+        size_t split;
+        for (split = 0; split < parent->children.size(); split++) {
+            if (parent->children[split] == node)
+                break;
+        }
+        parent->children.insert(parent->children.begin() + split + 1, new_node);
+        parent->insert_key(split, divider);
+        new_node->parent = parent;
+        node->rw_lock.unlock();
+
+        //Uh oh time for a split!!! again!!!!!!!!!!!!!!!
+        if ((int) parent->children.size() == order)
+            split_internal_node(parent);
+        else
+            parent->rw_lock.unlock();
+    }
+
+    ValueType* find(KeyType key) {
+        OperationPhases::Scope scope(phases);
+        if constexpr (!KeyTraits<KeyType>::out_of_line) {
+            if (trace != nullptr)
+                trace->record_find(key);
+        }
+        if (snapshot_active.load(memory_order_acquire))
+            return snapshot->find(key);
+
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(key, false);
+        if (geometry_policy != nullptr)
+            leaf->finds.fetch_add(1, memory_order_relaxed);
+
+        ValueType* val;
+        if (!leaf->filter.enabled()) {
+            val = leaf->find(key);
+        } else {
+            filter_lookups.fetch_add(1, memory_order_relaxed);
+            if (!leaf->filter.may_contain(key)) {
+                filter_rejected.fetch_add(1, memory_order_relaxed);
+                val = nullptr;
+            } else {
+                val = leaf->find(key);
+                if (val == nullptr)
+                    filter_false_positives.fetch_add(1, memory_order_relaxed);
             }
+        }
+        leaf->rw_lock.unlock_shared();
+        return val;
+    }
 
-            //Insert the first key in the righht leaf as the new divider key
-            leaf->parent->keys.insert(leaf->parent->keys.begin() + split, leaf_two->bpa.header_ptr[0].key);
+    // Count, sum, min and max of the values with a key in [lo, hi). Internal nodes keep cached summaries of their
+    // subtrees, so only the two boundary leaves are read in full and the cost grows with the height of the tree
+    // rather than with the size of the range. ValueType must be arithmetic.
+    RangeAggregate<ValueType> range_aggregate(KeyType lo, KeyType hi) {
+        OperationPhases::Scope scope(phases);
+        static_assert(is_arithmetic<ValueType>::value, "range_aggregate sums values");
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+        if (!(lo < hi))
+            return RangeAggregate<ValueType>();
+        return aggregate_node(root.load(memory_order_acquire), nullptr, nullptr, lo, hi);
+    }
 
+    // Gives every leaf a Bloom filter of bits_per_leaf bits probed num_hashes times, so that find can answer
+    // most misses without scanning the BPA. Existing leaves are rebuilt one at a time, so other threads may keep
+    // using the tree meanwhile; 0 bits turns filters off.
+    void set_leaf_filter(int bits_per_leaf, int num_hashes) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        filter_hashes.store(max(1, num_hashes), memory_order_relaxed);
+        filter_bits.store(max(0, bits_per_leaf), memory_order_relaxed);
+
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = leftmost_leaf();
+        leaf->rw_lock.lock();
+        while (leaf != nullptr) {
+            elts.clear();
+            leaf->collect_sorted(elts);
+            if (!leaf->retired())
+                rebuild_filter(leaf, elts);
+
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (next != nullptr)
+                next->rw_lock.lock(); // Hand-over-hand locking
             leaf->rw_lock.unlock();
-            leaf_one->rw_lock.unlock();
-            leaf_two->rw_lock.unlock();
+            leaf = next;
+        }
+        reset_leaf_filter_stats();
+    }
 
-            //Uh oh time for a split!!!
-            if (leaf->parent->children.size() == order) {
-                split_internal_node(leaf->parent, true);
+    LeafFilterStats leaf_filter_stats() const {
+        LeafFilterStats stats;
+        stats.lookups = filter_lookups.load(memory_order_relaxed);
+        stats.rejected = filter_rejected.load(memory_order_relaxed);
+        stats.false_positives = filter_false_positives.load(memory_order_relaxed);
+        return stats;
+    }
+
+    void reset_leaf_filter_stats() {
+        filter_lookups.store(0, memory_order_relaxed);
+        filter_rejected.store(0, memory_order_relaxed);
+        filter_false_positives.store(0, memory_order_relaxed);
+    }
+
+#ifdef BPTREE_LOCK_PROFILE
+    // Latch statistics of every node, summed per depth and mode, plus the top_n nodes with the longest total wait.
+    // Nodes are found with a walk that bypasses the profiling; it is exact when no split runs meanwhile.
+    LockProfile lock_profile(int top_n = 10) {
+        OperationPhases::Scope scope(phases);
+        LockProfile profile;
+        profile.split_mutex = split_mutex.stats(LatchMode::Exclusive);
+
+        vector<BPTreeNode<KeyType, ValueType>*> level{root.load(memory_order_acquire)};
+        vector<BPTreeNode<KeyType, ValueType>*> below;
+        for (int depth = 0; !level.empty(); depth++) {
+            profile.shared_by_depth.emplace_back();
+            profile.exclusive_by_depth.emplace_back();
+            below.clear();
+            for (BPTreeNode<KeyType, ValueType>* node : level) {
+                NodeLatchProfile entry;
+                entry.node = node;
+                entry.depth = depth;
+                entry.modes[0] = node->rw_lock.stats(LatchMode::Shared);
+                entry.modes[1] = node->rw_lock.stats(LatchMode::Exclusive);
+                profile.shared_by_depth[depth].add(entry.modes[0]);
+                profile.exclusive_by_depth[depth].add(entry.modes[1]);
+
+                BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(node);
+                entry.leaf = (internal == nullptr);
+                if (internal != nullptr) {
+                    internal->rw_lock.native().lock_shared();
+                    below.insert(below.end(), internal->children.begin(), internal->children.end());
+                    internal->rw_lock.native().unlock_shared();
+                }
+                if (entry.wait_ns() > 0)
+                    profile.hottest.push_back(entry);
             }
+            swap(level, below);
         }
 
-        leaf_one->rw_lock.lock();
-        leaf_two->rw_lock.lock();
+        sort(profile.hottest.begin(), profile.hottest.end(), [](const NodeLatchProfile& a, const NodeLatchProfile& b) {
+            return a.wait_ns() > b.wait_ns();
+        });
+        if ((int) profile.hottest.size() > top_n)
+            profile.hottest.resize(max(top_n, 0));
+        return profile;
+    }
 
-        //Redistributing the values from the original BPA into the two in a way such that
-        for(int i = 0; i < bpa_elts.size() / 2; i++) {
-            leaf_one->bpa.insert(bpa_elts[(i % bpa_num_blocks) * bpa_num_blocks + (i / bpa_num_blocks)]);
-            leaf_one->num_elts++;
-            leaf_two->bpa.insert(bpa_elts[(i % bpa_num_blocks) * bpa_num_blocks + (i / bpa_num_blocks) + bpa_elts.size() / 2]);
-            leaf_two->num_elts++;
+    // Zeroes the latch statistics, e.g. after loading the tree so that only the workload that follows is profiled
+    void reset_lock_profile() {
+        split_mutex.reset();
+        vector<BPTreeNode<KeyType, ValueType>*> level{root.load(memory_order_acquire)};
+        vector<BPTreeNode<KeyType, ValueType>*> below;
+        while (!level.empty()) {
+            below.clear();
+            for (BPTreeNode<KeyType, ValueType>* node : level) {
+                node->rw_lock.reset();
+                BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(node);
+                if (internal != nullptr) {
+                    internal->rw_lock.native().lock_shared();
+                    below.insert(below.end(), internal->children.begin(), internal->children.end());
+                    internal->rw_lock.native().unlock_shared();
+                }
+            }
+            swap(level, below);
         }
-
-        if (bpa_elts.size() % 2 == 1) {
-            leaf_two->bpa.insert(bpa_elts[bpa_elts.size() - 1]);
-            leaf_two->num_elts++;
+    }
+#endif
+
+    // Event counts, which need BPTREE_STATS, and the shape of the tree. Walks every leaf under shared
+    // hand-over-hand locks, so the shape is consistent per leaf but not across leaves while writers run.
+    BPTreeStats stats() {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTreeStats stats;
+#ifdef BPTREE_STATS
+        stats.counters_enabled = true;
+        stats.leaf_splits = events.total(BPTreeEvent::LeafSplit);
+        stats.internal_splits = events.total(BPTreeEvent::InternalSplit);
+        stats.root_splits = events.total(BPTreeEvent::RootSplit);
+        stats.leaf_move_rights = events.total(BPTreeEvent::LeafMoveRight);
+        stats.split_link_retries = events.total(BPTreeEvent::SplitLinkRetry);
+        stats.exclusive_scans = events.total(BPTreeEvent::ExclusiveScan);
+        stats.shared_scans = events.total(BPTreeEvent::SharedScan);
+        stats.freezes = events.total(BPTreeEvent::Freeze);
+        stats.thaws = events.total(BPTreeEvent::Thaw);
+        stats.leaf_merges = events.total(BPTreeEvent::LeafMerge);
+#endif
+
+        BPTreeNode<KeyType, ValueType>* probe_node = root.load(memory_order_acquire);
+        probe_node->rw_lock.lock_shared();
+        stats.height = 1;
+        while (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node) == nullptr) {
+            BPTreeNode_Internal<KeyType, ValueType>* curr_node = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(probe_node);
+            probe_node = curr_node->children[0];
+            probe_node->rw_lock.lock_shared(); // Hand-over-hand locking
+            curr_node->rw_lock.unlock_shared();
+            stats.height++;
         }
 
-        leaf = (key >= bpa_elts[bpa_elts.size() / 2].key) ? leaf_two : leaf_one;
-
-        leaf->bpa.insert(key, value); 
-        leaf->num_elts++;
+        size_t capacity = 0;
+        size_t log_slots = 0;
+        size_t log_used = 0;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(probe_node);
+        while (leaf != nullptr) {
+            if (leaf->retired()) {
+                BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+                next->rw_lock.lock_shared(); // A retired leaf always has a right neighbour
+                leaf->rw_lock.unlock_shared();
+                leaf = next;
+                continue;
+            }
+            stats.leaf_count++;
+            stats.elements += leaf->num_elts;
+            capacity += leaf->bpa.total_size;
+            stats.log_flushes += leaf->bpa.log_flushes;
+            stats.redistributions += leaf->bpa.redistributions;
+            stats.overflow_redistributions += leaf->bpa.overflow_redistributions;
+            if (leaf->frozen()) {
+                stats.frozen_leaves++;
+            } else {
+                log_slots += leaf->bpa.log_size;
+                log_used += leaf->bpa.log_fill();
+            }
 
-        leaf_one->rw_lock.unlock();
-        leaf_two->rw_lock.unlock();
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (next != nullptr)
+                next->rw_lock.lock_shared(); // Hand-over-hand locking
+            leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        stats.average_fill = capacity == 0 ? 0 : (double) stats.elements / capacity;
+        stats.average_log_fill = log_slots == 0 ? 0 : (double) log_used / log_slots;
+        return stats;
     }
 
-    void split_internal_node(BPTreeNode_Internal<KeyType, ValueType>* node, bool first_split = false) {
+    // Pins the current contents of the tree for scan_view. Writers carry on meanwhile; each leaf they change
+    // keeps a copy of its old contents until every view that can see it has ended. Pair with end_read.
+    ReadView begin_read() {
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+        ReadView view;
+        view.ts = read_views.begin();
+        return view;
+    }
 
-        if (first_split)
-            pess_descent(node);
-        int splitIndex = node->keys.size() / 2;
+    void end_read(const ReadView& view) {
+        read_views.end(view.ts);
+    }
 
-        BPTreeNode_Internal<KeyType, ValueType> *new_node = new BPTreeNode_Internal<KeyType, ValueType>();
-        new_node->rw_lock.lock();
+    // Hands f up to length elements starting at key start, as they were when view was taken, and returns how many
+    // it saw. Leaves are read one at a time under a brief shared lock and f runs with none held, so a long scan
+    // neither blocks writers nor sees any write that came after the view.
+    int scan_view (const ReadView& view, KeyType start, int length, function<void(KeyType, ValueType)> f) {
+        OperationPhases::Scope scope(phases);
+        BPTREE_STAT(events.add(BPTreeEvent::SharedScan));
+        if constexpr (!KeyTraits<KeyType>::out_of_line) {
+            if (trace != nullptr)
+                trace->record_range(start, length);
+        }
+        int num_to_process = length;
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(start, false);
+
+        // A leaf split off after the view holds nothing the view can see by itself; what it holds then was still
+        // in the leaf it was split from, somewhere to its left. Likewise, keys that a merge after the view moved
+        // into this leaf are still, for the view, in the retired leaf to its left.
+        while (true) {
+            BPTreeNode_Leaf<KeyType, ValueType>* prev = leaf->prev;
+            bool back = leaf->created_ts > view.ts;
+            if (!back && prev != nullptr && prev->retired_ts.load(memory_order_acquire) > view.ts)
+                back = start < prev->high_key; // A retired leaf's high key no longer changes
+            if (!back)
+                break;
+            leaf->rw_lock.unlock_shared();
+            leaf = prev;
+            leaf->rw_lock.lock_shared();
+        }
 
-        // Root node, need to create a new root
-        if(node->parent == nullptr) {
-            root = new_node;
+        while (num_to_process > 0) {
+            elts.clear();
+            leaf->collect_at(view.ts, elts);
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            leaf->rw_lock.unlock_shared();
+
+            auto it = lower_bound(elts.begin(), elts.end(), start, [](const ElementBPA<KeyType, ValueType>& elt, const KeyType& key) {
+                return elt.key < key;
+            });
+            for (; it != elts.end() && num_to_process > 0; ++it, --num_to_process)
+                f(it->key, it->value);
+
+            // Leaves are only freed once every operation that could reach them is over, so next stays valid without
+            // the lock; skip those split off after the view
+            leaf = nullptr;
+            while (next != nullptr && num_to_process > 0) {
+                next->rw_lock.lock_shared();
+                if (next->created_ts <= view.ts) {
+                    leaf = next;
+                    break;
+                }
+                BPTreeNode_Leaf<KeyType, ValueType>* after = next->next;
+                next->rw_lock.unlock_shared();
+                next = after;
+            }
+            if (leaf == nullptr)
+                break;
+        }
+        if (leaf != nullptr)
+            leaf->rw_lock.unlock_shared();
+        return length - num_to_process;
+    }
 
-            node->parent = new_node;
-            new_node->parent = new_node;
+    // Applies f to up to length elements starting at key start, returns how many were visited
+    int iterate_range (KeyType start, int length, function<ValueType(KeyType)> f) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+        if constexpr (!KeyTraits<KeyType>::out_of_line) {
+            if (trace != nullptr)
+                trace->record_range(start, length);
+        }
 
-            new_node->children.push_back(node);
-            new_node->children.push_back(new_node);
+        BPTREE_STAT(events.add(BPTreeEvent::ExclusiveScan));
+        int num_to_process = length;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(start);
+        BPTreeNode_Leaf<KeyType, ValueType>* locked = nullptr; //Leaf visited last, still held until its successor is locked
+
+        while (num_to_process > 0 && leaf != nullptr) {
+            // f writes back into the values and their block summaries, so every leaf is write-locked
+            leaf->rw_lock.lock();
+            if (locked != nullptr)
+                locked->rw_lock.unlock();
+
+            if (geometry_policy != nullptr)
+                leaf->scans.fetch_add(1, memory_order_relaxed);
+            stamp_write(leaf);
+            int visited = leaf->iterate_range(start, num_to_process, f);
+            if (visited > 0)
+                invalidate_summaries(leaf->parent);
+            num_to_process -= visited;
+
+            locked = leaf;
+            leaf = leaf->next;
+        }
+        if (locked != nullptr)
+            locked->rw_lock.unlock();
+        return length - num_to_process;
+    }
 
-            new_node->keys.push_back(node->keys[splitIndex]);
+    // Applies f to every element with a key in [start, start + length), for keys with arithmetic. Returns how
+    // many elements were touched.
+    int map_range (KeyType start, int length, function<ValueType(KeyType)> f) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTREE_STAT(events.add(BPTreeEvent::ExclusiveScan));
+        KeyType end = start + length;
+        int touched = 0;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(start, true);
+
+        while (true) {
+            stamp_write(leaf);
+            int mapped = leaf->map_between(start, end, f);
+            if (mapped > 0)
+                invalidate_summaries(leaf->parent);
+            touched += mapped;
+
+            // A retired leaf is empty and its old high key says nothing about where its keys went
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (next == nullptr || (!leaf->retired() && (!leaf->has_high || !(leaf->high_key < end))))
+                break;
+            next->rw_lock.lock(); // Hand-over-hand locking
+            leaf->rw_lock.unlock();
+            leaf = next;
         }
-        else {
-            // Get the index at which the original leaf was at
-            int split;
-            for (split = 0; split < node->parent->children.size(); split++) {
-                if (node->parent->children[split] == node) {
-                    node->parent->children.insert(node->parent->children.begin() + split + 1, new_node);
-                    break;
+        leaf->rw_lock.unlock();
+        return touched;
+    }
+
+    // One round of background upkeep: flushes the log of every leaf at least log_fill_threshold full and sorts
+    // its unsorted blocks, so that neither job is left to a foreground insert or scan. With freeze_after set,
+    // a leaf that has not seen an insert for that many rounds is frozen into its compact read-only form instead.
+    // Leaf versions no read view can see any more are dropped along the way. A leaf is only write-locked with
+    // try_lock, so one in use is skipped until the next round. Stops after budget leaves, returns how many it
+    // serviced.
+    int maintenance_pass(double log_fill_threshold, int budget, int freeze_after = 0) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            return 0;
+
+        uint64_t round = maintenance_round.fetch_add(1, memory_order_relaxed) + 1;
+        uint64_t oldest_view = read_views.oldest_active();
+        int serviced = 0;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = leftmost_leaf();
+
+        while (leaf != nullptr && serviced < budget) {
+            leaf->rw_lock.lock_shared();
+            bool freeze = false;
+            bool candidate = false;
+            int min_fill = 0;
+            if (!leaf->frozen()) {
+                freeze = freeze_after > 0 && leaf->num_elts > 0 && round - leaf->last_insert >= (uint64_t) freeze_after;
+                min_fill = max(1, (int) (log_fill_threshold * leaf->bpa.log_size)); // Leaves may differ in geometry
+                candidate = freeze || leaf->bpa.log_fill() >= min_fill || !leaf->bpa.is_sorted();
+            }
+            candidate = candidate || leaf->has_stale_versions(oldest_view);
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            leaf->rw_lock.unlock_shared();
+
+            if (candidate && leaf->rw_lock.try_lock()) {
+                leaf->prune_versions(read_views.oldest_active());
+                if (leaf->frozen()) {
+                    // Nothing else to do for a frozen leaf
+                } else if (freeze) {
+                    leaf->freeze();
+                    BPTREE_STAT(events.add(BPTreeEvent::Freeze));
+                } else {
+                    if (leaf->bpa.log_fill() >= min_fill)
+                        leaf->bpa.flush_log(); // Fails only if the leaf is due a split, which the next insert does
+                    leaf->bpa.sort_blocks();
                 }
+                next = leaf->next;
+                leaf->rw_lock.unlock();
+                serviced++;
+            }
+            leaf = next;
+        }
+        return serviced;
+    }
 
+    // Online compaction, the space counterpart of maintenance_pass. Walks the leaves left to right and merges each
+    // one holding less than min_fill of its BPA capacity into its right neighbour, as long as the neighbour ends
+    // up at most max_merged_fill full; a leaf whose count still includes duplicates, or whose key arena is mostly
+    // dead bytes, is instead repacked in place.
+    // Only the two leaves and their parent are locked, and only for the merge itself. A merged leaf stays on the
+    // leaf chain, empty, until no read view needs it and is freed by a later call once no operation can still
+    // hold it. Stops after budget merges and repacks.
+    BPTreeCompaction compact_leaves(double min_fill = 0.5, double max_merged_fill = 0.75, int budget = INT_MAX) {
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        lock_guard<mutex> guard(compaction_mutex);
+        BPTreeCompaction done;
+        done.freed += free_drained();
+        {
+            OperationPhases::Scope scope(phases);
+            vector<ElementBPA<KeyType, ValueType>> elts;
+            BPTreeNode_Leaf<KeyType, ValueType>* leaf = leftmost_leaf();
+            while (leaf != nullptr && done.merged + done.repacked < budget) {
+                leaf->rw_lock.lock_shared();
+                elts.clear();
+                leaf->collect_sorted(elts);
+                bool retired = leaf->retired();
+                bool under_full = elts.size() < min_fill * leaf->bpa.total_size;
+                bool stale = leaf->num_elts > (int) elts.size() || arena_wasted(leaf, elts);
+                BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+                leaf->rw_lock.unlock_shared();
+
+                if (!retired && under_full && next != nullptr) {
+                    BPTreeNode_Leaf<KeyType, ValueType>* merged = merge_into_next(leaf, max_merged_fill);
+                    if (merged != nullptr) {
+                        retired_leaves.push_back(leaf);
+                        done.merged++;
+                        leaf = merged; // May still be under-full and take its own right neighbour
+                        continue;
+                    }
+                }
+                if (!retired && stale && leaf->rw_lock.try_lock()) {
+                    // The live contents stay the same, so read views need no version of them
+                    elts.clear();
+                    leaf->collect_sorted(elts);
+                    if (arena_wasted(leaf, elts))
+                        rebuild_arena(leaf, elts);
+                    repack_leaf(leaf, elts);
+                    next = leaf->next;
+                    leaf->rw_lock.unlock();
+                    done.repacked++;
+                }
+                leaf = next;
             }
-            new_node->parent = node->parent;
+            done.unlinked = unlink_retired();
+        }
+        done.freed += free_drained();
+        return done;
+    }
 
-            //Insert the first key in the righht leaf as the new divider key
-            node->parent->keys.insert(node->parent->keys.begin() + split, node->keys[splitIndex]);
+    // Where the tree's memory goes: bytes per live entry split by structure, and how full each level is. Walks
+    // the internal levels and then the leaf chain, each node under a brief shared lock, so while writers run the
+    // report is consistent per node but not across nodes. Every leaf is read in full to count its live entries.
+    BPTreeSpaceReport space_report() {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTreeSpaceReport report;
+        vector<BPTreeNode<KeyType, ValueType>*> level{root.load(memory_order_acquire)};
+        vector<BPTreeNode<KeyType, ValueType>*> below;
+        while (dynamic_cast<BPTreeNode_Leaf<KeyType, ValueType>*>(level[0]) == nullptr) {
+            BPTreeLevelFill fill;
+            below.clear();
+            for (BPTreeNode<KeyType, ValueType>* node : level) {
+                BPTreeNode_Internal<KeyType, ValueType>* internal = dynamic_cast<BPTreeNode_Internal<KeyType, ValueType>*>(node);
+                internal->rw_lock.lock_shared();
+                fill.nodes++;
+                fill.entries += internal->children.size();
+                fill.capacity += order;
+                report.internal_bytes += sizeof(*internal) + internal->key_bytes()
+                    + internal->children.capacity() * sizeof(BPTreeNode<KeyType, ValueType>*);
+                below.insert(below.end(), internal->children.begin(), internal->children.end());
+                internal->rw_lock.unlock_shared();
+            }
+            report.levels.push_back(fill);
+            swap(level, below);
         }
 
-        //For  efficiency we just reuse the old leaf
-        new_node->keys.assign(node->keys.begin() + splitIndex + 1, node->keys.end());
-        new_node->children.assign(node->children.begin() + splitIndex+1, node->children.end());
+        BPTreeLevelFill leaves;
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = leftmost_leaf();
+        leaf->rw_lock.lock_shared();
+        while (leaf != nullptr) {
+            if (leaf->retired()) {
+                report.retired_leaves++;
+                report.retired_bytes += leaf->footprint();
+            } else {
+                elts.clear();
+                leaf->collect_sorted(elts);
+                leaves.nodes++;
+                leaves.entries += elts.size();
+                leaves.capacity += leaf->bpa.total_size;
+                report.live_entries += elts.size();
+                report.counted_elements += leaf->num_elts;
+                report.leaf_bytes += sizeof(*leaf);
+                report.bpa_bytes += leaf->bpa.allocated_bytes();
+                report.cold_bytes += leaf->frozen() ? leaf->cold->bytes() : 0;
+                report.version_bytes += leaf->version_bytes();
+                report.arena_bytes += leaf->arena.bytes_reserved();
+                report.filter_bytes += leaf->filter.bytes();
+            }
 
-        node->keys.erase(node->keys.begin() + splitIndex, node->keys.end());
-        node->children.erase(node->children.begin() + splitIndex+1, node->children.end());
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (next != nullptr)
+                next->rw_lock.lock_shared(); // Hand-over-hand locking
+            leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        report.levels.push_back(leaves);
+        report.payload_bytes = report.live_entries * (sizeof(KeyType) + sizeof(ValueType));
 
-        node->rw_lock.unlock();
-        new_node->rw_lock.unlock();
+        {
+            lock_guard<mutex> guard(separator_mutex);
+            report.arena_bytes += separator_arena.bytes_reserved();
+        }
+        {
+            // Off the chain already, but a straggling operation may still be writing a version into one
+            lock_guard<mutex> guard(compaction_mutex);
+            for (vector<BPTreeNode_Leaf<KeyType, ValueType>*>* list : {&unlinked_leaves, &draining_leaves}) {
+                for (BPTreeNode_Leaf<KeyType, ValueType>* gone : *list) {
+                    gone->rw_lock.lock_shared();
+                    report.retired_leaves++;
+                    report.retired_bytes += gone->footprint();
+                    gone->rw_lock.unlock_shared();
+                }
+            }
+        }
+        report.allocator_bytes = (memory != nullptr) ? memory->footprint() : 0;
+        return report;
+    }
 
-        //Uh oh time for a split!!! again!!!!!!!!!!!!!!!
-        if (node->parent->children.size() == order)
-            split_internal_node(node->parent);
-        else { //Unlock the rest of the nodes up to the root
-            while (new_node->parent != nullptr) { //if not root
-                new_node = new_node->parent;
-                new_node->rw_lock.unlock();
+    // Applies f to every element with a key in [low, high) using num_threads workers. The range is cut at leaf
+    // boundaries into key segments of about leaves_per_task leaves, which a work-stealing pool hands out. Each
+    // segment is walked like map_range, write-locking one leaf at a time and following next under the latch, so
+    // leaves split or merged after the cuts were taken are still covered, and no key is mapped by two segments.
+    // Returns how many elements each worker touched.
+    vector<size_t> parallel_map_range(KeyType low, KeyType high, function<ValueType(KeyType)> f, int num_threads, int leaves_per_task = 16) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTREE_STAT(events.add(BPTreeEvent::ExclusiveScan));
+        vector<size_t> counts(max(num_threads, 1), 0);
+        if (!(low < high))
+            return counts;
+
+        // Cut the range at the high key of every leaves_per_task-th leaf; separators never move, only the leaves
+        // holding the keys between them do
+        vector<KeyType> cuts = {low};
+        int in_segment = 0;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(low, false);
+        while (true) {
+            bool last = !leaf->retired() && (!leaf->has_high || !(leaf->high_key < high));
+            if (!leaf->retired() && !last && ++in_segment == leaves_per_task) {
+                cuts.push_back(leaf->high_key);
+                in_segment = 0;
+            }
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (last || next == nullptr)
+                break;
+            next->rw_lock.lock_shared(); // Hand-over-hand locking
+            leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        leaf->rw_lock.unlock_shared();
+        cuts.push_back(high);
+
+        run_work_stealing(cuts.size() - 1, num_threads, [&](size_t task, int worker) {
+            KeyType segment_low = cuts[task];
+            KeyType segment_high = cuts[task + 1];
+            BPTreeNode_Leaf<KeyType, ValueType>* current = lock_leaf(segment_low, true);
+            while (true) {
+                stamp_write(current);
+                int touched = current->map_between(segment_low, segment_high, f);
+                if (touched > 0)
+                    invalidate_summaries(current->parent);
+                counts[worker] += touched;
+
+                // A retired leaf is empty and its old high key says nothing about where its keys went
+                BPTreeNode_Leaf<KeyType, ValueType>* next = current->next;
+                if (next == nullptr || (!current->retired() && (!current->has_high || !(current->high_key < segment_high))))
+                    break;
+                next->rw_lock.lock(); // Hand-over-hand locking
+                current->rw_lock.unlock();
+                current = next;
+            }
+            current->rw_lock.unlock();
+        });
+        return counts;
+    }
+
+    // Bottom-up build, step one: appends n elements sorted by key, all above any key appended before and with
+    // no duplicates. Only a partial leaf is buffered between calls, so sources can be streamed through.
+    void bulk_append(const ElementBPA<KeyType, ValueType>* elts, size_t n) {
+        int fill = leaf_fill();
+        for (size_t i = 0; i < n; i++) {
+            bulk_pending.push_back(elts[i]);
+            if (bulk_pending.size() == (size_t) fill) {
+                bulk_append_leaf(bulk_pending.data(), fill);
+                bulk_pending.clear();
             }
         }
     }
 
-    ValueType* find(KeyType key) {
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(key);
+    // Bottom-up build, step two: builds the internal levels and replaces the previous contents of the tree.
+    // Meant for a freshly constructed tree that no other thread is using yet.
+    void bulk_finish() {
+        if (!bulk_pending.empty())
+            bulk_append_leaf(bulk_pending.data(), bulk_pending.size());
+        bulk_pending.clear();
 
-        leaf->rw_lock.lock_shared();
-        ValueType* val = leaf->bpa.find(key);
-        leaf->rw_lock.unlock_shared();
-        return val;
+        BPTreeNode<KeyType, ValueType>* old_root = root;
+        bulk_build_levels();
+        free_subtree(old_root);
     }
 
-    void iterate_range (int start, int length, function<ValueType(KeyType)> f) {
-        int num_to_process = length;
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(start);
+    void bulk_load(const ElementBPA<KeyType, ValueType>* elts, size_t n) {
+        bulk_append(elts, n);
+        bulk_finish();
+    }
 
-        bool need_write = true; //Check if we need to take a write lock here
-        bool last_need_write;
+    // Walks the leaves left to right and hands f the live contents of each one as a sorted run. Each leaf is
+    // copied under a brief shared lock and f runs with none held, so a slow consumer does not hold up writers;
+    // the next leaf is then found again from the copied leaf's high key, so keys that moved meanwhile are
+    // neither skipped nor handed out twice. Each run is consistent, the walk as a whole is not a snapshot.
+    void for_each_run(function<void(const ElementBPA<KeyType, ValueType>*, size_t)> f) {
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+
+        BPTREE_STAT(events.add(BPTreeEvent::SharedScan));
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = leftmost_leaf();
+        leaf->rw_lock.lock_shared();
+        while (true) {
+            elts.clear();
+            leaf->collect_sorted(elts);
+            bool last = !leaf->has_high;
+            KeyType high_key = leaf->high_key;
+            leaf->rw_lock.unlock_shared();
+
+            if (!elts.empty())
+                f(elts.data(), elts.size());
+            if (last)
+                break;
+            leaf = lock_leaf(high_key, false);
+        }
+    }
 
-        while (num_to_process > 0) {
-            last_need_write = need_write;
-            need_write = true;
-            if (leaf->bpa.sorted_log) {
-                for(int i = 1; i < bpa_num_blocks; i++) {
-                    if (leaf->bpa.header_ptr[i].key < start && ! leaf->bpa.sorted_blocks[i])
-                        break;
+    // Copies up to limit entries with a key of at least lo into keys and values, in ascending key order, for
+    // callers that consume columns rather than one element at a time. Each leaf is copied straight into the
+    // arrays under a shared lock, whole sorted blocks at a time, and leaves are walked hand over hand, so each
+    // leaf is read consistently but the batch as a whole is not a snapshot. The returned resume key starts the
+    // next batch; a batch may then come back empty while more is still set if only empty leaves were left.
+    BPTreeScanBatch<KeyType> scan_into(KeyType lo, size_t limit, KeyType* keys, ValueType* values) {
+        static_assert(!KeyTraits<KeyType>::out_of_line, "scan_into hands out keys by value, out-of-line keys would point into the tree");
+        OperationPhases::Scope scope(phases);
+        if (snapshot_active.load(memory_order_acquire))
+            materialize();
+        if (trace != nullptr)
+            trace->record_range(lo, (int) min<size_t>(limit, INT_MAX));
+
+        BPTreeScanBatch<KeyType> batch;
+        batch.resume = lo;
+        if (limit == 0) {
+            batch.more = true;
+            return batch;
+        }
+
+        BPTREE_STAT(events.add(BPTreeEvent::SharedScan));
+        vector<ElementBPA<KeyType, ValueType>> scratch;
+        BPTreeNode_Leaf<KeyType, ValueType>* leaf = lock_leaf(lo, false);
+        while (true) {
+            int want = (int) min<size_t>(limit - batch.count, INT_MAX);
+            batch.count += leaf->copy_from(lo, want, keys + batch.count, values + batch.count, scratch);
+            if (batch.count == limit) {
+                // Look one past the last key copied for where the next batch starts
+                KeyType peek_keys[2];
+                ValueType peek_values[2];
+                if (leaf->copy_from(keys[limit-1], 2, peek_keys, peek_values, scratch) == 2) {
+                    batch.more = true;
+                    batch.resume = peek_keys[1];
+                    break;
                 }
+            }
+
+            // Nothing left in this leaf at or above lo, the next batch starts where its successor does
+            batch.more = leaf->has_high;
+            if (leaf->has_high)
+                batch.resume = leaf->high_key;
+            BPTreeNode_Leaf<KeyType, ValueType>* next = leaf->next;
+            if (batch.count == limit || next == nullptr)
+                break;
+            next->rw_lock.lock_shared(); // Hand-over-hand locking
+            leaf->rw_lock.unlock_shared();
+            leaf = next;
+        }
+        leaf->rw_lock.unlock_shared();
+        return batch;
+    }
 
-                need_write = false;
+    // Writes every live entry to path as a BPTreeSnapshot. The internal levels are rebuilt from the leaf
+    // minimums once all the leaves are written.
+    bool save_snapshot(const char* path) {
+        static_assert(is_trivially_copyable<KeyType>::value && is_trivially_copyable<ValueType>::value, "snapshots store keys and values as raw bytes");
+        static_assert(!KeyTraits<KeyType>::out_of_line, "snapshots cannot hold out-of-line keys");
+
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out)
+            return false;
+
+        BPTreeSnapshotHeader header = {};
+        memcpy(header.magic, bptree_snapshot_magic, sizeof(header.magic));
+        header.key_size = sizeof(KeyType);
+        header.value_size = sizeof(ValueType);
+        header.order = order;
+        header.log_size = bpa_log_size;
+        header.num_blocks = bpa_num_blocks;
+        header.block_size = bpa_block_size;
+        out.write((const char*) &header, sizeof(header));
+
+        const char padding[8] = {};
+        uint64_t offset = sizeof(header);
+        uint64_t last_leaf = 0;
+        vector<pair<KeyType, uint64_t>> level; // Minimum key and offset of each record on the level being written
+        vector<KeyType> keys;
+        vector<ValueType> values;
+
+        // Leaves are written in the order the tree holds them, so the internal levels can be stacked on top
+        for_each_run([&](const ElementBPA<KeyType, ValueType>* elts, size_t count) {
+            keys.clear();
+            values.clear();
+            for (size_t i = 0; i < count; i++) {
+                keys.push_back(elts[i].key);
+                values.push_back(elts[i].value);
             }
 
-            (need_write) ? leaf->rw_lock.lock() : leaf->rw_lock.lock_shared();
-            if (num_to_process != length)
-                (last_need_write) ? leaf->prev->rw_lock.unlock() : leaf->prev->rw_lock.unlock_shared();
+            uint64_t keys_bytes = keys.size() * sizeof(KeyType);
+            uint64_t values_bytes = values.size() * sizeof(ValueType);
+            uint64_t record_size = sizeof(BPTreeSnapshotLeaf) + snapshot_align(keys_bytes) + snapshot_align(values_bytes);
+
+            BPTreeSnapshotLeaf record = {keys.size(), offset + record_size};
+            out.write((const char*) &record, sizeof(record));
+            out.write((const char*) keys.data(), keys_bytes);
+            out.write(padding, snapshot_align(keys_bytes) - keys_bytes);
+            out.write((const char*) values.data(), values_bytes);
+            out.write(padding, snapshot_align(values_bytes) - values_bytes);
+
+            level.push_back({keys[0], offset});
+            header.num_entries += keys.size();
+            header.num_leaves++;
+            last_leaf = offset;
+            offset += record_size;
+        });
+
+        if (header.num_leaves > 0) {
+            header.first_leaf = level[0].second;
+            header.height = 1;
+        }
 
-            num_to_process -= leaf->bpa.iterate_range(start, num_to_process, f);
+        // Internal levels are never modified in place, so pack them as full as the order allows
+        size_t fanout = max(2, order - 1);
+        while (level.size() > 1) {
+            vector<pair<KeyType, uint64_t>> parents;
+            for (size_t i = 0; i < level.size(); i += fanout) {
+                size_t end = min(level.size(), i + fanout);
+                uint64_t num_keys = end - i - 1;
+
+                keys.clear();
+                vector<uint64_t> children;
+                for (size_t j = i; j < end; j++) {
+                    if (j > i)
+                        keys.push_back(level[j].first);
+                    children.push_back(level[j].second);
+                }
 
-            if (leaf-> next == nullptr)
-                break;
-            leaf = leaf->next;
+                uint64_t keys_bytes = num_keys * sizeof(KeyType);
+                BPTreeSnapshotInternal record = {num_keys};
+                out.write((const char*) &record, sizeof(record));
+                out.write((const char*) keys.data(), keys_bytes);
+                out.write(padding, snapshot_align(keys_bytes) - keys_bytes);
+                out.write((const char*) children.data(), children.size() * sizeof(uint64_t));
+
+                parents.push_back({level[i].first, offset});
+                offset += sizeof(record) + snapshot_align(keys_bytes) + children.size() * sizeof(uint64_t);
+            }
+            level.swap(parents);
+            header.height++;
+        }
+        if (!level.empty())
+            header.root = level[0].second;
+
+        // The last leaf has no successor, and the header could only be filled in once everything was written
+        if (header.num_leaves > 0) {
+            uint64_t no_next = 0;
+            out.seekp(last_leaf + offsetof(BPTreeSnapshotLeaf, next));
+            out.write((const char*) &no_next, sizeof(no_next));
         }
-        (need_write) ? leaf->rw_lock.unlock() : leaf->rw_lock.unlock_shared();
+        out.seekp(0);
+        out.write((const char*) &header, sizeof(header));
+        out.close();
+        return !out.fail();
     }
 
-    void map_range (int start, int length, function<ValueType(KeyType)> f) {
-        int num_to_process = length;
-        BPTreeNode_Leaf<KeyType, ValueType>* leaf = traverse(start);
+    // Lets each leaf pick its own BPA geometry from the mix of operations it sees, applied when the leaf splits
+    // or redistributes. May be switched while other threads use the tree. The tree does not own the policy, which
+    // must outlive it or the next switch; pass nullptr to go back to the fixed geometry for leaves created from
+    // then on.
+    void set_geometry_policy(BPAGeometryPolicy* policy) {
+        geometry_policy.store(policy, memory_order_release);
+    }
 
-        while (num_to_process > 0) {
-            num_to_process -= leaf->bpa.map_range(start, num_to_process, f);
-            left = leaf->next;
+    // Logs every subsequent insert to wal before applying it. With sync_commit an insert returns once its record
+    // is durable, but other threads may see it a little earlier. To recover, load the last snapshot, replay the
+    // log into the tree with BPTreeWAL::replay, and only then reopen and attach the log. Pass nullptr to detach.
+    void attach_wal(BPTreeWAL<KeyType, ValueType>* log) {
+        wal = log;
+    }
+
+    // Records every subsequent insert, find and iterate_range or scan_view call to recorder, for replaying the
+    // workload later. Attach before the threads using the tree start. Pass nullptr to stop recording.
+    void attach_trace(BPTreeTraceRecorder<KeyType, ValueType>* recorder) {
+        static_assert(!KeyTraits<KeyType>::out_of_line, "traces cannot hold out-of-line keys");
+        trace = recorder;
+    }
+
+    // Serves reads straight from the snapshot at path through a memory mapping. The first insert or range
+    // operation converts it into the normal mutable layout. Meant for a freshly constructed tree. Every leaf record
+    // is checked first, so a truncated or corrupt file fails here rather than leaving a partial or unsorted tree.
+    bool load_snapshot(const char* path) {
+        static_assert(!KeyTraits<KeyType>::out_of_line, "snapshots cannot hold out-of-line keys");
+        BPTreeSnapshot<KeyType, ValueType>* loaded = new BPTreeSnapshot<KeyType, ValueType>();
+        if (!loaded->open(path) || !loaded->validate_leaves()) {
+            delete loaded;
+            return false;
         }
+
+        lock_guard<mutex> guard(snapshot_mutex);
+        snapshot = loaded;
+        snapshot_active.store(true, memory_order_release);
+        return true;
     }
 };
\ No newline at end of file
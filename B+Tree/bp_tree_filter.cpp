@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+// Bloom filter over the keys of one leaf, so that a lookup for a key the leaf does not hold can usually be
+// answered without touching the BPA. Keys are only ever added; the filter is rebuilt whenever the leaf is.
+// An unconfigured filter (zero bits) lets every key through.
+template <typename KeyType>
+class LeafBloomFilter {
+private:
+    vector<uint64_t> bits;
+    uint64_t num_bits = 0;
+    int num_hashes = 0;
+
+    // splitmix64 finalizer, std::hash is the identity for integers on common standard libraries
+    static uint64_t mix(uint64_t h) {
+        h += 0x9e3779b97f4a7c15ull;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+public:
+    // Sizes the filter to num_bits bits (rounded up to a multiple of 64) probed num_hashes times, and empties it
+    void configure(int bits_wanted, int hashes) {
+        num_bits = bits_wanted > 0 ? ((uint64_t) bits_wanted + 63) / 64 * 64 : 0;
+        num_hashes = max(1, hashes);
+        bits.assign(num_bits / 64, 0);
+    }
+
+    bool enabled() const {
+        return num_bits > 0;
+    }
+
+    size_t bytes() const {
+        return bits.capacity() * sizeof(uint64_t);
+    }
+
+    void clear() {
+        fill(bits.begin(), bits.end(), 0);
+    }
+
+    void add(const KeyType& key) {
+        if (num_bits == 0)
+            return;
+        uint64_t h1 = mix(hash<KeyType>()(key));
+        uint64_t h2 = (h1 >> 32) | 1; // Double hashing, an odd step visits distinct bits
+        for (int i = 0; i < num_hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % num_bits;
+            bits[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    // False means the key is certainly absent
+    bool may_contain(const KeyType& key) const {
+        if (num_bits == 0)
+            return true;
+        uint64_t h1 = mix(hash<KeyType>()(key));
+        uint64_t h2 = (h1 >> 32) | 1;
+        for (int i = 0; i < num_hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % num_bits;
+            if (!(bits[bit / 64] & (1ull << (bit % 64))))
+                return false;
+        }
+        return true;
+    }
+};
+
+// Counters kept by a BPTree with leaf filters enabled
+struct LeafFilterStats
+{
+    uint64_t lookups = 0;         // Point lookups that reached a leaf
+    uint64_t rejected = 0;        // Answered by the filter alone
+    uint64_t false_positives = 0; // Let through by the filter, but the key was not in the leaf
+
+    // Share of absent keys the filter failed to reject
+    double false_positive_rate() const {
+        uint64_t misses = rejected + false_positives;
+        return misses == 0 ? 0.0 : (double) false_positives / misses;
+    }
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// Shape of one leaf's BPA
+struct BPAGeometry
+{
+    int log_size;
+    int num_blocks;
+    int block_size;
+
+    int capacity() const {
+        return num_blocks + num_blocks * block_size;
+    }
+
+    bool operator==(const BPAGeometry& other) const {
+        return log_size == other.log_size && num_blocks == other.num_blocks && block_size == other.block_size;
+    }
+};
+
+// Operations a leaf has seen since its geometry was last chosen
+struct LeafWorkloadSample
+{
+    uint32_t inserts;
+    uint32_t finds;
+    uint32_t scans;
+    int num_elts;
+};
+
+// Decides the BPA geometry of a leaf from its recent workload. A BPTree consults it when a leaf splits and
+// after a leaf redistributes; the tree keeps the current geometry if the answer cannot hold the leaf's contents.
+class BPAGeometryPolicy {
+public:
+    virtual ~BPAGeometryPolicy() = default;
+
+    virtual BPAGeometry choose(const BPAGeometry& current, const LeafWorkloadSample& sample) = 0;
+};
+
+// Default policy around the tree's base geometry. Write-hot leaves get a log scale times larger, so inserts
+// flush less often; read-hot leaves get a log scale times smaller and twice the blocks at half the size, so a
+// find scans less of both. Everything else stays at the base geometry.
+class WorkloadGeometryPolicy: public BPAGeometryPolicy {
+private:
+    BPAGeometry base;
+    int scale;
+    uint32_t min_samples;
+    double write_hot;
+    double read_hot;
+
+public:
+    WorkloadGeometryPolicy(BPAGeometry base, int scale = 4, uint32_t min_samples = 64, double write_hot = 0.6, double read_hot = 0.1)
+        : base(base), scale(max(1, scale)), min_samples(min_samples), write_hot(write_hot), read_hot(read_hot) {}
+
+    BPAGeometry choose(const BPAGeometry& current, const LeafWorkloadSample& sample) override {
+        uint32_t total = sample.inserts + sample.finds + sample.scans;
+        if (total < min_samples)
+            return current;
+
+        double write_share = (double) sample.inserts / total;
+        BPAGeometry result = base;
+        if (write_share >= write_hot) {
+            result.log_size = base.log_size * scale;
+        } else if (write_share <= read_hot) {
+            result.log_size = max(1, base.log_size / scale);
+            result.num_blocks = base.num_blocks * 2;
+            result.block_size = max(1, base.block_size / 2);
+        }
+        return result;
+    }
+};
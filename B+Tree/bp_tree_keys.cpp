@@ -0,0 +1,146 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for key bytes. Memory comes in chunks that are only released with the arena, so a key copied
+// in stays at the same address for as long as its owner lives and no key costs a heap allocation of its own.
+class KeyArena {
+private:
+    vector<unique_ptr<char[]>> chunks;
+    size_t chunk_used = 0;
+    size_t chunk_size = 0;
+    size_t total_bytes = 0;
+    size_t total_reserved = 0;
+
+public:
+    static constexpr size_t default_chunk = 4096;
+
+    // Copies len bytes into the arena and returns their new address
+    const char* copy(const char* bytes, size_t len) {
+        if (chunks.empty() || chunk_used + len > chunk_size) {
+            chunk_size = max(default_chunk, len);
+            chunks.emplace_back(new char[chunk_size]);
+            chunk_used = 0;
+            total_reserved += chunk_size;
+        }
+        char* out = chunks.back().get() + chunk_used;
+        memcpy(out, bytes, len);
+        chunk_used += len;
+        total_bytes += len;
+        return out;
+    }
+
+    // Bytes handed out so far, dead copies included
+    size_t bytes_used() const {
+        return total_bytes;
+    }
+
+    size_t bytes_reserved() const {
+        return total_reserved;
+    }
+};
+
+// Variable-length key that still fits the fixed-width slots of a BPA. The first 8 bytes are kept inline,
+// zero padded, and decide most comparisons; longer keys point at their full bytes, which live in the arena
+// of the leaf holding them. A StringKey made from caller memory is only valid until the tree interns it.
+// Keys of up to 8 bytes are self-contained and copy freely.
+struct StringKey
+{
+    char prefix[8];
+    uint32_t len;
+    const char* data; // All len bytes, prefix included, for keys longer than the prefix
+
+    StringKey() : len(0), data(nullptr) {
+        memset(prefix, 0, sizeof(prefix));
+    }
+
+    StringKey(const char* bytes, uint32_t n) : len(n), data(bytes) {
+        memset(prefix, 0, sizeof(prefix));
+        memcpy(prefix, bytes, min<size_t>(n, sizeof(prefix)));
+    }
+
+    StringKey(const string& s) : StringKey(s.data(), s.size()) {}
+
+    const char* bytes() const {
+        return (len > sizeof(prefix)) ? data : prefix;
+    }
+
+    string to_string() const {
+        return string(bytes(), len);
+    }
+
+    // Negative, zero or positive like memcmp, shorter keys first on a tie
+    int compare(const StringKey& other) const {
+        int c = memcmp(prefix, other.prefix, sizeof(prefix));
+        if (c != 0)
+            return c;
+        if (len > sizeof(prefix) && other.len > sizeof(prefix)) {
+            c = memcmp(data + sizeof(prefix), other.data + sizeof(prefix), min(len, other.len) - sizeof(prefix));
+            if (c != 0)
+                return c;
+        }
+        return (len < other.len) ? -1 : (len > other.len) ? 1 : 0;
+    }
+
+    bool operator<(const StringKey& other) const { return compare(other) < 0; }
+    bool operator>(const StringKey& other) const { return compare(other) > 0; }
+    bool operator<=(const StringKey& other) const { return compare(other) <= 0; }
+    bool operator>=(const StringKey& other) const { return compare(other) >= 0; }
+    bool operator==(const StringKey& other) const { return len == other.len && compare(other) == 0; }
+    bool operator!=(const StringKey& other) const { return !(*this == other); }
+};
+
+namespace std {
+template <>
+struct hash<StringKey>
+{
+    size_t operator()(const StringKey& key) const {
+        uint64_t h = 1469598103934665603ull; // FNV-1a
+        const char* bytes = key.bytes();
+        for (uint32_t i = 0; i < key.len; i++) {
+            h ^= (unsigned char) bytes[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+};
+}
+
+// How a BPTree stores its keys. Plain keys are copied into the BPA as they are; out-of-line keys keep part of
+// themselves elsewhere and are interned into an arena owned by the node that stores them.
+template <typename KeyType>
+struct KeyTraits
+{
+    static const bool out_of_line = false;
+
+    static KeyType intern(const KeyType& key, KeyArena&) {
+        return key;
+    }
+
+    // Bytes intern copies into the arena for key
+    static size_t arena_bytes(const KeyType&) {
+        return 0;
+    }
+};
+
+template <>
+struct KeyTraits<StringKey>
+{
+    static const bool out_of_line = true;
+
+    static StringKey intern(const StringKey& key, KeyArena& arena) {
+        StringKey result = key;
+        result.data = (key.len > sizeof(key.prefix)) ? arena.copy(key.data, key.len) : nullptr;
+        return result;
+    }
+
+    static size_t arena_bytes(const StringKey& key) {
+        return (key.len > sizeof(key.prefix)) ? key.len : 0;
+    }
+};
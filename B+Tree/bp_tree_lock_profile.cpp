@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Lock contention profiling for BPTree. Built with BPTREE_LOCK_PROFILE defined, every node latch and the tree's
+// split_mutex is a ProfiledLatch instead of a plain mutex, and BPTree::lock_profile reports where threads waited.
+// Without it nothing here is used.
+
+enum class LatchMode { Shared = 0, Exclusive = 1 };
+
+struct LatchModeStats
+{
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;   // Acquisitions that could not be had straight away
+    uint64_t wait_ns = 0;     // Total time spent blocked on the latch
+    uint64_t max_wait_ns = 0;
+    uint64_t hold_ns = 0;     // Total time the latch was held in this mode, summed over holders
+
+    void add(const LatchModeStats& other) {
+        acquisitions += other.acquisitions;
+        contended += other.contended;
+        wait_ns += other.wait_ns;
+        max_wait_ns = max(max_wait_ns, other.max_wait_ns);
+        hold_ns += other.hold_ns;
+    }
+};
+
+// Drop-in for shared_timed_mutex that counts acquisitions and times waits and holds per mode. An acquisition
+// first tries the latch and only reads the clock a second time if that fails, so an uncontended latch costs two
+// clock reads per lock/unlock pair. A thread's shared holds are matched to their unlocks through a short
+// thread-local list, since several readers can hold the latch at once.
+class ProfiledLatch {
+private:
+    struct ModeCounters
+    {
+        atomic<uint64_t> acquisitions{0};
+        atomic<uint64_t> contended{0};
+        atomic<uint64_t> wait_ns{0};
+        atomic<uint64_t> max_wait_ns{0};
+        atomic<uint64_t> hold_ns{0};
+    };
+
+    struct SharedHold
+    {
+        const ProfiledLatch* latch;
+        uint64_t since;
+    };
+
+    shared_timed_mutex latch;
+    ModeCounters modes[2];
+    uint64_t exclusive_since = 0; // Only touched by the exclusive holder
+
+    static uint64_t now_ns() {
+        return (uint64_t) chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static vector<SharedHold>& shared_holds() {
+        thread_local vector<SharedHold> holds;
+        return holds;
+    }
+
+    void acquired(LatchMode mode, bool contended, uint64_t wait) {
+        ModeCounters& counters = modes[(int) mode];
+        counters.acquisitions.fetch_add(1, memory_order_relaxed);
+        if (!contended)
+            return;
+        counters.contended.fetch_add(1, memory_order_relaxed);
+        counters.wait_ns.fetch_add(wait, memory_order_relaxed);
+        uint64_t seen = counters.max_wait_ns.load(memory_order_relaxed);
+        while (wait > seen && !counters.max_wait_ns.compare_exchange_weak(seen, wait, memory_order_relaxed)) {}
+    }
+
+public:
+    void lock() {
+        uint64_t start = now_ns();
+        bool contended = !latch.try_lock();
+        if (contended)
+            latch.lock();
+        uint64_t now = contended ? now_ns() : start;
+        acquired(LatchMode::Exclusive, contended, now - start);
+        exclusive_since = now;
+    }
+
+    bool try_lock() {
+        if (!latch.try_lock())
+            return false;
+        acquired(LatchMode::Exclusive, false, 0);
+        exclusive_since = now_ns();
+        return true;
+    }
+
+    void unlock() {
+        modes[(int) LatchMode::Exclusive].hold_ns.fetch_add(now_ns() - exclusive_since, memory_order_relaxed);
+        latch.unlock();
+    }
+
+    void lock_shared() {
+        uint64_t start = now_ns();
+        bool contended = !latch.try_lock_shared();
+        if (contended)
+            latch.lock_shared();
+        uint64_t now = contended ? now_ns() : start;
+        acquired(LatchMode::Shared, contended, now - start);
+        shared_holds().push_back({this, now});
+    }
+
+    bool try_lock_shared() {
+        if (!latch.try_lock_shared())
+            return false;
+        acquired(LatchMode::Shared, false, 0);
+        shared_holds().push_back({this, now_ns()});
+        return true;
+    }
+
+    void unlock_shared() {
+        vector<SharedHold>& holds = shared_holds();
+        for (size_t i = holds.size(); i-- > 0;) {
+            if (holds[i].latch == this) {
+                modes[(int) LatchMode::Shared].hold_ns.fetch_add(now_ns() - holds[i].since, memory_order_relaxed);
+                holds.erase(holds.begin() + i);
+                break;
+            }
+        }
+        latch.unlock_shared();
+    }
+
+    // The latch itself, for walks of the tree that should not show up in the profile
+    shared_timed_mutex& native() {
+        return latch;
+    }
+
+    LatchModeStats stats(LatchMode mode) const {
+        const ModeCounters& counters = modes[(int) mode];
+        LatchModeStats stats;
+        stats.acquisitions = counters.acquisitions.load(memory_order_relaxed);
+        stats.contended = counters.contended.load(memory_order_relaxed);
+        stats.wait_ns = counters.wait_ns.load(memory_order_relaxed);
+        stats.max_wait_ns = counters.max_wait_ns.load(memory_order_relaxed);
+        stats.hold_ns = counters.hold_ns.load(memory_order_relaxed);
+        return stats;
+    }
+
+    void reset() {
+        for (ModeCounters& counters : modes) {
+            counters.acquisitions.store(0, memory_order_relaxed);
+            counters.contended.store(0, memory_order_relaxed);
+            counters.wait_ns.store(0, memory_order_relaxed);
+            counters.max_wait_ns.store(0, memory_order_relaxed);
+            counters.hold_ns.store(0, memory_order_relaxed);
+        }
+    }
+};
+
+// One node's latch in a LockProfile. Depth 0 is the root.
+struct NodeLatchProfile
+{
+    const void* node = nullptr;
+    int depth = 0;
+    bool leaf = false;
+    LatchModeStats modes[2];
+
+    uint64_t wait_ns() const {
+        return modes[0].wait_ns + modes[1].wait_ns;
+    }
+};
+
+// Result of BPTree::lock_profile: totals per depth and mode, the split_mutex, and the nodes waited on longest
+struct LockProfile
+{
+    vector<LatchModeStats> shared_by_depth;
+    vector<LatchModeStats> exclusive_by_depth;
+    LatchModeStats split_mutex;
+    vector<NodeLatchProfile> hottest; // By total wait time, longest first
+
+    void print(ostream& out) const {
+        auto line = [&](const string& label, const LatchModeStats& stats) {
+            if (stats.acquisitions == 0)
+                return;
+            out << "  " << label << ": " << stats.acquisitions << " acquisitions, " << stats.contended << " contended, waited "
+                << stats.wait_ns / 1000 << " us (max " << stats.max_wait_ns / 1000 << " us), held " << stats.hold_ns / 1000 << " us" << endl;
+        };
+
+        out << " Lock profile by depth (0 is the root):" << endl;
+        for (size_t depth = 0; depth < shared_by_depth.size(); depth++) {
+            line("depth " + to_string(depth) + " shared", shared_by_depth[depth]);
+            line("depth " + to_string(depth) + " exclusive", exclusive_by_depth[depth]);
+        }
+        line("split_mutex", split_mutex);
+
+        out << " Hottest nodes:" << endl;
+        for (const NodeLatchProfile& node : hottest) {
+            out << "  " << (node.leaf ? "leaf " : "internal ") << node.node << " at depth " << node.depth << " waited "
+                << node.wait_ns() / 1000 << " us (" << node.modes[0].contended << " of " << node.modes[0].acquisitions
+                << " shared and " << node.modes[1].contended << " of " << node.modes[1].acquisitions << " exclusive contended)" << endl;
+        }
+    }
+};
+
+#ifdef BPTREE_LOCK_PROFILE
+using NodeLatch = ProfiledLatch;
+using SplitLatch = ProfiledLatch;
+#else
+using NodeLatch = shared_timed_mutex;
+using SplitLatch = mutex;
+#endif
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "bp_tree.cpp"
+
+using namespace std;
+
+// Knobs for a BPTreeMaintainer
+struct MaintenanceOptions
+{
+    double log_fill_threshold = 0.75; // A leaf whose log is at least this full gets flushed
+    int leaves_per_second = 20000;    // Upper bound on the leaves serviced, so upkeep never hogs the leaf locks
+    int interval_ms = 10;             // Pause between two rounds
+    int freeze_after_passes = 0;      // A leaf without inserts for this many rounds is frozen, 0 never freezes
+};
+
+// Background thread that keeps a BPTree's leaves flushed and sorted, and freezes the ones gone cold, by calling
+// maintenance_pass every interval_ms, with the budget of each round taken from leaves_per_second. Can be
+// paused, resumed and retuned while running.
+template <typename KeyType, typename ValueType>
+class BPTreeMaintainer {
+private:
+    BPTree<KeyType, ValueType>& tree;
+    MaintenanceOptions options;
+
+    thread worker;
+    mutex state_mutex;
+    condition_variable wake_cv;
+    bool running = false;
+    bool stopping = false;
+    bool paused = false;
+
+    atomic<uint64_t> passes{0};
+    atomic<uint64_t> leaves_serviced{0};
+
+    void run() {
+        unique_lock<mutex> lock(state_mutex);
+        while (!stopping) {
+            if (paused) {
+                wake_cv.wait(lock);
+                continue;
+            }
+
+            MaintenanceOptions round = options;
+            lock.unlock();
+            int budget = max(1, (int) ((long long) round.leaves_per_second * round.interval_ms / 1000));
+            int serviced = tree.maintenance_pass(round.log_fill_threshold, budget, round.freeze_after_passes);
+            passes.fetch_add(1, memory_order_relaxed);
+            leaves_serviced.fetch_add(serviced, memory_order_relaxed);
+            lock.lock();
+
+            wake_cv.wait_for(lock, chrono::milliseconds(round.interval_ms), [&] { return stopping; });
+        }
+    }
+
+public:
+    BPTreeMaintainer(BPTree<KeyType, ValueType>& tree, MaintenanceOptions opts = MaintenanceOptions()) : tree(tree), options(opts) {}
+
+    ~BPTreeMaintainer() {
+        stop();
+    }
+
+    void start() {
+        lock_guard<mutex> lock(state_mutex);
+        if (running)
+            return;
+        running = true;
+        stopping = false;
+        paused = false;
+        worker = thread(&BPTreeMaintainer::run, this);
+    }
+
+    // Waits for the current round to finish, then joins the thread
+    void stop() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (!running)
+                return;
+            stopping = true;
+        }
+        wake_cv.notify_all();
+        worker.join();
+        running = false;
+    }
+
+    void pause() {
+        lock_guard<mutex> lock(state_mutex);
+        paused = true;
+    }
+
+    void resume() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            paused = false;
+        }
+        wake_cv.notify_all();
+    }
+
+    // Takes effect from the next round
+    void set_rate(int leaves_per_second, int interval_ms) {
+        lock_guard<mutex> lock(state_mutex);
+        options.leaves_per_second = leaves_per_second;
+        options.interval_ms = max(1, interval_ms);
+    }
+
+    void set_log_fill_threshold(double threshold) {
+        lock_guard<mutex> lock(state_mutex);
+        options.log_fill_threshold = threshold;
+    }
+
+    void set_freeze_after(int passes) {
+        lock_guard<mutex> lock(state_mutex);
+        options.freeze_after_passes = max(0, passes);
+    }
+
+    uint64_t num_passes() const {
+        return passes.load(memory_order_relaxed);
+    }
+
+    uint64_t num_leaves_serviced() const {
+        return leaves_serviced.load(memory_order_relaxed);
+    }
+};
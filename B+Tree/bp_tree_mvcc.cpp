@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "../BPA/bpa.cpp"
+
+using namespace std;
+
+// Contents of a leaf as they were for read views taken in [start_ts, end_ts), saved by the write that ended
+// that interval. Versions of one leaf are chained newest first.
+template <typename KeyType, typename ValueType>
+struct LeafVersion
+{
+    uint64_t start_ts;
+    uint64_t end_ts;
+    vector<ElementBPA<KeyType, ValueType>> elts; // Sorted, as collect_sorted returns them
+    LeafVersion* older = nullptr;
+};
+
+// Pinned point in time of a BPTree, from begin_read until end_read
+struct ReadView
+{
+    uint64_t ts = 0;
+};
+
+// Hands out read timestamps and tracks the ones still in use. The clock only advances when a view is taken, so
+// a write stamped with the current clock is seen by exactly the views taken from then on. A write has to save
+// the old contents of its leaf only if a view exists that was taken after the leaf last changed.
+class ReadViewRegistry {
+private:
+    mutex registry_mutex;
+    multiset<uint64_t> active;
+    atomic<uint64_t> clock{1};
+    atomic<int> num_active{0};
+    atomic<uint64_t> oldest{UINT64_MAX};
+
+public:
+    uint64_t begin() {
+        lock_guard<mutex> guard(registry_mutex);
+        // The view is fully registered before the clock moves, so a writer that sees the new time also sees the
+        // view, both to save a version for it and to keep that version from being pruned. Only begin moves the clock.
+        uint64_t ts = clock.load();
+        active.insert(ts);
+        oldest.store(*active.begin());
+        num_active.fetch_add(1);
+        clock.store(ts + 1);
+        return ts;
+    }
+
+    void end(uint64_t ts) {
+        lock_guard<mutex> guard(registry_mutex);
+        auto it = active.find(ts);
+        if (it == active.end())
+            return;
+        active.erase(it);
+        num_active.fetch_sub(1);
+        oldest.store(active.empty() ? UINT64_MAX : *active.begin());
+    }
+
+    // Timestamp for a write happening now
+    uint64_t now() const {
+        return clock.load();
+    }
+
+    bool any_active() const {
+        return num_active.load() > 0;
+    }
+
+    // Versions that ended at or before this are no longer visible to anyone
+    uint64_t oldest_active() const {
+        return oldest.load();
+    }
+};
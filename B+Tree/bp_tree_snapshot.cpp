@@ -0,0 +1,280 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// On-disk snapshot of a BPTree. Every reference inside the file is a byte offset from the start of the file,
+// so the file can be mapped anywhere and read in place. Layout:
+//   header | leaf records in key order | internal node records, one level after another, root last
+// Leaf record:     BPTreeSnapshotLeaf, then count keys, then count values (each array padded to 8 bytes)
+// Internal record: BPTreeSnapshotInternal, then num_keys keys (padded to 8 bytes), then num_keys + 1 child offsets
+const char bptree_snapshot_magic[8] = {'B', 'P', 'T', 'S', 'N', 'A', 'P', '1'};
+
+struct BPTreeSnapshotHeader
+{
+    char magic[8];
+    uint32_t key_size;
+    uint32_t value_size;
+    int32_t order;
+    int32_t log_size;
+    int32_t num_blocks;
+    int32_t block_size;
+    uint64_t num_entries;
+    uint64_t num_leaves;
+    uint64_t first_leaf; // Offset of the leftmost leaf, 0 if the tree is empty
+    uint64_t root;       // Offset of the root node, 0 if the tree is empty
+    uint32_t height;     // Number of levels, 1 when the root is a leaf
+    uint32_t reserved;
+};
+
+struct BPTreeSnapshotLeaf
+{
+    uint64_t count;
+    uint64_t next; // Offset of the next leaf, 0 for the last one
+};
+
+struct BPTreeSnapshotInternal
+{
+    uint64_t num_keys;
+};
+
+inline uint64_t snapshot_align(uint64_t n) {
+    return (n + 7) & ~uint64_t(7);
+}
+
+// Read-only view of a snapshot file. Pages are mapped copy-on-write and fault in lazily as lookups touch them,
+// so opening a snapshot costs one mmap no matter how large the tree is.
+template <typename KeyType, typename ValueType>
+class BPTreeSnapshot {
+private:
+    char* base = nullptr;
+    uint64_t length = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE map_handle = NULL;
+#endif
+
+    const BPTreeSnapshotHeader* head() const {
+        return reinterpret_cast<const BPTreeSnapshotHeader*>(base);
+    }
+
+    // Bounds check for a record of size bytes at offset
+    bool in_file(uint64_t offset, uint64_t size) const {
+        return offset >= sizeof(BPTreeSnapshotHeader) && offset <= length && size <= length - offset;
+    }
+
+    // Bounds check for a record whose header of head_size bytes at offset is followed by count keys, padded, and
+    // then count + extra entries of entry_size bytes. Records are 8-byte aligned, like the writer lays them out.
+    bool record_in_file(uint64_t offset, uint64_t head_size, uint64_t count, uint64_t extra, uint64_t entry_size) const {
+        if (offset % 8 != 0 || !in_file(offset, head_size))
+            return false;
+        // Anything larger could not fit, and would overflow the byte counts below
+        uint64_t room = length - offset - head_size;
+        if (count > room / max<uint64_t>(sizeof(KeyType), 1) || count + extra > room / entry_size)
+            return false;
+        return head_size + snapshot_align(count * sizeof(KeyType)) + (count + extra) * entry_size <= length - offset;
+    }
+
+    // Leaf record at offset, or nullptr if it does not lie wholly inside the file
+    const BPTreeSnapshotLeaf* leaf_at(uint64_t offset) const {
+        if (!in_file(offset, sizeof(BPTreeSnapshotLeaf)))
+            return nullptr;
+        const BPTreeSnapshotLeaf* leaf = reinterpret_cast<const BPTreeSnapshotLeaf*>(base + offset);
+        return record_in_file(offset, sizeof(BPTreeSnapshotLeaf), leaf->count, 0, sizeof(ValueType)) ? leaf : nullptr;
+    }
+
+    // Internal record at offset, or nullptr if it does not lie wholly inside the file
+    const BPTreeSnapshotInternal* internal_at(uint64_t offset) const {
+        if (!in_file(offset, sizeof(BPTreeSnapshotInternal)))
+            return nullptr;
+        const BPTreeSnapshotInternal* node = reinterpret_cast<const BPTreeSnapshotInternal*>(base + offset);
+        return record_in_file(offset, sizeof(BPTreeSnapshotInternal), node->num_keys, 1, sizeof(uint64_t)) ? node : nullptr;
+    }
+
+    // Root record at the level the header gives it
+    bool root_valid() const {
+        const BPTreeSnapshotHeader* h = head();
+        return (h->height > 1) ? internal_at(h->root) != nullptr : leaf_at(h->root) != nullptr;
+    }
+
+public:
+    ~BPTreeSnapshot() {
+        close();
+    }
+
+    // Maps the file at path and validates its header, root and first leaf. Returns false if the file is missing,
+    // truncated or was not written by a BPTree with the same key and value types. The other records are only
+    // bounds-checked as lookups reach them, so that opening stays independent of the size of the tree.
+    bool open(const char* path) {
+        close();
+#ifdef _WIN32
+        file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_handle, &size) || size.QuadPart < (LONGLONG) sizeof(BPTreeSnapshotHeader)) {
+            close();
+            return false;
+        }
+        map_handle = CreateFileMappingA(file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (map_handle == NULL) {
+            close();
+            return false;
+        }
+        base = (char*) MapViewOfFile(map_handle, FILE_MAP_COPY, 0, 0, 0);
+        length = size.QuadPart;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(BPTreeSnapshotHeader)) {
+            ::close(fd);
+            return false;
+        }
+        // Private mapping so that find can hand out writable value pointers without touching the file
+        void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        base = (char*) addr;
+        length = st.st_size;
+#endif
+        if (base == nullptr) {
+            close();
+            return false;
+        }
+
+        const BPTreeSnapshotHeader* h = head();
+        bool valid = memcmp(h->magic, bptree_snapshot_magic, sizeof(h->magic)) == 0
+            && h->key_size == sizeof(KeyType) && h->value_size == sizeof(ValueType)
+            && (h->num_leaves == 0 || (h->height >= 1 && h->height <= 64 && root_valid() && leaf_at(h->first_leaf) != nullptr));
+        if (!valid) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (base != nullptr)
+            UnmapViewOfFile(base);
+        if (map_handle != NULL)
+            CloseHandle(map_handle);
+        if (file_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(file_handle);
+        map_handle = NULL;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if (base != nullptr)
+            munmap(base, length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    bool is_open() const {
+        return base != nullptr;
+    }
+
+    const BPTreeSnapshotHeader& header() const {
+        return *head();
+    }
+
+    uint64_t size() const {
+        return head()->num_entries;
+    }
+
+    // Binary searches down the internal levels and into the leaf, returns nullptr if the key is absent or a
+    // record on the way lies outside the file
+    ValueType* find(const KeyType& key) const {
+        const BPTreeSnapshotHeader* h = head();
+        if (h->num_leaves == 0)
+            return nullptr;
+
+        uint64_t offset = h->root;
+        for (uint32_t level = h->height; level > 1; level--) {
+            const BPTreeSnapshotInternal* node = internal_at(offset);
+            if (node == nullptr)
+                return nullptr;
+            uint64_t num_keys = node->num_keys;
+            const KeyType* keys = reinterpret_cast<const KeyType*>(base + offset + sizeof(BPTreeSnapshotInternal));
+            const uint64_t* children = reinterpret_cast<const uint64_t*>(base + offset + sizeof(BPTreeSnapshotInternal) + snapshot_align(num_keys * sizeof(KeyType)));
+
+            // Same routing as BPTree::traverse: child i holds the keys below keys[i]
+            offset = children[upper_bound(keys, keys + num_keys, key) - keys];
+        }
+
+        const BPTreeSnapshotLeaf* leaf = leaf_at(offset);
+        if (leaf == nullptr)
+            return nullptr;
+        uint64_t count = leaf->count;
+        KeyType* keys = reinterpret_cast<KeyType*>(base + offset + sizeof(BPTreeSnapshotLeaf));
+        ValueType* values = reinterpret_cast<ValueType*>(base + offset + sizeof(BPTreeSnapshotLeaf) + snapshot_align(count * sizeof(KeyType)));
+
+        KeyType* found = lower_bound(keys, keys + count, key);
+        if (found == keys + count || key < *found)
+            return nullptr;
+        return &values[found - keys];
+    }
+
+    // Reads every leaf record once and checks what the header and a bottom-up rebuild rely on: each record lies
+    // inside the file, keys increase strictly within and across leaves, and the chain ends after num_leaves
+    // leaves holding num_entries entries in all. Costs a pass over the whole file, unlike open.
+    bool validate_leaves() const {
+        const BPTreeSnapshotHeader* h = head();
+        uint64_t leaves = 0;
+        uint64_t entries = 0;
+        bool has_last = false;
+        bool sorted = true;
+        KeyType last_key{};
+        uint64_t offset = h->first_leaf;
+        while (h->num_leaves > 0 && leaves < h->num_leaves) {
+            const BPTreeSnapshotLeaf* leaf = leaf_at(offset);
+            if (leaf == nullptr)
+                return false;
+            const KeyType* keys = reinterpret_cast<const KeyType*>(base + offset + sizeof(BPTreeSnapshotLeaf));
+            for (uint64_t i = 0; i < leaf->count && sorted; i++) {
+                sorted = !has_last || last_key < keys[i];
+                last_key = keys[i];
+                has_last = true;
+            }
+            if (!sorted)
+                return false;
+            leaves++;
+            entries += leaf->count;
+            offset = leaf->next;
+        }
+        return (h->num_leaves == 0 || offset == 0) && entries == h->num_entries;
+    }
+
+    // Walks the leaf records in key order, handing each one to f as a pair of packed key and value arrays. Stops
+    // and returns false at the first record that lies outside the file.
+    bool for_each_leaf(function<void(const KeyType*, const ValueType*, uint64_t)> f) const {
+        uint64_t offset = head()->first_leaf;
+        for (uint64_t i = 0; i < head()->num_leaves; i++) {
+            const BPTreeSnapshotLeaf* leaf = leaf_at(offset);
+            if (leaf == nullptr)
+                return false;
+            const KeyType* keys = reinterpret_cast<const KeyType*>(base + offset + sizeof(BPTreeSnapshotLeaf));
+            const ValueType* values = reinterpret_cast<const ValueType*>(base + offset + sizeof(BPTreeSnapshotLeaf) + snapshot_align(leaf->count * sizeof(KeyType)));
+            f(keys, values, leaf->count);
+            offset = leaf->next;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+
+// One level of a BPTree in a BPTreeSpaceReport
+struct BPTreeLevelFill
+{
+    size_t nodes = 0;
+    size_t entries = 0;  // Children of internal nodes, live elements of leaves
+    size_t capacity = 0; // The order for each internal node, the BPA capacity for each leaf
+
+    double fill() const {
+        return capacity == 0 ? 0 : (double) entries / capacity;
+    }
+};
+
+// Where a BPTree's memory goes, returned by BPTree::space_report. Byte counts are of the tree's own structures,
+// container capacity included, and leave out allocator overhead.
+struct BPTreeSpaceReport
+{
+    size_t live_entries = 0;     // Distinct keys
+    size_t counted_elements = 0; // What the leaves count, which includes duplicates not yet dropped by a redistribution
+    size_t payload_bytes = 0;    // A key and a value per live entry
+
+    size_t internal_bytes = 0;   // Internal nodes with their separators, child pointers and packed keys
+    size_t leaf_bytes = 0;       // The leaf objects themselves
+    size_t bpa_bytes = 0;        // BPA arrays of the leaves that are not frozen
+    size_t cold_bytes = 0;       // Compact copies held by frozen leaves
+    size_t version_bytes = 0;    // Old leaf contents kept for read views
+    size_t arena_bytes = 0;      // Out-of-line key bytes, separators included
+    size_t filter_bytes = 0;
+    size_t retired_leaves = 0;   // Merged away by compact_leaves and not yet freed
+    size_t retired_bytes = 0;
+
+    size_t allocator_bytes = 0;  // What the tree's MemoryPolicy holds from the system, 0 for the heap or if it cannot tell
+
+    vector<BPTreeLevelFill> levels; // Root first, leaves last
+
+    size_t total_bytes() const {
+        return internal_bytes + leaf_bytes + bpa_bytes + cold_bytes + version_bytes + arena_bytes + filter_bytes + retired_bytes;
+    }
+
+    double bytes_per_entry() const {
+        return live_entries == 0 ? 0 : (double) total_bytes() / live_entries;
+    }
+
+    // Bytes held per byte of payload
+    double amplification() const {
+        return payload_bytes == 0 ? 0 : (double) total_bytes() / payload_bytes;
+    }
+
+    void print(ostream& out) const {
+        out << " Space: " << live_entries << " live entries (" << counted_elements << " counted) in " << total_bytes()
+            << " bytes, " << bytes_per_entry() << " bytes per entry, " << amplification() << "x the payload" << endl;
+        out << "  internal " << internal_bytes << ", leaves " << leaf_bytes << ", BPA arrays " << bpa_bytes << ", cold "
+            << cold_bytes << ", versions " << version_bytes << ", arenas " << arena_bytes << ", filters " << filter_bytes
+            << ", retired " << retired_bytes << " (" << retired_leaves << " leaves)" << endl;
+        if (allocator_bytes > 0)
+            out << "  allocator holds " << allocator_bytes << " bytes" << endl;
+        for (size_t depth = 0; depth < levels.size(); depth++) {
+            out << "  level " << depth << ": " << levels[depth].nodes << " nodes " << levels[depth].fill() * 100
+                << "% full" << endl;
+        }
+    }
+};
+
+// What one BPTree::compact_leaves call did
+struct BPTreeCompaction
+{
+    int merged = 0;   // Leaves emptied into their right neighbour
+    int repacked = 0; // Leaves rewritten in place to drop duplicates and empty the log
+    int unlinked = 0; // Merged leaves taken off the leaf chain once no read view needed them
+    int freed = 0;    // Unlinked leaves deleted once no operation could still be holding them
+};
+
+// Tells when every BPTree operation running at a given moment has finished, so that a leaf taken out of the
+// tree at that moment can be freed. Operations count themselves in and out of the current phase on a per-thread
+// slot. After leaves are unlinked, once each phase has been seen empty every operation that could have reached
+// them is done; switching the phase lets the one new operations were entering drain as well.
+class OperationPhases {
+private:
+    static constexpr int num_slots = 64;
+
+    struct alignas(64) Slot
+    {
+        atomic<int64_t> active[2];
+    };
+
+    unique_ptr<Slot[]> slots;
+    atomic<int> phase{0};
+
+    static int thread_slot() {
+        static atomic<int> next_slot{0};
+        thread_local int slot = next_slot.fetch_add(1, memory_order_relaxed) % num_slots;
+        return slot;
+    }
+
+public:
+    OperationPhases() : slots(new Slot[num_slots]) {
+        for (int i = 0; i < num_slots; i++) {
+            slots[i].active[0].store(0, memory_order_relaxed);
+            slots[i].active[1].store(0, memory_order_relaxed);
+        }
+    }
+
+    // Counts the calling thread in for as long as it lives
+    class Scope {
+    private:
+        OperationPhases& phases;
+        int slot;
+        int entered;
+
+    public:
+        Scope(OperationPhases& phases) : phases(phases), slot(thread_slot()), entered(phases.phase.load()) {
+            phases.slots[slot].active[entered].fetch_add(1);
+        }
+
+        ~Scope() {
+            phases.slots[slot].active[entered].fetch_sub(1, memory_order_release);
+        }
+    };
+
+    int current() const {
+        return phase.load();
+    }
+
+    void advance() {
+        phase.store(phase.load() ^ 1);
+    }
+
+    // True if no operation is counted in phase p right now
+    bool quiet(int p) const {
+        int64_t sum = 0;
+        for (int i = 0; i < num_slots; i++)
+            sum += slots[i].active[p].load();
+        return sum == 0;
+    }
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "../BPA/bpa.cpp"
+
+using namespace std;
+
+// Events a BPTree counts when built with BPTREE_STATS defined. Without it the counting compiles away and stats()
+// reports only what it reads off the tree itself.
+enum class BPTreeEvent
+{
+    LeafSplit,
+    InternalSplit,
+    RootSplit,        // The tree grew a level
+    LeafMoveRight,    // A descent reached a leaf that had just split and moved on to its right neighbour
+    SplitLinkRetry,   // A split waited for the split that created its leaf to be linked into the parent
+    ExclusiveScan,    // Range operation that write-locks each leaf it visits: iterate_range, map_range, parallel_map_range
+    SharedScan,       // Range operation that only read-locks: scan_view, for_each_run, scan_into
+    Freeze,
+    Thaw,
+    LeafMerge,        // compact_leaves emptied a leaf into its right neighbour
+    NumEvents
+};
+
+// Snapshot returned by BPTree::stats
+struct BPTreeStats
+{
+    bool counters_enabled = false; // False if built without BPTREE_STATS, every event count but redistributions is then zero
+
+    // BPA events, summed over the leaves
+    uint64_t log_flushes = 0;
+    uint64_t redistributions = 0;          // Of any cause, including every flush of a fresh BPA. Always counted.
+    uint64_t overflow_redistributions = 0; // A flush found a block without room for its share of the log
+
+    // Tree events
+    uint64_t leaf_splits = 0;
+    uint64_t internal_splits = 0;
+    uint64_t root_splits = 0;
+    uint64_t leaf_move_rights = 0;
+    uint64_t split_link_retries = 0;
+    uint64_t exclusive_scans = 0;
+    uint64_t shared_scans = 0;
+    uint64_t freezes = 0;
+    uint64_t thaws = 0;
+    uint64_t leaf_merges = 0;
+
+    // Shape, as stats() found it
+    int height = 0;                  // Levels, 1 for a tree that is a single leaf
+    size_t leaf_count = 0;           // Live leaves, retired ones left out
+    size_t frozen_leaves = 0;
+    size_t elements = 0;
+    double average_fill = 0;         // Elements over BPA capacity, log excluded, across all leaves
+    double average_log_fill = 0;     // Share of log slots in use, across the leaves that are not frozen
+};
+
+// Event counts striped over cache line sized slots. A thread always increments the same slot, so threads only
+// share one when there are more of them than slots, and reading the totals sums all the slots.
+class BPTreeEventCounters {
+private:
+    static constexpr int num_slots = 64;
+
+    struct alignas(64) Slot
+    {
+        atomic<uint64_t> counts[(int) BPTreeEvent::NumEvents];
+    };
+
+    unique_ptr<Slot[]> slots;
+
+    static int thread_slot() {
+        static atomic<int> next_slot{0};
+        thread_local int slot = next_slot.fetch_add(1, memory_order_relaxed) % num_slots;
+        return slot;
+    }
+
+public:
+    BPTreeEventCounters() : slots(new Slot[num_slots]) {
+        for (int i = 0; i < num_slots; i++) {
+            for (atomic<uint64_t>& count : slots[i].counts)
+                count.store(0, memory_order_relaxed);
+        }
+    }
+
+    void add(BPTreeEvent event) {
+        slots[thread_slot()].counts[(int) event].fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t total(BPTreeEvent event) const {
+        uint64_t sum = 0;
+        for (int i = 0; i < num_slots; i++)
+            sum += slots[i].counts[(int) event].load(memory_order_relaxed);
+        return sum;
+    }
+};
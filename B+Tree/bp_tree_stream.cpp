@@ -0,0 +1,231 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <type_traits>
+#include "bp_tree.cpp"
+
+using namespace std;
+
+// Streaming dump format for BPTree contents:
+//   BPTreeStreamHeader, then blocks of BPTreeStreamBlock followed by payload_bytes of payload, then a block with count 0
+// A payload holds count keys followed by count values, in ascending key order. Compressed blocks store each key as
+// a varint delta from the previous one and each value as a zigzag varint, which only applies to integral types.
+// A block holds at most bptree_stream_max_block_entries elements, so a reader never buffers more than that.
+const char bptree_stream_magic[8] = {'B', 'P', 'T', 'S', 'T', 'R', 'M', '1'};
+const uint32_t bptree_stream_compressed = 1;
+const uint32_t bptree_stream_max_block_entries = 1 << 24;
+const size_t bptree_stream_max_varint_bytes = 10;
+
+struct BPTreeStreamHeader
+{
+    char magic[8];
+    uint32_t key_size;
+    uint32_t value_size;
+};
+
+struct BPTreeStreamBlock
+{
+    uint32_t count;
+    uint32_t flags;
+    uint64_t payload_bytes;
+};
+
+inline void stream_put_varint(vector<char>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char) v);
+}
+
+inline uint64_t stream_get_varint(const char*& in, const char* end) {
+    uint64_t v = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        v |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return v;
+}
+
+// Encodes one block of count sorted elements into payload and returns the flags describing it
+template <typename KeyType, typename ValueType>
+uint32_t stream_encode_block(const ElementBPA<KeyType, ValueType>* elts, size_t count, bool compress, vector<char>& payload) {
+    payload.clear();
+    if constexpr (is_integral<KeyType>::value && is_integral<ValueType>::value) {
+        if (compress) {
+            uint64_t prev = 0;
+            for (size_t i = 0; i < count; i++) {
+                uint64_t key = (uint64_t) elts[i].key;
+                stream_put_varint(payload, key - prev);
+                prev = key;
+            }
+            for (size_t i = 0; i < count; i++) {
+                int64_t value = (int64_t) elts[i].value;
+                stream_put_varint(payload, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+            }
+            return bptree_stream_compressed;
+        }
+    }
+
+    payload.resize(count * (sizeof(KeyType) + sizeof(ValueType)));
+    char* out = payload.data();
+    for (size_t i = 0; i < count; i++, out += sizeof(KeyType))
+        memcpy(out, &elts[i].key, sizeof(KeyType));
+    for (size_t i = 0; i < count; i++, out += sizeof(ValueType))
+        memcpy(out, &elts[i].value, sizeof(ValueType));
+    return 0;
+}
+
+// Decodes one block back into elements, returns false if the payload is malformed
+template <typename KeyType, typename ValueType>
+bool stream_decode_block(const vector<char>& payload, const BPTreeStreamBlock& block, vector<ElementBPA<KeyType, ValueType>>& elts) {
+    elts.resize(block.count);
+    const char* in = payload.data();
+    const char* end = in + payload.size();
+
+    if (block.flags & bptree_stream_compressed) {
+        if constexpr (is_integral<KeyType>::value && is_integral<ValueType>::value) {
+            uint64_t key = 0;
+            for (uint32_t i = 0; i < block.count; i++) {
+                key += stream_get_varint(in, end);
+                elts[i].isNull = false;
+                elts[i].key = (KeyType) key;
+            }
+            for (uint32_t i = 0; i < block.count; i++) {
+                uint64_t zigzag = stream_get_varint(in, end);
+                elts[i].value = (ValueType) (int64_t) ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+            }
+            return in == end;
+        }
+        return false;
+    }
+
+    if (payload.size() != (size_t) block.count * (sizeof(KeyType) + sizeof(ValueType)))
+        return false;
+    for (uint32_t i = 0; i < block.count; i++, in += sizeof(KeyType)) {
+        elts[i].isNull = false;
+        memcpy(&elts[i].key, in, sizeof(KeyType));
+    }
+    for (uint32_t i = 0; i < block.count; i++, in += sizeof(ValueType))
+        memcpy(&elts[i].value, in, sizeof(ValueType));
+    return true;
+}
+
+// Writes the contents of tree to out in key order, walking the leaf chain once. Memory use is one leaf plus one
+// output block of up to block_entries elements. Returns the number of entries written, or -1 if out failed,
+// e.g. on a full disk; nothing more is written once it has.
+template <typename KeyType, typename ValueType>
+int64_t bptree_export(BPTree<KeyType, ValueType>& tree, ostream& out, bool compress = false, size_t block_entries = 65536) {
+    static_assert(is_trivially_copyable<KeyType>::value && is_trivially_copyable<ValueType>::value, "the stream format stores keys and values as raw bytes");
+    static_assert(!KeyTraits<KeyType>::out_of_line, "the stream format cannot hold out-of-line keys");
+
+    BPTreeStreamHeader header = {};
+    memcpy(header.magic, bptree_stream_magic, sizeof(header.magic));
+    header.key_size = sizeof(KeyType);
+    header.value_size = sizeof(ValueType);
+    out.write((const char*) &header, sizeof(header));
+    block_entries = max<size_t>(1, min<size_t>(block_entries, bptree_stream_max_block_entries));
+
+    int64_t written = 0;
+    vector<ElementBPA<KeyType, ValueType>> pending;
+    vector<char> payload;
+
+    auto write_block = [&]() {
+        if (!out) {
+            pending.clear();
+            return;
+        }
+        BPTreeStreamBlock block = {};
+        block.count = pending.size();
+        block.flags = stream_encode_block(pending.data(), pending.size(), compress, payload);
+        block.payload_bytes = payload.size();
+        out.write((const char*) &block, sizeof(block));
+        out.write(payload.data(), payload.size());
+        written += pending.size();
+        pending.clear();
+    };
+
+    tree.for_each_run([&](const ElementBPA<KeyType, ValueType>* elts, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            pending.push_back(elts[i]);
+            if (pending.size() == block_entries)
+                write_block();
+        }
+    });
+    if (!pending.empty())
+        write_block();
+
+    BPTreeStreamBlock terminator = {};
+    out.write((const char*) &terminator, sizeof(terminator));
+    out.flush();
+    return out.good() ? written : -1;
+}
+
+// Checks a block header read from a stream before anything is allocated for it: the count is capped, and the
+// payload size must fit the count, exactly for raw blocks and within the varint bounds for compressed ones.
+template <typename KeyType, typename ValueType>
+bool stream_block_valid(const BPTreeStreamBlock& block) {
+    if (block.count > bptree_stream_max_block_entries || (block.flags & ~bptree_stream_compressed) != 0)
+        return false;
+    if (block.flags & bptree_stream_compressed)
+        return block.payload_bytes >= 2 * (uint64_t) block.count && block.payload_bytes <= 2 * bptree_stream_max_varint_bytes * block.count;
+    return block.payload_bytes == (uint64_t) block.count * (sizeof(KeyType) + sizeof(ValueType));
+}
+
+// Reads n bytes into payload, growing it a chunk at a time so that a size the input does not back up fails on
+// the missing bytes rather than allocating all of them up front
+inline bool stream_read_payload(istream& in, uint64_t n, vector<char>& payload) {
+    const uint64_t chunk = 1 << 20;
+    payload.clear();
+    while (payload.size() < n) {
+        size_t have = payload.size();
+        size_t want = (size_t) min(chunk, n - have);
+        payload.resize(have + want);
+        if (!in.read(payload.data() + have, want))
+            return false;
+    }
+    return true;
+}
+
+// Feeds a stream written by bptree_export straight into a bottom-up build of tree, one block at a time.
+// tree should be freshly constructed. Returns the number of entries loaded, or -1 if the stream is malformed,
+// including keys that are not strictly increasing; the tree is then left without its internal levels rebuilt.
+template <typename KeyType, typename ValueType>
+int64_t bptree_import(BPTree<KeyType, ValueType>& tree, istream& in) {
+    BPTreeStreamHeader header;
+    if (!in.read((char*) &header, sizeof(header)) || memcmp(header.magic, bptree_stream_magic, sizeof(header.magic)) != 0
+        || header.key_size != sizeof(KeyType) || header.value_size != sizeof(ValueType))
+        return -1;
+
+    int64_t loaded = 0;
+    vector<char> payload;
+    vector<ElementBPA<KeyType, ValueType>> elts;
+    BPTreeStreamBlock block;
+    bool has_last = false;
+    KeyType last_key{};
+
+    while (in.read((char*) &block, sizeof(block)) && block.count > 0) {
+        if (!stream_block_valid<KeyType, ValueType>(block) || !stream_read_payload(in, block.payload_bytes, payload)
+            || !stream_decode_block(payload, block, elts))
+            return -1;
+        // bulk_append relies on the keys being sorted and unique, across blocks as well as within them
+        for (const ElementBPA<KeyType, ValueType>& elt : elts) {
+            if (has_last && !(last_key < elt.key))
+                return -1;
+            last_key = elt.key;
+            has_last = true;
+        }
+        tree.bulk_append(elts.data(), elts.size());
+        loaded += elts.size();
+    }
+    if (!in)
+        return -1;
+
+    tree.bulk_finish();
+    return loaded;
+}
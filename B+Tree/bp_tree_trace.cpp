@@ -0,0 +1,218 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+#include "bp_tree_keys.cpp"
+
+using namespace std;
+
+// Binary trace of the operations a BPTree served, for replaying a workload with identical inputs. Layout:
+//   header | records, in the order the tree was called
+// Record: op byte, calling thread as a varint, microseconds since the previous record as a varint, the raw key,
+// then the raw value of an insert or the int32 length of a range. Finds carry nothing after the key. Varints
+// are LEB128, 7 bits a byte, low bits first.
+const char bptree_trace_magic[8] = {'B', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct BPTreeTraceHeader
+{
+    char magic[8];
+    uint32_t key_size;
+    uint32_t value_size;
+};
+
+enum class TraceOp : uint8_t
+{
+    Insert = 0,
+    Find = 1,
+    Range = 2 // iterate_range, scan_view or scan_into from a key, for a number of elements
+};
+
+template <typename KeyType, typename ValueType>
+struct TraceRecord
+{
+    TraceOp op;
+    uint32_t thread;  // Small number for the recording thread, in the order threads first recorded
+    uint64_t time_us; // Since the recorder was opened
+    KeyType key;
+    ValueType value;  // Inserts only
+    int32_t length;   // Ranges only
+};
+
+// Records operations into a trace file. Threads append under one mutex into a shared buffer that is written
+// out in 64KB chunks, so the file holds a single order of operations across threads. That is cheap next to a
+// tree operation but not free; attach a recorder only while capturing.
+template <typename KeyType, typename ValueType>
+class BPTreeTraceRecorder {
+private:
+    static_assert(is_trivially_copyable<KeyType>::value && is_trivially_copyable<ValueType>::value, "trace records store keys and values as raw bytes");
+    static_assert(!KeyTraits<KeyType>::out_of_line, "trace records cannot hold out-of-line keys");
+    static const size_t flush_bytes = 1 << 16;
+
+    mutex trace_mutex;
+    ofstream out;
+    vector<char> buffer;
+    chrono::steady_clock::time_point opened;
+    uint64_t last_us = 0;
+    uint64_t num_records = 0;
+
+    static uint32_t thread_number() {
+        static atomic<uint32_t> next_thread{0};
+        thread_local uint32_t number = next_thread.fetch_add(1, memory_order_relaxed);
+        return number;
+    }
+
+    void put_varint(uint64_t v) {
+        while (v >= 0x80) {
+            buffer.push_back((char) (v | 0x80));
+            v >>= 7;
+        }
+        buffer.push_back((char) v);
+    }
+
+    void put_bytes(const void* bytes, size_t n) {
+        buffer.insert(buffer.end(), (const char*) bytes, (const char*) bytes + n);
+    }
+
+    // Writes the fixed part of a record, called under trace_mutex
+    void begin_record(TraceOp op, const KeyType& key) {
+        uint64_t now = (uint64_t) chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - opened).count();
+        buffer.push_back((char) op);
+        put_varint(thread_number());
+        put_varint(now - last_us);
+        put_bytes(&key, sizeof(KeyType));
+        last_us = now;
+        num_records++;
+    }
+
+    void end_record() {
+        if (buffer.size() >= flush_bytes)
+            flush();
+    }
+
+    void flush() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+public:
+    ~BPTreeTraceRecorder() {
+        close();
+    }
+
+    // Starts a new trace at path, replacing any file there
+    bool open(const char* path) {
+        close();
+        lock_guard<mutex> guard(trace_mutex);
+        out.open(path, ios::binary | ios::trunc);
+        if (!out)
+            return false;
+
+        BPTreeTraceHeader header;
+        memcpy(header.magic, bptree_trace_magic, sizeof(header.magic));
+        header.key_size = sizeof(KeyType);
+        header.value_size = sizeof(ValueType);
+        out.write((const char*) &header, sizeof(header));
+        buffer.reserve(flush_bytes + 64);
+        opened = chrono::steady_clock::now();
+        last_us = 0;
+        num_records = 0;
+        return true;
+    }
+
+    // Writes out whatever is buffered and closes the file
+    void close() {
+        lock_guard<mutex> guard(trace_mutex);
+        if (!out.is_open())
+            return;
+        flush();
+        out.close();
+    }
+
+    uint64_t records() {
+        lock_guard<mutex> guard(trace_mutex);
+        return num_records;
+    }
+
+    void record_insert(const KeyType& key, const ValueType& value) {
+        lock_guard<mutex> guard(trace_mutex);
+        begin_record(TraceOp::Insert, key);
+        put_bytes(&value, sizeof(ValueType));
+        end_record();
+    }
+
+    void record_find(const KeyType& key) {
+        lock_guard<mutex> guard(trace_mutex);
+        begin_record(TraceOp::Find, key);
+        end_record();
+    }
+
+    void record_range(const KeyType& start, int length) {
+        lock_guard<mutex> guard(trace_mutex);
+        int32_t stored = length;
+        begin_record(TraceOp::Range, start);
+        put_bytes(&stored, sizeof(stored));
+        end_record();
+    }
+};
+
+// Reads the trace at path into out, with each record's time made absolute. Returns false if the file cannot be
+// read or was recorded for other key or value types; a record cut short at the end is dropped.
+template <typename KeyType, typename ValueType>
+bool load_trace(const char* path, vector<TraceRecord<KeyType, ValueType>>& out) {
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    BPTreeTraceHeader header;
+    if (!in.read((char*) &header, sizeof(header)) || memcmp(header.magic, bptree_trace_magic, sizeof(header.magic)) != 0)
+        return false;
+    if (header.key_size != sizeof(KeyType) || header.value_size != sizeof(ValueType))
+        return false;
+    vector<char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    auto get_varint = [&](uint64_t& v) {
+        v = 0;
+        for (int shift = 0; pos < bytes.size() && shift < 64; shift += 7) {
+            unsigned char byte = (unsigned char) bytes[pos++];
+            v |= (uint64_t) (byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    };
+    auto get_bytes = [&](void* dest, size_t n) {
+        if (pos + n > bytes.size())
+            return false;
+        memcpy(dest, bytes.data() + pos, n);
+        pos += n;
+        return true;
+    };
+
+    uint64_t time_us = 0;
+    while (pos < bytes.size()) {
+        TraceRecord<KeyType, ValueType> record = {};
+        uint64_t thread, delta;
+        record.op = (TraceOp) bytes[pos++];
+        if (!get_varint(thread) || !get_varint(delta) || !get_bytes(&record.key, sizeof(KeyType)))
+            break;
+        if (record.op == TraceOp::Insert) {
+            if (!get_bytes(&record.value, sizeof(ValueType)))
+                break;
+        } else if (record.op == TraceOp::Range) {
+            if (!get_bytes(&record.length, sizeof(record.length)))
+                break;
+        } else if (record.op != TraceOp::Find) {
+            break;
+        }
+        time_us += delta;
+        record.thread = (uint32_t) thread;
+        record.time_us = time_us;
+        out.push_back(record);
+    }
+    return true;
+}
@@ -0,0 +1,322 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "bp_tree_keys.cpp"
+
+#ifdef _WIN32
+#include <io.h>
+#define wal_open _open
+#define wal_close _close
+#define wal_read _read
+#define wal_write _write
+#define wal_fsync _commit
+#define wal_truncate _chsize_s
+#define WAL_FLAGS (_O_BINARY)
+#else
+#include <unistd.h>
+#define wal_open ::open
+#define wal_close ::close
+#define wal_read ::read
+#define wal_write ::write
+#define wal_fsync ::fsync
+#define wal_truncate ::ftruncate
+#define WAL_FLAGS 0
+#endif
+
+using namespace std;
+
+// Knobs trading commit latency against throughput for a BPTreeWAL
+struct WALOptions
+{
+    int batch_size = 256;      // A flush starts as soon as this many records are buffered
+    int max_delay_us = 1000;   // Longest a buffered record waits for a full batch before it is flushed anyway
+    int buffer_size = 65536;   // Number of slots in the append buffer, rounded up to a power of two
+    bool sync_commit = true;   // If set, append returns only once its record has been fsynced
+};
+
+// Write-ahead log of BPTree inserts. Appenders claim slots in a ring buffer with a single atomic increment and
+// never take a lock to log a record; one flusher thread drains the ring, writes each batch with one write()
+// and makes it durable with one fsync(), however many threads contributed to it.
+// Each record on disk is a 32 bit checksum followed by the raw key and value bytes.
+template <typename KeyType, typename ValueType>
+class BPTreeWAL {
+private:
+    static_assert(is_trivially_copyable<KeyType>::value && is_trivially_copyable<ValueType>::value, "WAL records store keys and values as raw bytes");
+    static_assert(!KeyTraits<KeyType>::out_of_line, "WAL records cannot hold out-of-line keys");
+    static const size_t record_size = sizeof(uint32_t) + sizeof(KeyType) + sizeof(ValueType);
+
+    struct Slot
+    {
+        atomic<uint64_t> seq; // ticket + 1 once the record is written, ticket + ring size once it may be reused
+        KeyType key;
+        ValueType value;
+    };
+
+    WALOptions options;
+    Slot* ring = nullptr;
+    uint64_t ring_size = 0;
+
+    atomic<uint64_t> tail{0};    // Next ticket handed to an appender
+    atomic<uint64_t> durable{0}; // Every ticket below this one is on disk
+    atomic<uint64_t> kicked{0};  // durable + 1 as of the last early wakeup, so each batch sends at most one
+    atomic<bool> failed{false};  // A write or fsync failed; nothing logged from then on is durable
+    int fd = -1;
+
+    thread flusher;
+    atomic<bool> stopping{false};
+    mutex wait_mutex;
+    condition_variable work_cv;    // Wakes the flusher early when a batch fills up
+    condition_variable durable_cv; // Wakes appenders waiting for their batch to commit
+
+    static uint32_t checksum(const char* bytes, size_t n) {
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (size_t i = 0; i < n; i++) {
+            hash ^= (unsigned char) bytes[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    // Writes all n bytes, carrying on after interrupted and partial writes
+    static bool write_all(int fd, const char* bytes, size_t n) {
+        while (n > 0) {
+            long written = wal_write(fd, bytes, n);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            bytes += written;
+            n -= written;
+        }
+        return true;
+    }
+
+    void flush_loop() {
+        vector<char> buffer;
+        uint64_t head = 0;
+
+        while (true) {
+            {
+                unique_lock<mutex> lock(wait_mutex);
+                // Sleep until there is something to log, then give the batch up to max_delay_us to fill
+                while (tail.load() == head && !stopping.load())
+                    work_cv.wait_for(lock, chrono::microseconds(options.max_delay_us));
+                auto deadline = chrono::steady_clock::now() + chrono::microseconds(options.max_delay_us);
+                while (tail.load() - head < (uint64_t) options.batch_size && !stopping.load()) {
+                    if (work_cv.wait_until(lock, deadline) == cv_status::timeout)
+                        break;
+                }
+            }
+
+            uint64_t upto = tail.load();
+            if (upto == head) {
+                if (stopping.load())
+                    return;
+                continue;
+            }
+            upto = min(upto, head + ring_size);
+
+            buffer.resize((upto - head) * record_size);
+            char* out = buffer.data();
+            for (uint64_t ticket = head; ticket < upto; ticket++) {
+                Slot& slot = ring[ticket & (ring_size - 1)];
+                while (slot.seq.load(memory_order_acquire) != ticket + 1) // Appender has the ticket but is still copying
+                    this_thread::yield();
+
+                memcpy(out + sizeof(uint32_t), &slot.key, sizeof(KeyType));
+                memcpy(out + sizeof(uint32_t) + sizeof(KeyType), &slot.value, sizeof(ValueType));
+                uint32_t sum = checksum(out + sizeof(uint32_t), sizeof(KeyType) + sizeof(ValueType));
+                memcpy(out, &sum, sizeof(sum));
+                out += record_size;
+
+                slot.seq.store(ticket + ring_size, memory_order_release);
+            }
+
+            // After a failure the ring is still drained, so appenders never block on it, but nothing more is
+            // written: the file may end in a partial batch and durable must not move past it. A failed fsync is
+            // not retried, since the kernel may already have dropped the dirty pages.
+            bool ok = !failed.load() && write_all(fd, buffer.data(), buffer.size()) && wal_fsync(fd) == 0;
+
+            head = upto;
+            {
+                lock_guard<mutex> lock(wait_mutex);
+                if (ok)
+                    durable.store(upto, memory_order_release);
+                else
+                    failed.store(true);
+            }
+            durable_cv.notify_all();
+        }
+    }
+
+public:
+    ~BPTreeWAL() {
+        close();
+    }
+
+    // Opens (or creates) the log at path for appending and starts the flusher thread
+    bool open(const char* path, WALOptions opts = WALOptions()) {
+        close();
+        fd = wal_open(path, O_WRONLY | O_CREAT | O_APPEND | WAL_FLAGS, 0644);
+        if (fd < 0)
+            return false;
+
+        options = opts;
+        ring_size = 1;
+        while (ring_size < (uint64_t) max(options.buffer_size, options.batch_size))
+            ring_size <<= 1;
+        ring = new Slot[ring_size];
+        for (uint64_t i = 0; i < ring_size; i++)
+            ring[i].seq.store(i);
+
+        tail.store(0);
+        durable.store(0);
+        kicked.store(0);
+        failed.store(false);
+        stopping.store(false);
+        flusher = thread(&BPTreeWAL::flush_loop, this);
+        return true;
+    }
+
+    // Flushes whatever is still buffered, then stops the flusher and closes the file
+    void close() {
+        if (fd < 0)
+            return;
+        {
+            lock_guard<mutex> lock(wait_mutex);
+            stopping.store(true);
+        }
+        work_cv.notify_one();
+        flusher.join();
+
+        wal_close(fd);
+        fd = -1;
+        delete[] ring;
+        ring = nullptr;
+    }
+
+    // Logs one insert and returns its sequence number, or 0 if the log has failed. With sync_commit this only
+    // returns once the record is durable; otherwise call wait_durable when the caller needs that guarantee.
+    uint64_t append(const KeyType& key, const ValueType& value) {
+        uint64_t lsn = log(key, value);
+        if (options.sync_commit && !wait_durable(lsn))
+            return 0;
+        return lsn;
+    }
+
+    // Buffers one insert without waiting for it to be durable and returns its sequence number. Records reach the
+    // file in sequence order, so a caller that logs under the lock serializing its writes gets them replayed in
+    // the order they were applied.
+    uint64_t log(const KeyType& key, const ValueType& value) {
+        uint64_t ticket = tail.fetch_add(1);
+        Slot& slot = ring[ticket & (ring_size - 1)];
+        while (slot.seq.load(memory_order_acquire) != ticket) // Ring is full, wait for the flusher to catch up
+            this_thread::yield();
+
+        slot.key = key;
+        slot.value = value;
+        slot.seq.store(ticket + 1, memory_order_release);
+
+        // Appenders racing past batch_size would step over an exact match, so any of them may wake the flusher,
+        // but only the first one for each batch does
+        uint64_t base = durable.load(memory_order_relaxed);
+        if (ticket + 1 > base && ticket + 1 - base >= (uint64_t) options.batch_size) {
+            uint64_t last = kicked.load(memory_order_relaxed);
+            if (last < base + 1 && kicked.compare_exchange_strong(last, base + 1)) {
+                { lock_guard<mutex> lock(wait_mutex); } // The flusher is either waiting or yet to test the batch size
+                work_cv.notify_one();
+            }
+        }
+        return ticket + 1;
+    }
+
+    // Blocks until every record up to and including sequence number lsn is on disk. Returns false, at once or
+    // as soon as it happens, if the log failed first; the record then never becomes durable.
+    bool wait_durable(uint64_t lsn) {
+        if (durable.load(memory_order_acquire) >= lsn)
+            return true;
+        unique_lock<mutex> lock(wait_mutex);
+        durable_cv.wait(lock, [&] { return durable.load(memory_order_acquire) >= lsn || failed.load(); });
+        return durable.load(memory_order_acquire) >= lsn;
+    }
+
+    // True once a write or fsync failed. The log stays failed until it is opened again.
+    bool has_failed() const {
+        return failed.load();
+    }
+
+    bool sync_commit() const {
+        return options.sync_commit;
+    }
+
+    uint64_t durable_lsn() const {
+        return durable.load(memory_order_acquire);
+    }
+
+    // Empties the log. Call right after saving a snapshot, while no inserts are in flight.
+    bool reset(const char* path) {
+        int trunc_fd = wal_open(path, O_WRONLY | O_CREAT | O_TRUNC | WAL_FLAGS, 0644);
+        if (trunc_fd < 0)
+            return false;
+        bool synced = wal_fsync(trunc_fd) == 0;
+        wal_close(trunc_fd);
+        return synced;
+    }
+
+    // Re-inserts every intact record of the log at path into tree and returns how many were applied.
+    // A torn record at the end, left by a crash in the middle of a write, is cut off so appends can resume.
+    // Run this on the tree loaded from the last snapshot, before the log is attached to it.
+    template <typename Tree>
+    static uint64_t replay(const char* path, Tree& tree) {
+        int in = wal_open(path, O_RDWR | WAL_FLAGS);
+        if (in < 0)
+            return 0;
+
+        uint64_t applied = 0;
+        uint64_t valid_bytes = 0;
+        vector<char> buffer(record_size * 4096);
+        size_t filled = 0;
+        bool intact = true;
+
+        while (intact) {
+            long got = wal_read(in, buffer.data() + filled, buffer.size() - filled);
+            if (got <= 0)
+                break;
+            filled += got;
+
+            size_t pos = 0;
+            for (; pos + record_size <= filled; pos += record_size) {
+                uint32_t sum;
+                memcpy(&sum, buffer.data() + pos, sizeof(sum));
+                if (sum != checksum(buffer.data() + pos + sizeof(uint32_t), sizeof(KeyType) + sizeof(ValueType))) {
+                    intact = false;
+                    break;
+                }
+
+                KeyType key;
+                ValueType value;
+                memcpy(&key, buffer.data() + pos + sizeof(uint32_t), sizeof(KeyType));
+                memcpy(&value, buffer.data() + pos + sizeof(uint32_t) + sizeof(KeyType), sizeof(ValueType));
+                tree.insert(key, value);
+                applied++;
+                valid_bytes += record_size;
+            }
+            memmove(buffer.data(), buffer.data() + pos, filled - pos);
+            filled -= pos;
+        }
+
+        wal_truncate(in, valid_bytes);
+        wal_close(in);
+        return applied;
+    }
+};
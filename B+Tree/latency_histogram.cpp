@@ -0,0 +1,150 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Log bucketed latency histogram in the style of HdrHistogram. Values below 2^sub_bits nanoseconds get a bucket
+// each; above that every power of two is split into 2^sub_bits equal buckets, so a recorded value is off by at
+// most 1/2^sub_bits (about 3%) wherever it falls. Recording is an index computation and an increment, cheap
+// enough to do for every operation. Not thread safe: keep one per thread and merge them at the end.
+class LatencyHistogram {
+private:
+    static constexpr int sub_bits = 5;
+    static constexpr int num_buckets = (64 - sub_bits + 1) << sub_bits;
+
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t min_ns = UINT64_MAX;
+    uint64_t max_ns = 0;
+    double sum_ns = 0;
+
+    // Index of the highest set bit
+    static int magnitude_of(uint64_t v) {
+        int magnitude = 0;
+        for (int step = 32; step > 0; step /= 2) {
+            if (v >> step) {
+                v >>= step;
+                magnitude += step;
+            }
+        }
+        return magnitude;
+    }
+
+    static int bucket_of(uint64_t ns) {
+        if (ns < (1ull << sub_bits))
+            return (int) ns;
+        int magnitude = magnitude_of(ns);
+        int shift = magnitude - sub_bits;
+        return (shift << sub_bits) + (int) (ns >> shift);
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t bucket_high(int bucket) {
+        if (bucket < (1 << sub_bits))
+            return bucket;
+        int shift = (bucket >> sub_bits) - 1;
+        uint64_t low = (uint64_t) (bucket - (shift << sub_bits)) << shift;
+        return low + (1ull << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(num_buckets, 0) {}
+
+    void record(uint64_t ns) {
+        counts[bucket_of(ns)]++;
+        total++;
+        sum_ns += ns;
+        min_ns = min(min_ns, ns);
+        max_ns = max(max_ns, ns);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < num_buckets; i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum_ns += other.sum_ns;
+        min_ns = min(min_ns, other.min_ns);
+        max_ns = max(max_ns, other.max_ns);
+    }
+
+    void reset() {
+        fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        sum_ns = 0;
+        min_ns = UINT64_MAX;
+        max_ns = 0;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min_value() const {
+        return total == 0 ? 0 : min_ns;
+    }
+
+    uint64_t max_value() const {
+        return max_ns;
+    }
+
+    double mean() const {
+        return total == 0 ? 0 : sum_ns / total;
+    }
+
+    // Smallest recorded value that at least percent of the values are not above, to bucket precision
+    uint64_t percentile(double percent) const {
+        if (total == 0)
+            return 0;
+        uint64_t rank = max<uint64_t>(1, (uint64_t) (percent / 100 * total + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < num_buckets; i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return min(bucket_high(i), max_ns);
+        }
+        return max_ns;
+    }
+
+    // One line of p50/p90/p99/p99.9/max
+    void print(ostream& out, const string& label) const {
+        out << " " << label << " latency ns p50: " << percentile(50) << " p90: " << percentile(90)
+            << " p99: " << percentile(99) << " p99.9: " << percentile(99.9) << " max: " << max_value()
+            << " (" << count() << " ops)" << endl;
+    }
+
+    // One row per non-empty bucket: prefix, the bucket's highest value, its count and the percentage of values
+    // at or below it. prefix holds the caller's leading columns, already comma separated.
+    void write_csv(ostream& out, const string& prefix) const {
+        uint64_t seen = 0;
+        for (int i = 0; i < num_buckets; i++) {
+            if (counts[i] == 0)
+                continue;
+            seen += counts[i];
+            out << prefix << "," << min(bucket_high(i), max_ns) << "," << counts[i] << ","
+                << 100.0 * seen / total << "\n";
+        }
+    }
+
+    static const char* csv_columns() {
+        return "latency_ns,count,percentile";
+    }
+};
+
+// Runs f and records how long it took
+template <typename F>
+inline auto time_op(LatencyHistogram& histogram, F f) -> decltype(f()) {
+    struct Record
+    {
+        LatencyHistogram& histogram;
+        chrono::steady_clock::time_point start;
+        ~Record() {
+            histogram.record((uint64_t) chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+    } record{histogram, chrono::steady_clock::now()};
+    return f();
+}
@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "b+Tree.h"
+#include "bp_tree.cpp"
+#include "latency_histogram.cpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Replays a trace written by BPTreeTraceRecorder against a fresh BPTree or BPlusTree and reports how long it
+// took, so that a workload captured elsewhere can be rerun locally with exactly the same operations.
+//
+//   replay_trace TRACE [--tree=bp|bplus|both] [--threads=N] [--preload=N] [--paced] [--csv=PATH]
+//                      [--order=N] [--log-size=N] [--num-blocks=N] [--block-size=N] [--bplus-order=N]
+//
+// The first --preload records are applied on one thread before timing starts, to rebuild the state the trace
+// began from. The rest are split over --threads threads by the thread that recorded them, modulo the number
+// of threads, so each recorded thread's operations keep their order; --threads=1 replays everything in the
+// recorded order. With --paced each operation waits for its recorded time, reproducing the arrival rate
+// rather than running flat out. The report has throughput and per-operation latency percentiles, and --csv
+// writes the histograms as tree,threads,op,latency_ns,count,percentile rows.
+
+typedef TraceRecord<int, int> Record;
+
+struct ReplayConfig
+{
+    string trace_path;
+    int threads = 1;
+    size_t preload = 0;
+    bool paced = false;
+    bool run_bp = true;
+    bool run_bplus = true;
+    string csv_path;
+
+    int bp_order = 16;
+    int bp_log_size = 3;
+    int bp_num_blocks = 4;
+    int bp_block_size = 4;
+    int bplus_order = 256;
+};
+
+const int num_trace_ops = 3;
+const char* trace_op_names[num_trace_ops] = {"insert", "find", "range"};
+
+struct ReplayResult
+{
+    LatencyHistogram latency[num_trace_ops];
+    long scanned = 0;
+
+    void merge(const ReplayResult& other) {
+        for (int i = 0; i < num_trace_ops; i++)
+            latency[i].merge(other.latency[i]);
+        scanned += other.scanned;
+    }
+
+    long ops() const {
+        long ops = 0;
+        for (int i = 0; i < num_trace_ops; i++)
+            ops += (long) latency[i].count();
+        return ops;
+    }
+};
+
+// Ranges only read and count the elements they visit, on both trees: a BPTree copies them into per-thread
+// scratch columns with scan_into, continuing a batch that stops early on empty leaves from its resume key.
+// Returns the elements visited.
+inline int apply(BPTree<int, int>& tree, const Record& record) {
+    switch (record.op) {
+    case TraceOp::Insert:
+        tree.insert(record.key, record.value);
+        return 0;
+    case TraceOp::Find:
+        tree.find(record.key);
+        return 0;
+    default:
+        break;
+    }
+    if (record.length <= 0)
+        return 0;
+    thread_local vector<int> keys, values;
+    if (keys.size() < (size_t) record.length) {
+        keys.resize(record.length);
+        values.resize(record.length);
+    }
+    int start = record.key;
+    int visited = 0;
+    while (visited < record.length) {
+        BPTreeScanBatch<int> batch = tree.scan_into(start, record.length - visited, keys.data(), values.data());
+        visited += (int) batch.count;
+        if (!batch.more)
+            break;
+        start = batch.resume;
+    }
+    return visited;
+}
+
+inline int apply(BPlusTree<int, int>& tree, const Record& record) {
+    int visited = 0;
+    switch (record.op) {
+    case TraceOp::Insert:
+        tree.insert(record.key, record.value);
+        break;
+    case TraceOp::Find:
+        tree.find(record.key);
+        break;
+    default:
+        tree.iterate_range(record.key, record.length, [&visited](const int&, int&) { visited++; });
+        break;
+    }
+    return visited;
+}
+
+template <typename Tree>
+double replay(Tree& tree, const vector<Record>& records, const ReplayConfig& config, ReplayResult& total) {
+    size_t preload = min(config.preload, records.size());
+    for (size_t i = 0; i < preload; i++)
+        apply(tree, records[i]);
+
+    vector<vector<const Record*>> shares(config.threads);
+    for (size_t i = preload; i < records.size(); i++)
+        shares[records[i].thread % config.threads].push_back(&records[i]);
+    uint64_t first_us = preload < records.size() ? records[preload].time_us : 0;
+
+    vector<ReplayResult> results(config.threads);
+    atomic<int> ready{0};
+    atomic<bool> go{false};
+    steady_clock::time_point start;
+
+    vector<thread> workers;
+    for (int t = 0; t < config.threads; t++) {
+        workers.emplace_back([&, t]() {
+            ready.fetch_add(1);
+            while (!go.load(memory_order_acquire))
+                this_thread::yield();
+            ReplayResult& result = results[t];
+            for (const Record* record : shares[t]) {
+                if (config.paced)
+                    this_thread::sleep_until(start + microseconds(record->time_us - first_us));
+                result.scanned += time_op(result.latency[(int) record->op], [&]() { return apply(tree, *record); });
+            }
+        });
+    }
+
+    while (ready.load() < config.threads)
+        this_thread::yield();
+    start = steady_clock::now();
+    go.store(true, memory_order_release);
+    for (thread& worker : workers)
+        worker.join();
+    double seconds = duration<double>(steady_clock::now() - start).count();
+
+    for (const ReplayResult& result : results)
+        total.merge(result);
+    return seconds;
+}
+
+inline void print_tree_stats(BPTree<int, int>& tree) {
+    BPTreeStats stats = tree.stats();
+    cout << "  height " << stats.height << ", " << stats.leaf_count << " leaves " << stats.average_fill * 100
+         << "% full, " << stats.elements << " elements, " << stats.redistributions << " redistributions" << endl;
+}
+
+inline void print_tree_stats(BPlusTree<int, int>&) {}
+
+template <typename Tree>
+void run_replay(const char* name, Tree& tree, const vector<Record>& records, const ReplayConfig& config, ostream* csv) {
+    ReplayResult result;
+    double seconds = replay(tree, records, config, result);
+    cout << name << " threads: " << config.threads << " ops: " << result.ops() << " ops/s: "
+         << (long) (result.ops() / max(seconds, 1e-9)) << " (" << result.scanned << " elements in ranges, "
+         << (long) (seconds * 1000000) << " microseconds)" << endl;
+    for (int i = 0; i < num_trace_ops; i++) {
+        if (result.latency[i].count() > 0)
+            result.latency[i].print(cout, string(" ") + trace_op_names[i]);
+    }
+    print_tree_stats(tree);
+    if (csv != nullptr) {
+        for (int i = 0; i < num_trace_ops; i++)
+            result.latency[i].write_csv(*csv, string(name) + "," + to_string(config.threads) + "," + trace_op_names[i]);
+    }
+}
+
+static bool parse_flag(const char* arg, const char* name, long& out) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    out = atol(arg + len + 1);
+    return true;
+}
+
+static bool parse_args(int argc, char** argv, ReplayConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        long v;
+        if (parse_flag(arg, "--threads", v))
+            config.threads = (int) max(1l, v);
+        else if (parse_flag(arg, "--preload", v))
+            config.preload = (size_t) max(0l, v);
+        else if (strcmp(arg, "--paced") == 0)
+            config.paced = true;
+        else if (parse_flag(arg, "--order", v))
+            config.bp_order = (int) max(3l, v);
+        else if (parse_flag(arg, "--log-size", v))
+            config.bp_log_size = (int) max(1l, v);
+        else if (parse_flag(arg, "--num-blocks", v))
+            config.bp_num_blocks = (int) max(1l, v);
+        else if (parse_flag(arg, "--block-size", v))
+            config.bp_block_size = (int) max(1l, v);
+        else if (parse_flag(arg, "--bplus-order", v))
+            config.bplus_order = (int) max(3l, v);
+        else if (strncmp(arg, "--csv=", 6) == 0)
+            config.csv_path = arg + 6;
+        else if (strcmp(arg, "--tree=bp") == 0)
+            config.run_bplus = false;
+        else if (strcmp(arg, "--tree=bplus") == 0)
+            config.run_bp = false;
+        else if (strcmp(arg, "--tree=both") == 0)
+            continue;
+        else if (arg[0] != '-' && config.trace_path.empty())
+            config.trace_path = arg;
+        else {
+            cerr << "Unknown argument: " << arg << endl;
+            return false;
+        }
+    }
+    if (config.trace_path.empty()) {
+        cerr << "No trace given" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    ReplayConfig config;
+    if (!parse_args(argc, argv, config))
+        return 1;
+
+    vector<Record> records;
+    if (!load_trace(config.trace_path.c_str(), records)) {
+        cerr << "Cannot read " << config.trace_path << " as a trace of int keys and values" << endl;
+        return 1;
+    }
+    uint64_t span_us = records.empty() ? 0 : records.back().time_us - records.front().time_us;
+    cout << "Trace " << config.trace_path << ": " << records.size() << " records over " << span_us / 1000
+         << " ms, preload " << min(config.preload, records.size()) << (config.paced ? ", paced" : "") << endl;
+
+    ofstream csv_file;
+    ostream* csv = nullptr;
+    if (!config.csv_path.empty()) {
+        csv_file.open(config.csv_path);
+        if (!csv_file) {
+            cerr << "Cannot write " << config.csv_path << endl;
+            return 1;
+        }
+        csv_file << "tree,threads,op," << LatencyHistogram::csv_columns() << "\n";
+        csv = &csv_file;
+    }
+
+    if (config.run_bp) {
+        BPTree<int, int> tree(config.bp_order, config.bp_log_size, config.bp_num_blocks, config.bp_block_size);
+        run_replay("BP Tree", tree, records, config, csv);
+    }
+    if (config.run_bplus) {
+        BPlusTree<int, int> tree(config.bplus_order, true);
+        run_replay("B+ Tree", tree, records, config, csv);
+    }
+    return 0;
+}
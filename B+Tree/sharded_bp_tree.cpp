@@ -0,0 +1,261 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <type_traits>
+#include "bp_tree.cpp"
+
+using namespace std;
+
+// Memory placement of a ShardedBPTree's shards. With numa_nodes set, shard i keeps its leaves on node
+// i % numa_nodes; otherwise pages land wherever the thread first touching them runs, so a shard driven by a
+// thread pinned to one node ends up there anyway.
+struct ShardPlacement
+{
+    int numa_nodes = 0;
+    bool huge_pages = false;
+};
+
+// Partitions the key space over independent BPTrees so that writers in different key ranges never meet on a
+// root or an upper-level node. Shard i holds the keys in [splitters[i-1], splitters[i]); the first and last
+// shards are open-ended. Routing is a binary search over the small splitter array.
+template <typename KeyType, typename ValueType>
+class ShardedBPTree {
+private:
+    struct alignas(64) Shard
+    {
+        BPTree<KeyType, ValueType>* tree;
+        PageSlab* memory = nullptr;      // Leaf storage of tree and of the trees replacing it, heap if null
+        mutable shared_timed_mutex lock; // Shared for every operation, exclusive only while the shard is rebuilt
+        atomic<uint64_t> ops{0};         // Operations routed here since the last rebalance
+
+        // Key range of the shard, read under lock so that operations can notice a rebalance that raced with routing
+        bool has_low = false;
+        bool has_high = false;
+        KeyType low;
+        KeyType high;
+
+        bool owns(const KeyType& key) const {
+            return (!has_low || !(key < low)) && (!has_high || key < high);
+        }
+    };
+
+    vector<Shard*> shards;
+    vector<KeyType> splitters;
+    mutable shared_timed_mutex routing_lock; // Guards splitters
+    mutex rebalance_mutex;
+    KeyArena splitter_arena; // Bytes of out-of-line splitters chosen by rebalance, which outlive the trees they came from
+
+    int order;
+    int bpa_log_size;
+    int bpa_num_blocks;
+    int bpa_block_size;
+
+    int route(const KeyType& key) const {
+        shared_lock<shared_timed_mutex> guard(routing_lock);
+        return upper_bound(splitters.begin(), splitters.end(), key) - splitters.begin();
+    }
+
+    // Routes key and returns its shard locked shared. Retries if a rebalance moved the key in the meantime.
+    Shard* acquire(const KeyType& key) {
+        while (true) {
+            Shard* shard = shards[route(key)];
+            shard->lock.lock_shared();
+            if (shard->owns(key))
+                return shard;
+            shard->lock.unlock_shared();
+        }
+    }
+
+public:
+    // One shard per splitter plus one, splitters must be sorted ascending
+    ShardedBPTree(const vector<KeyType>& splitters, int order, int log_size, int num_blocks, int block_size, ShardPlacement placement = ShardPlacement())
+        : splitters(splitters), order(order), bpa_log_size(log_size), bpa_num_blocks(num_blocks), bpa_block_size(block_size) {
+        for (size_t i = 0; i <= splitters.size(); i++) {
+            Shard* shard = new Shard();
+            if (placement.numa_nodes > 0 || placement.huge_pages) {
+                PageSlabOptions opts;
+                opts.huge_pages = placement.huge_pages;
+                opts.numa_node = (placement.numa_nodes > 0) ? (int) (i % placement.numa_nodes) : -1;
+                shard->memory = new PageSlab(opts);
+            }
+            shard->tree = new BPTree<KeyType, ValueType>(order, log_size, num_blocks, block_size, shard->memory);
+            shard->has_low = i > 0;
+            shard->has_high = i < splitters.size();
+            if (shard->has_low)
+                shard->low = splitters[i-1];
+            if (shard->has_high)
+                shard->high = splitters[i];
+            shards.push_back(shard);
+        }
+    }
+
+    // Shards own their trees and memory, so a copy would free them twice
+    ShardedBPTree(const ShardedBPTree&) = delete;
+    ShardedBPTree& operator=(const ShardedBPTree&) = delete;
+
+    ~ShardedBPTree() {
+        for (Shard* shard : shards) {
+            delete shard->tree;
+            delete shard->memory;
+            delete shard;
+        }
+    }
+
+    // Splitters cutting [low, high) into num_shards equal key ranges, for arithmetic keys. Integral spans are
+    // taken in uint64_t, so a range as wide as the key type, e.g. INT_MIN to INT_MAX, does not overflow.
+    static vector<KeyType> uniform_splitters(KeyType low, KeyType high, int num_shards) {
+        vector<KeyType> result;
+        for (int i = 1; i < num_shards; i++) {
+            if constexpr (is_integral<KeyType>::value) {
+                uint64_t span = (uint64_t) high - (uint64_t) low;
+                result.push_back((KeyType) ((uint64_t) low + span / num_shards * i));
+            } else {
+                result.push_back(low + (high - low) / num_shards * i);
+            }
+        }
+        return result;
+    }
+
+    // Splitters at the quantiles of a sample of the expected keys, so each shard starts with a similar share
+    static vector<KeyType> sampled_splitters(vector<KeyType> sample, int num_shards) {
+        vector<KeyType> result;
+        sort(sample.begin(), sample.end());
+        for (int i = 1; i < num_shards && !sample.empty(); i++) {
+            KeyType splitter = sample[sample.size() * i / num_shards];
+            if (result.empty() || result.back() < splitter)
+                result.push_back(splitter);
+        }
+        return result;
+    }
+
+    int num_shards() const {
+        return shards.size();
+    }
+
+    void insert(KeyType key, ValueType value) {
+        Shard* shard = acquire(key);
+        shard->ops.fetch_add(1, memory_order_relaxed);
+        shard->tree->insert(key, value);
+        shard->lock.unlock_shared();
+    }
+
+    // The pointer stays valid until the next rebalance, which frees the trees of the shards it rebuilds
+    ValueType* find(KeyType key) {
+        Shard* shard = acquire(key);
+        shard->ops.fetch_add(1, memory_order_relaxed);
+        ValueType* val = shard->tree->find(key);
+        shard->lock.unlock_shared();
+        return val;
+    }
+
+    // Stitches the range together across shards: once a shard runs out, the scan resumes at the next shard's
+    // lower bound. Returns how many elements were visited.
+    int iterate_range(KeyType start, int length, function<ValueType(KeyType)> f) {
+        int num_to_process = length;
+        Shard* shard = acquire(start);
+
+        while (true) {
+            shard->ops.fetch_add(1, memory_order_relaxed);
+            num_to_process -= shard->tree->iterate_range(start, num_to_process, f);
+
+            bool more = shard->has_high && num_to_process > 0;
+            if (more)
+                start = shard->high;
+            shard->lock.unlock_shared();
+            if (!more)
+                break;
+            shard = acquire(start);
+        }
+        return length - num_to_process;
+    }
+
+    // Moves load off the busiest shard once it has seen more than skew times the mean number of operations since
+    // the last call, by handing half of its keys to its calmer neighbour. Only those two shards are blocked while
+    // they are rebuilt; every other shard keeps serving. Returns true if keys were moved, in which case pointers
+    // returned by find are invalid, even for keys that stayed in their shard.
+    bool rebalance(double skew = 2.0) {
+        lock_guard<mutex> guard(rebalance_mutex);
+        int n = shards.size();
+        if (n < 2)
+            return false;
+
+        vector<uint64_t> load(n);
+        uint64_t total = 0;
+        int hot = 0;
+        for (int i = 0; i < n; i++) {
+            load[i] = shards[i]->ops.exchange(0, memory_order_relaxed);
+            total += load[i];
+            if (load[i] > load[hot])
+                hot = i;
+        }
+        if (load[hot] == 0 || load[hot] <= skew * total / n)
+            return false;
+
+        int cold;
+        if (hot == 0)
+            cold = 1;
+        else if (hot == n - 1)
+            cold = n - 2;
+        else
+            cold = (load[hot-1] <= load[hot+1]) ? hot - 1 : hot + 1;
+
+        Shard* left = shards[min(hot, cold)];
+        Shard* right = shards[max(hot, cold)];
+        left->lock.lock();
+        right->lock.lock();
+
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        auto collect = [&](const ElementBPA<KeyType, ValueType>* run, size_t count) {
+            elts.insert(elts.end(), run, run + count);
+        };
+        left->tree->for_each_run(collect);
+        size_t left_count = elts.size();
+        right->tree->for_each_run(collect);
+
+        // The hot shard gives away the half of its keys that borders the cold one
+        size_t split;
+        if (hot < cold)
+            split = left_count - left_count / 2;
+        else
+            split = left_count + (elts.size() - left_count) / 2;
+
+        bool moved = split > 0 && split < elts.size() && split != left_count;
+        if (moved) {
+            BPTree<KeyType, ValueType>* new_left = new BPTree<KeyType, ValueType>(order, bpa_log_size, bpa_num_blocks, bpa_block_size, left->memory);
+            BPTree<KeyType, ValueType>* new_right = new BPTree<KeyType, ValueType>(order, bpa_log_size, bpa_num_blocks, bpa_block_size, right->memory);
+            new_left->bulk_load(elts.data(), split);
+            new_right->bulk_load(elts.data() + split, elts.size() - split);
+
+            // The boundary key may live in the old trees' arenas
+            KeyType boundary = KeyTraits<KeyType>::intern(elts[split].key, splitter_arena);
+            delete left->tree;
+            delete right->tree;
+            left->tree = new_left;
+            right->tree = new_right;
+            left->high = boundary;
+            right->low = boundary;
+
+            // Routing changes before the shards reopen, so anything that waited on them re-routes correctly
+            unique_lock<shared_timed_mutex> routing(routing_lock);
+            splitters[min(hot, cold)] = boundary;
+        }
+
+        right->lock.unlock();
+        left->lock.unlock();
+        return moved;
+    }
+
+    // Number of operations each shard has served since the last rebalance
+    vector<uint64_t> shard_load() const {
+        vector<uint64_t> load;
+        for (Shard* shard : shards)
+            load.push_back(shard->ops.load(memory_order_relaxed));
+        return load;
+    }
+};
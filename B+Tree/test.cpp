@@ -3,19 +3,1235 @@
 #include <queue>
 #include <chrono>
 #include <random>
+#include <fstream>
+#include <string>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <atomic>
 #include "b+Tree.h"
+#include "b+TreeArray.h"
 #include "bp_tree.cpp"
+#include "bp_tree_stream.cpp"
+#include "sharded_bp_tree.cpp"
+#include "bp_tree_maintenance.cpp"
+#include "latency_histogram.cpp"
 
 using namespace std;
 using namespace std::chrono;
 
+// Failures of one check, each printed with the check's name as it is found
+struct CheckFailures
+{
+    string check;
+    int count = 0;
+
+    CheckFailures(const string &check) : check(check) {}
+
+    void expect(bool ok, const string &what)
+    {
+        if (!ok)
+        {
+            cout << check << " check failed: " << what << endl;
+            count++;
+        }
+    }
+};
+
+// Differential checks of the range APIs against std::map over a few BPA geometries. Prints every mismatch and
+// returns how many there were.
+int checkRangeApis()
+{
+    CheckFailures failures("Range API");
+
+    // Log size, number of blocks and block size of each tree checked; a log of one slot never shadows a block.
+    int geometries[4][3] = {{1,4,4},{3,4,4},{4,8,8},{8,4,16}};
+    for (auto &geometry : geometries)
+    {
+        const string name = "geometry " + to_string(geometry[0]) + "," + to_string(geometry[1]) + "," + to_string(geometry[2]);
+        BPTree<int, int> bPTree(8, geometry[0], geometry[1], geometry[2]);
+        map<int, int> reference;
+        mt19937 gen(42);
+        uniform_int_distribution<int> distr(0, 200000);
+
+        // Overwrites leave older copies of a key in the blocks behind the log.
+        for (int i = 0; i < 50000; i++)
+        {
+            const int key = distr(gen);
+            bPTree.insert(key, i);
+            reference[key] = i;
+        }
+
+        auto expectContents = [&](const string &what)
+        {
+            size_t entries = 0;
+            bool match = true;
+            for (auto &entry : reference)
+            {
+                int* value = bPTree.find(entry.first);
+                match = match && value != nullptr && *value == entry.second;
+                entries++;
+            }
+            failures.expect(match && entries == reference.size(), name + " " + what);
+        };
+
+        for (int i = 0; i < 50; i++)
+        {
+            const int start = distr(gen);
+            const int length = distr(gen) % 5000;
+            size_t expected = distance(reference.lower_bound(start), reference.lower_bound(start + length));
+            int mapped = bPTree.map_range(start, length, [&](int key) { return reference[key] += 3; });
+            failures.expect(mapped >= 0 && (size_t) mapped == expected, name + " map_range count " + to_string(mapped) + " vs " + to_string(expected));
+        }
+        expectContents("contents after map_range");
+
+        size_t distinct = distance(reference.lower_bound(1000), reference.lower_bound(150000));
+        vector<size_t> counts = bPTree.parallel_map_range(1000, 150000, [&](int key) { return key ^ 7; }, 4, 3);
+        size_t mapped = 0;
+        for (size_t count : counts)
+        {
+            mapped += count;
+        }
+        failures.expect(mapped == distinct, name + " parallel_map_range count " + to_string(mapped) + " vs " + to_string(distinct));
+        for (auto it = reference.lower_bound(1000); it != reference.lower_bound(150000); ++it)
+        {
+            it->second = it->first ^ 7;
+        }
+        expectContents("contents after parallel_map_range");
+    }
+
+    // Range APIs under concurrent inserts and compaction: every even key is present throughout with value 0, while
+    // odd keys with value 1 come and go around it. Each call must see every even key once, however the leaves
+    // holding it split or merge meanwhile.
+    {
+        BPTree<int, int> bPTree(8, 4, 4, 8);
+        const int numKeys = 40000;
+        for (int key = 0; key < numKeys; key += 2)
+        {
+            bPTree.insert(key, 0);
+        }
+        vector<atomic<int>> hits(numKeys);
+        atomic<bool> stopWriters(false);
+        vector<thread> writers;
+        for (int w = 0; w < 2; w++)
+        {
+            writers.emplace_back([&, w]()
+            {
+                mt19937 gen(w);
+                while (!stopWriters)
+                {
+                    bPTree.insert((gen() % (numKeys / 2)) * 2 + 1, 1);
+                }
+            });
+        }
+        writers.emplace_back([&]()
+        {
+            while (!stopWriters)
+            {
+                bPTree.compact_leaves(0.8, 1.0);
+            }
+        });
+
+        auto markEven = [&](int key)
+        {
+            if (key % 2 != 0)
+            {
+                return 1;
+            }
+            hits[key]++;
+            return 0;
+        };
+        const int calls = 20;
+        mt19937 gen(3);
+        for (int i = 0; i < calls; i++)
+        {
+            bPTree.parallel_map_range(0, numKeys, markEven, 4, 2);
+
+            const int start = (gen() % (numKeys / 2)) * 2;
+            const int length = min<int>((gen() % (numKeys / 8)) * 2, numKeys - start);
+            int evens = 0;
+            bPTree.map_range(start, length, [&](int key) { evens += (key % 2 == 0); return (key % 2 == 0) ? 0 : 1; });
+            failures.expect(evens == length / 2, "concurrent map_range saw " + to_string(evens) + " of " + to_string(length / 2) + " even keys");
+            RangeAggregate<int> aggregate = bPTree.range_aggregate(start, start + length);
+            failures.expect((long) aggregate.count - (long) aggregate.sum == length / 2, "concurrent range_aggregate over even keys");
+        }
+        stopWriters = true;
+        for (thread &writer : writers)
+        {
+            writer.join();
+        }
+        bool once = true;
+        for (int key = 0; key < numKeys; key += 2)
+        {
+            once = once && hits[key] == calls;
+        }
+        failures.expect(once, "concurrent parallel_map_range maps every even key once per call");
+    }
+    return failures.count;
+}
+
+// Contents of bPTree in key order.
+vector<pair<int, int>> treeContents(BPTree<int, int> &bPTree)
+{
+    vector<pair<int, int>> contents;
+    bPTree.for_each_run([&](const ElementBPA<int, int>* elts, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            contents.push_back({elts[i].key, elts[i].value});
+        }
+    });
+    return contents;
+}
+
+// Threads overwrite the same few keys with a WAL attached; replaying the log must rebuild the tree they left.
+// Returns 1 on a mismatch.
+int checkWalReplay()
+{
+    const char* path = "wal_check.log";
+    remove(path);
+    BPTree<int, int> bPTree(8, 3, 4, 4);
+    BPTreeWAL<int, int> wal;
+    WALOptions options;
+    options.batch_size = 32;
+    options.max_delay_us = 200;
+    options.sync_commit = false;
+    if (!wal.open(path, options))
+    {
+        cout << "WAL check failed: cannot open " << path << endl;
+        return 1;
+    }
+    bPTree.attach_wal(&wal);
+
+    atomic<bool> logged(true);
+    vector<thread> writers;
+    for (int w = 0; w < 4; w++)
+    {
+        writers.emplace_back([&, w]()
+        {
+            for (int i = 0; i < 20000; i++)
+            {
+                if (!bPTree.insert(i % 300, w * 100000 + i))
+                {
+                    logged = false;
+                }
+            }
+        });
+    }
+    for (thread &writer : writers)
+    {
+        writer.join();
+    }
+    bPTree.attach_wal(nullptr);
+    wal.close();
+
+    BPTree<int, int> replayed(8, 3, 4, 4);
+    BPTreeWAL<int, int>::replay(path, replayed);
+    remove(path);
+    if (!logged || treeContents(replayed) != treeContents(bPTree))
+    {
+        cout << "WAL check failed: the replayed tree differs from the one logged" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Differential checks of the bulk and whole-tree APIs against std::map: range_aggregate, scan_into, compaction
+// and the snapshot and stream round trips, on trees with frozen leaves and keys overwritten many times. Prints
+// every mismatch and returns how many there were.
+int checkContentApis()
+{
+    CheckFailures failures("Content API");
+
+    int geometries[3][3] = {{3,4,4},{4,8,8},{8,4,16}};
+    for (auto &geometry : geometries)
+    {
+        const string name = "geometry " + to_string(geometry[0]) + "," + to_string(geometry[1]) + "," + to_string(geometry[2]);
+        BPTree<int, int> bPTree(8, geometry[0], geometry[1], geometry[2]);
+        map<int, int> reference;
+        mt19937 gen(11);
+        uniform_int_distribution<int> distr(0, 100000);
+        for (int i = 0; i < 40000; i++)
+        {
+            const int key = distr(gen);
+            bPTree.insert(key, i - 20000);
+            reference[key] = i - 20000;
+            if (i == 30000)
+            {
+                // Freeze every leaf, then thaw some with the last inserts
+                for (int round = 0; round < 3; round++)
+                {
+                    bPTree.maintenance_pass(0.5, INT_MAX, 1);
+                }
+            }
+        }
+        vector<pair<int, int>> expected(reference.begin(), reference.end());
+
+        for (int i = 0; i < 50; i++)
+        {
+            const int low = distr(gen);
+            const int high = low + distr(gen) % 20000;
+            RangeAggregate<int> aggregate = bPTree.range_aggregate(low, high);
+            RangeAggregate<int> direct;
+            for (auto it = reference.lower_bound(low); it != reference.lower_bound(high); ++it)
+            {
+                direct.add(it->second);
+            }
+            failures.expect(aggregate.count == direct.count && aggregate.sum == direct.sum
+                && (direct.count == 0 || (aggregate.min == direct.min && aggregate.max == direct.max)), name + " range_aggregate [" + to_string(low) + ", " + to_string(high) + ")");
+        }
+
+        for (int i = 0; i < 50; i++)
+        {
+            const size_t limit = 1 + distr(gen) % 700;
+            vector<int> keys(limit), values(limit);
+            const int first = distr(gen);
+            int start = first;
+            vector<pair<int, int>> scanned;
+            while (true)
+            {
+                BPTreeScanBatch<int> batch = bPTree.scan_into(start, limit, keys.data(), values.data());
+                for (size_t j = 0; j < batch.count; j++)
+                {
+                    scanned.push_back({keys[j], values[j]});
+                }
+                if (!batch.more || scanned.size() > expected.size())
+                {
+                    break;
+                }
+                start = batch.resume;
+            }
+            failures.expect(scanned == vector<pair<int, int>>(reference.lower_bound(first), reference.end()), name + " scan_into with batches of " + to_string(limit));
+        }
+
+        bPTree.compact_leaves(0.7, 1.0);
+        bPTree.compact_leaves(0.7, 1.0);
+        failures.expect(treeContents(bPTree) == expected, name + " contents after compact_leaves");
+
+        const char* path = "check.snapshot";
+        failures.expect(bPTree.save_snapshot(path), name + " save_snapshot");
+        BPTree<int, int> loaded(8, geometry[0], geometry[1], geometry[2]);
+        failures.expect(loaded.load_snapshot(path), name + " load_snapshot");
+        bool found = true;
+        for (int i = 0; i < 1000; i++)
+        {
+            const int key = distr(gen);
+            int* value = loaded.find(key);
+            auto it = reference.find(key);
+            found = found && (it == reference.end() ? value == nullptr : value != nullptr && *value == it->second);
+        }
+        failures.expect(found, name + " find on a mapped snapshot");
+        failures.expect(treeContents(loaded) == expected, name + " snapshot round trip");
+
+        // Damage the file in ways open alone cannot see as well as ways it can; load_snapshot must reject each
+        // rather than serve or rebuild part of the tree. The root is written last, so cutting the file short
+        // leaves it out of range.
+        ifstream saved(path, ios::binary);
+        const string bytes((istreambuf_iterator<char>(saved)), istreambuf_iterator<char>());
+        saved.close();
+        BPTreeSnapshotHeader header;
+        memcpy(&header, bytes.data(), sizeof(header));
+        BPTreeSnapshotLeaf first;
+        memcpy(&first, &bytes[header.first_leaf], sizeof(first));
+        auto expectRejected = [&](const string &damaged, const string &what)
+        {
+            ofstream(path, ios::binary | ios::trunc).write(damaged.data(), damaged.size());
+            BPTree<int, int> rejected(8, geometry[0], geometry[1], geometry[2]);
+            failures.expect(!rejected.load_snapshot(path), name + " " + what + " rejected");
+        };
+        expectRejected(bytes.substr(0, bytes.size() - 8), "truncated snapshot");
+
+        string damaged = bytes;
+        uint64_t hugeCount = 1ull << 60;
+        memcpy(&damaged[header.first_leaf], &hugeCount, sizeof(hugeCount));
+        expectRejected(damaged, "snapshot with an oversized first leaf");
+
+        // The second leaf's link points past the end, cutting the chain in the middle of the file
+        damaged = bytes;
+        uint64_t pastEnd = bytes.size() + 64;
+        memcpy(&damaged[first.next + offsetof(BPTreeSnapshotLeaf, next)], &pastEnd, sizeof(pastEnd));
+        expectRejected(damaged, "snapshot with a leaf chain running off the file");
+
+        // The first two keys of the second leaf swapped
+        damaged = bytes;
+        char* keys = &damaged[first.next + sizeof(BPTreeSnapshotLeaf)];
+        swap_ranges(keys, keys + sizeof(int), keys + sizeof(int));
+        expectRejected(damaged, "snapshot with unsorted keys");
+        remove(path);
+
+        for (bool compress : {false, true})
+        {
+            stringstream stream;
+            int64_t written = bptree_export(bPTree, stream, compress, 1000);
+            BPTree<int, int> imported(8, geometry[0], geometry[1], geometry[2]);
+            int64_t read = bptree_import(imported, stream);
+            failures.expect(written == (int64_t) expected.size() && read == written && treeContents(imported) == expected,
+                name + (compress ? " compressed" : "") + " stream round trip");
+        }
+    }
+    return failures.count;
+}
+
+// Stream import must reject corrupt blocks before allocating for them, and keys out of order, and export must
+// report an output that failed. Returns how many of those went unnoticed.
+int checkStreamErrors()
+{
+    CheckFailures failures("Stream error");
+
+    // A header followed by one block holding keys, and a terminator
+    auto streamOf = [](const vector<int> &keys, const BPTreeStreamBlock *override)
+    {
+        stringstream stream;
+        BPTreeStreamHeader header = {};
+        memcpy(header.magic, bptree_stream_magic, sizeof(header.magic));
+        header.key_size = sizeof(int);
+        header.value_size = sizeof(int);
+        stream.write((const char*) &header, sizeof(header));
+        vector<ElementBPA<int, int>> elts(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            elts[i].key = keys[i];
+            elts[i].value = (int) i;
+        }
+        vector<char> payload;
+        BPTreeStreamBlock block = {};
+        block.count = keys.size();
+        block.flags = stream_encode_block(elts.data(), elts.size(), false, payload);
+        block.payload_bytes = payload.size();
+        if (override != nullptr)
+        {
+            block = *override;
+        }
+        stream.write((const char*) &block, sizeof(block));
+        stream.write(payload.data(), payload.size());
+        BPTreeStreamBlock terminator = {};
+        stream.write((const char*) &terminator, sizeof(terminator));
+        return stream;
+    };
+
+    BPTree<int, int> sorted(8, 3, 4, 4);
+    stringstream good = streamOf({1, 2, 3}, nullptr);
+    failures.expect(bptree_import(sorted, good) == 3, "sorted keys import");
+
+    BPTree<int, int> unsorted(8, 3, 4, 4);
+    stringstream swapped = streamOf({1, 3, 2}, nullptr);
+    failures.expect(bptree_import(unsorted, swapped) == -1, "unsorted keys rejected");
+    BPTree<int, int> duplicated(8, 3, 4, 4);
+    stringstream repeated = streamOf({1, 2, 2}, nullptr);
+    failures.expect(bptree_import(duplicated, repeated) == -1, "duplicate keys rejected");
+
+    BPTreeStreamBlock huge = {};
+    huge.count = 1;
+    huge.payload_bytes = 1ull << 40;
+    BPTree<int, int> hugeTree(8, 3, 4, 4);
+    stringstream hugeStream = streamOf({1}, &huge);
+    failures.expect(bptree_import(hugeTree, hugeStream) == -1, "payload size not matching the count rejected");
+
+    // Plausible for its count, but far more than the input holds
+    BPTreeStreamBlock truncated = {};
+    truncated.count = bptree_stream_max_block_entries;
+    truncated.flags = bptree_stream_compressed;
+    truncated.payload_bytes = 2ull * truncated.count;
+    BPTree<int, int> truncatedTree(8, 3, 4, 4);
+    stringstream truncatedStream = streamOf({1}, &truncated);
+    failures.expect(bptree_import(truncatedTree, truncatedStream) == -1, "payload beyond the end of the input rejected");
+
+    stringstream failed;
+    failed.setstate(ios::badbit);
+    failures.expect(bptree_export(sorted, failed) == -1, "export to a failed stream reported");
+    return failures.count;
+}
+
+// With leaf filters on, every present key must still be found and every absent one missed, also for filters
+// resized while a writer splits leaves. Prints the false-positive rate seen and returns 1 on a failure.
+int checkLeafFilter()
+{
+    BPTree<int, int> bPTree(8, 4, 4, 8);
+    bPTree.set_leaf_filter(512, 3);
+    atomic<bool> stop(false);
+    thread resizer([&]()
+    {
+        for (int bits = 64; !stop; bits = bits % 1024 + 64)
+        {
+            bPTree.set_leaf_filter(bits, 3);
+        }
+    });
+    // Even keys only, so that odd ones are absent
+    for (int i = 0; i < 100000; i++)
+    {
+        bPTree.insert((int) ((i * 7919L) % 100000) * 2, i);
+    }
+    stop = true;
+    resizer.join();
+    bPTree.set_leaf_filter(512, 3);
+
+    bool match = true;
+    for (int key = 0; key < 200000; key++)
+    {
+        int* value = bPTree.find(key);
+        match = match && (key % 2 == 0) == (value != nullptr);
+    }
+    LeafFilterStats stats = bPTree.leaf_filter_stats();
+    cout << "Leaf filter: " << stats.rejected << " of " << stats.lookups << " finds rejected, false-positive rate "
+        << stats.false_positive_rate() * 100 << "%" << endl;
+    if (!match || stats.rejected == 0)
+    {
+        cout << "Leaf filter check failed" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Differential check of ShardedBPTree against std::map: writers hammer one shard while rebalance moves keys
+// between it and its neighbours, then every key and a range across all shards are compared. Prints every
+// mismatch and returns how many there were.
+int checkShardedTree()
+{
+    CheckFailures failures("Sharded tree");
+
+    vector<int> wide = ShardedBPTree<int, int>::uniform_splitters(INT_MIN, INT_MAX, 4);
+    failures.expect(wide.size() == 3 && is_sorted(wide.begin(), wide.end()) && wide[0] > INT_MIN + INT_MAX / 4 && wide[2] < INT_MAX - INT_MAX / 4,
+        "uniform_splitters over the whole int range");
+
+    ShardedBPTree<int, int> sharded(ShardedBPTree<int, int>::uniform_splitters(0, 400000, 4), 8, 4, 4, 8);
+    const int numWriters = 2;
+    vector<map<int, int>> written(numWriters);
+    atomic<int> done(0);
+    vector<thread> writers;
+    for (int w = 0; w < numWriters; w++)
+    {
+        writers.emplace_back([&, w]()
+        {
+            mt19937 gen(w + 5);
+            for (int i = 0; i < 60000; i++)
+            {
+                // Three quarters of the inserts go to the second shard, the rest anywhere
+                const int key = (i % 4 != 0 ? 100000 + (int) (gen() % 100000) : (int) (gen() % 400000)) / numWriters * numWriters + w;
+                sharded.insert(key, i);
+                written[w][key] = i;
+            }
+            done++;
+        });
+    }
+    int rebalances = 0;
+    while (done < numWriters)
+    {
+        rebalances += sharded.rebalance(1.5);
+        this_thread::sleep_for(milliseconds(1));
+    }
+    for (thread &writer : writers)
+    {
+        writer.join();
+    }
+    rebalances += sharded.rebalance(1.5);
+    failures.expect(rebalances > 0, "rebalance never moved any keys");
+
+    map<int, int> reference;
+    for (auto &part : written)
+    {
+        reference.insert(part.begin(), part.end());
+    }
+    bool match = true;
+    for (int key = -10; key < 400010; key++)
+    {
+        int* value = sharded.find(key);
+        auto it = reference.find(key);
+        match = match && (it == reference.end() ? value == nullptr : value != nullptr && *value == it->second);
+    }
+    failures.expect(match, "find after " + to_string(rebalances) + " rebalances");
+
+    // Walk everything in key order, across every shard boundary, rewriting each value to its key plus one
+    vector<int> visited;
+    int count = sharded.iterate_range(INT_MIN, INT_MAX, [&](int key) { visited.push_back(key); return key + 1; });
+    vector<int> keys;
+    for (auto &entry : reference)
+    {
+        keys.push_back(entry.first);
+    }
+    failures.expect(count == (int) reference.size() && visited == keys, "iterate_range across shards");
+    bool rewritten = true;
+    for (int key : keys)
+    {
+        int* value = sharded.find(key);
+        rewritten = rewritten && value != nullptr && *value == key + 1;
+    }
+    failures.expect(rewritten, "values written by iterate_range");
+    return failures.count;
+}
+
+// A BPTreeMaintainer flushing, sorting and freezing leaves under writers and readers must leave exactly what
+// was inserted, and stop cleanly whether running, paused or restarted. Returns how many checks failed.
+int checkMaintainer()
+{
+    CheckFailures failures("Maintainer");
+
+    BPTree<int, int> bPTree(8, 8, 4, 8);
+    MaintenanceOptions options;
+    options.log_fill_threshold = 0.25;
+    options.interval_ms = 1;
+    options.freeze_after_passes = 2;
+    BPTreeMaintainer<int, int> maintainer(bPTree, options);
+    maintainer.start();
+
+    // Each writer owns the keys equal to it modulo numWriters; the last value written to a key is its own
+    const int numWriters = 3;
+    vector<map<int, int>> written(numWriters);
+    atomic<int> done(0);
+    vector<thread> writers;
+    for (int w = 0; w < numWriters; w++)
+    {
+        writers.emplace_back([&, w]()
+        {
+            mt19937 gen(w + 17);
+            for (int i = 0; i < 40000; i++)
+            {
+                // Bursts into one region at a time, so the others go quiet for long enough to freeze
+                const int key = ((i / 5000) * 20000 + (int) (gen() % 20000)) / numWriters * numWriters + w;
+                bPTree.insert(key, i);
+                written[w][key] = i;
+            }
+            done++;
+        });
+    }
+
+    // Readers alongside: the scan must come back in key order whatever the maintainer is doing to the leaves
+    vector<int> keys(500), values(500);
+    bool ordered = true;
+    for (int round = 0; done < numWriters; round++)
+    {
+        BPTreeScanBatch<int> batch = bPTree.scan_into((round * 7919) % 160000, keys.size(), keys.data(), values.data());
+        ordered = ordered && is_sorted(keys.begin(), keys.begin() + batch.count)
+            && adjacent_find(keys.begin(), keys.begin() + batch.count) == keys.begin() + batch.count;
+        bPTree.find((round * 104729) % 160000);
+        if (round % 50 == 0)
+        {
+            maintainer.pause();
+            maintainer.set_rate(5000 + round, 1);
+            maintainer.resume();
+        }
+    }
+    for (thread &writer : writers)
+    {
+        writer.join();
+    }
+    failures.expect(ordered, "scan_into out of order during maintenance");
+    failures.expect(maintainer.num_passes() > 0 && maintainer.num_leaves_serviced() > 0, "the maintainer never serviced a leaf");
+
+    maintainer.pause();
+    maintainer.stop();
+    maintainer.start();
+    this_thread::sleep_for(milliseconds(20));
+    maintainer.stop();
+
+    map<int, int> reference;
+    for (auto &part : written)
+    {
+        reference.insert(part.begin(), part.end());
+    }
+    failures.expect(treeContents(bPTree) == vector<pair<int, int>>(reference.begin(), reference.end()), "contents after maintenance");
+    bool found = true;
+    for (auto &entry : reference)
+    {
+        int* value = bPTree.find(entry.first);
+        found = found && value != nullptr && *value == entry.second;
+    }
+    failures.expect(found, "find after maintenance");
+    return failures.count;
+}
+
+// WorkloadGeometryPolicy that counts the leaves it moved to another geometry
+class CountingGeometryPolicy: public WorkloadGeometryPolicy {
+public:
+    atomic<int> changes{0};
+
+    CountingGeometryPolicy(BPAGeometry base) : WorkloadGeometryPolicy(base, 4, 16) {}
+
+    BPAGeometry choose(const BPAGeometry& current, const LeafWorkloadSample& sample) override
+    {
+        BPAGeometry chosen = WorkloadGeometryPolicy::choose(current, sample);
+        changes += !(chosen == current);
+        return chosen;
+    }
+};
+
+// A geometry policy switched on mid-workload must reshape leaves, write-hot and read-hot ones alike, without
+// losing or mixing up any contents. Returns how many checks failed.
+int checkGeometryPolicy()
+{
+    CheckFailures failures("Geometry policy");
+
+    BPTree<int, int> bPTree(8, 4, 4, 8);
+    CountingGeometryPolicy policy({4, 4, 8});
+    map<int, int> inserted[2];
+    mt19937 gen(23);
+    for (int i = 0; i < 20000; i++)
+    {
+        const int key = (int) (gen() % 100000) * 2;
+        bPTree.insert(key, i);
+        inserted[key < 100000 ? 0 : 1][key] = i;
+    }
+
+    // The low half only sees inserts, the high half mostly finds with an occasional insert; the policy goes on
+    // while both are running
+    atomic<int> started(0);
+    vector<thread> workers;
+    for (int w = 0; w < 2; w++)
+    {
+        workers.emplace_back([&, w]()
+        {
+            mt19937 gen(w + 29);
+            started++;
+            for (int i = 0; i < 60000; i++)
+            {
+                const int key = (w == 0 ? 0 : 100000) + (int) (gen() % 50000) * 2 + 1;
+                if (w == 0 || i % 16 == 0)
+                {
+                    bPTree.insert(key, i);
+                    inserted[w][key] = i;
+                }
+                else
+                {
+                    bPTree.find(key);
+                }
+            }
+        });
+    }
+    while (started < 2)
+    {
+        this_thread::yield();
+    }
+    bPTree.set_geometry_policy(&policy);
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+    bPTree.set_geometry_policy(nullptr);
+    failures.expect(policy.changes > 0, "no leaf changed geometry");
+
+    map<int, int> reference(inserted[0]);
+    reference.insert(inserted[1].begin(), inserted[1].end());
+    failures.expect(treeContents(bPTree) == vector<pair<int, int>>(reference.begin(), reference.end()), "contents after reshaping");
+    bool found = true;
+    for (auto &entry : reference)
+    {
+        int* value = bPTree.find(entry.first);
+        found = found && value != nullptr && *value == entry.second;
+    }
+    failures.expect(found, "find after reshaping");
+    return failures.count;
+}
+
+// stats() against a workload whose events are known: splits match the shape of the tree, and every scan, freeze
+// and thaw is counted once. Built without BPTREE_STATS the event counts must all stay zero. Returns how many
+// checks failed.
+int checkStats()
+{
+    CheckFailures failures("Stats");
+    BPTree<int, int> bPTree(8, 4, 4, 4);
+    map<int, int> reference;
+    mt19937 gen(31);
+    for (int i = 0; i < 20000; i++)
+    {
+        const int key = (int) (gen() % 100000);
+        bPTree.insert(key, i);
+        reference[key] = i;
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        bPTree.iterate_range(i * 1000, 100, [](int key) { return key; });
+    }
+    vector<int> keys(100), values(100);
+    for (int i = 0; i < 5; i++)
+    {
+        bPTree.scan_into(i * 1000, keys.size(), keys.data(), values.data());
+    }
+    treeContents(bPTree);
+    for (int round = 0; round < 3; round++)
+    {
+        bPTree.maintenance_pass(0.5, INT_MAX, 1);
+    }
+    bPTree.insert(-1, 0);
+    reference[-1] = 0;
+
+    BPTreeStats stats = bPTree.stats();
+    failures.expect(stats.elements == reference.size() && stats.leaf_count > 1 && stats.height > 1, "shape");
+    failures.expect(stats.redistributions > 0, "redistributions, which are always counted");
+    if (stats.counters_enabled)
+    {
+        // A single-threaded build never waits on a split or moves right, and each split adds one node
+        failures.expect(stats.leaf_splits == stats.leaf_count - 1, "leaf splits " + to_string(stats.leaf_splits) + " for " + to_string(stats.leaf_count) + " leaves");
+        failures.expect(stats.root_splits == (uint64_t) stats.height - 1, "root splits " + to_string(stats.root_splits) + " at height " + to_string(stats.height));
+        failures.expect(stats.internal_splits > 0 && stats.log_flushes > 0, "internal splits and log flushes");
+        failures.expect(stats.exclusive_scans == 10, "exclusive scans " + to_string(stats.exclusive_scans));
+        failures.expect(stats.shared_scans == 6, "shared scans " + to_string(stats.shared_scans));
+        failures.expect(stats.freezes == stats.leaf_count && stats.thaws == 1, "freezes " + to_string(stats.freezes) + ", thaws " + to_string(stats.thaws));
+        failures.expect(stats.leaf_move_rights == 0 && stats.split_link_retries == 0 && stats.leaf_merges == 0, "events this workload cannot cause");
+    }
+    else
+    {
+        failures.expect(stats.leaf_splits + stats.internal_splits + stats.root_splits + stats.log_flushes + stats.exclusive_scans
+            + stats.shared_scans + stats.freezes + stats.thaws == 0, "event counts without BPTREE_STATS");
+    }
+    return failures.count;
+}
+
+// Overwriting string keys must not grow the leaf key arenas much, and compaction must give back what splits
+// left in them. Returns 1 on a failure.
+int checkKeyArenas()
+{
+    BPTree<StringKey, int> bPTree(8, 16, 16, 64);
+    map<string, int> reference;
+    auto keyName = [](int i) { return "a key longer than its inline prefix " + to_string(i); };
+    for (int round = 0; round < 20; round++)
+    {
+        for (int i = 0; i < 3000; i++)
+        {
+            bPTree.insert(StringKey(keyName(i)), round);
+            reference[keyName(i)] = round;
+        }
+    }
+    size_t loaded = bPTree.space_report().arena_bytes;
+    bPTree.compact_leaves(0.0, 1.0);
+    bPTree.compact_leaves(0.0, 1.0);
+    size_t compacted = bPTree.space_report().arena_bytes;
+
+    bool match = true;
+    for (auto &entry : reference)
+    {
+        int* value = bPTree.find(StringKey(entry.first));
+        match = match && value != nullptr && *value == entry.second;
+    }
+    // 3000 keys of about 40 bytes each, well below 1 MB even with a spare chunk per leaf
+    if (!match || loaded > (1 << 20) || compacted >= loaded)
+    {
+        cout << "Key arena check failed: " << loaded << " bytes after overwrites, " << compacted << " after compaction" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// MVCC consistency under load: each writer inserts its own keys with values 0, 1, 2, ... in that order, so
+// any read view must see a prefix of every writer's inserts, and the same prefix every time it is scanned.
+// Returns how many views broke that.
+int checkPackedKeys()
+{
+    CheckFailures failures("Packed key");
+
+    // One run per offset width, each straddling zero so that the base and most keys are negative
+    const int64_t spreads[] = {200, 60000, 3000000000LL, 4000000000000000LL};
+    const int widths[] = {1, 2, 4, 8};
+    for (int w = 0; w < 4; w++)
+    {
+        const string name = "width " + to_string(widths[w]);
+        vector<int64_t> keys;
+        for (int64_t i = 0; i < 64; i++)
+            keys.push_back(-spreads[w] / 2 + spreads[w] * i / 63);
+
+        PackedKeyRun<int64_t> run;
+        run.encode(keys.data(), keys.size());
+        failures.expect(run.key_width() == widths[w], name + " chosen");
+        vector<int64_t> decoded(keys.size());
+        run.decode(decoded.data(), 0, keys.size());
+        failures.expect(decoded == keys && run.at(17) == keys[17], name + " decode");
+
+        // Every key, its neighbours, and keys far outside the run on both sides
+        vector<int64_t> probes = {INT64_MIN, INT64_MIN + 1, keys.front() - spreads[w], keys.back() + spreads[w], INT64_MAX};
+        for (int64_t key : keys)
+        {
+            probes.push_back(key - 1);
+            probes.push_back(key);
+            probes.push_back(key + 1);
+        }
+        bool searches = true;
+        for (int64_t probe : probes)
+        {
+            searches = searches && run.lower_bound_of(probe) == (uint32_t) (lower_bound(keys.begin(), keys.end(), probe) - keys.begin())
+                && run.upper_bound_of(probe) == (uint32_t) (upper_bound(keys.begin(), keys.end(), probe) - keys.begin());
+        }
+        failures.expect(searches, name + " searches");
+
+        // The same keys as a leaf, in blocks of 8 that each pick their own width
+        vector<ElementBPA<int64_t, int>> elts(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            elts[i].isNull = false;
+            elts[i].key = keys[i];
+            elts[i].value = (int) i;
+        }
+        PackedLeaf<int64_t, int> leaf;
+        leaf.build(elts.data(), elts.size(), 8);
+        bool finds = true;
+        for (int64_t probe : probes)
+        {
+            size_t pos = lower_bound(keys.begin(), keys.end(), probe) - keys.begin();
+            bool present = pos < keys.size() && keys[pos] == probe;
+            int* value = leaf.find(probe);
+            finds = finds && (present ? value != nullptr && *value == (int) pos : value == nullptr);
+        }
+        failures.expect(finds, name + " leaf find");
+
+        vector<int64_t> scanned;
+        leaf.scan(keys[5] + 1, keys[40], [&](int64_t key, int value) { scanned.push_back(key); finds = finds && key == keys[value]; });
+        failures.expect(finds && scanned == vector<int64_t>(keys.begin() + 6, keys.begin() + 40), name + " leaf scan");
+        scanned.clear();
+        failures.expect(leaf.scan_from(INT64_MIN, 10, [&](int64_t key, int) { scanned.push_back(key); }) == 10
+            && scanned == vector<int64_t>(keys.begin(), keys.begin() + 10), name + " leaf scan from below the range");
+        failures.expect(leaf.scan(keys.back() + 1, INT64_MAX, [](int64_t, int) {}) == 0, name + " leaf scan above the range");
+
+        vector<int64_t> copiedKeys(keys.size());
+        vector<int> copiedValues(keys.size());
+        size_t copied = leaf.copy_from(keys[60], keys.size(), copiedKeys.data(), copiedValues.data());
+        failures.expect(copied == 4 && equal(keys.begin() + 60, keys.end(), copiedKeys.begin()) && copiedValues[0] == 60, name + " leaf copy");
+
+        vector<ElementBPA<int64_t, int>> unpacked;
+        leaf.unpack(unpacked);
+        bool same = unpacked.size() == keys.size();
+        for (size_t i = 0; same && i < keys.size(); i++)
+            same = unpacked[i].key == keys[i] && unpacked[i].value == (int) i;
+        int64_t lowest;
+        failures.expect(same && leaf.min_key(lowest) && lowest == keys[0], name + " leaf unpack");
+    }
+
+    // A tree routing 64 bit keys through packed separators, split often by a small order
+    BPTree<int64_t, int> bPTree(4, 4, 4, 16);
+    map<int64_t, int> reference;
+    mt19937_64 gen(35);
+    for (int i = 0; i < 20000; i++)
+    {
+        int64_t key = (int64_t) gen();
+        bPTree.insert(key, i);
+        reference[key] = i;
+    }
+    bool routed = true;
+    for (auto &entry : reference)
+    {
+        int* value = bPTree.find(entry.first);
+        routed = routed && value != nullptr && *value == entry.second;
+    }
+    failures.expect(routed, "tree find across packed separators");
+    return failures.count;
+}
+
+int checkReadViews()
+{
+    const int numWriters = 3;
+    const int perWriter = 30000;
+    BPTree<int, int> bPTree(8, 8, 4, 6);
+    vector<thread> writers;
+    for (int w = 0; w < numWriters; w++)
+    {
+        writers.emplace_back([&, w]()
+        {
+            for (int i = 0; i < perWriter; i++)
+            {
+                // Scattered over the key space, so the writers split leaves under each other's scans
+                bPTree.insert((int) ((i * 7919L) % perWriter) * 4 + w, i);
+            }
+        });
+    }
+
+    int failures = 0;
+    for (int check = 0; check < 200; check++)
+    {
+        ReadView view = bPTree.begin_read();
+        vector<int> seen[2];
+        for (vector<int> &counts : seen)
+        {
+            vector<int> highest(numWriters, -1);
+            counts.assign(numWriters, 0);
+            bPTree.scan_view(view, 0, INT_MAX, [&](int key, int value)
+            {
+                counts[key % 4]++;
+                highest[key % 4] = max(highest[key % 4], value);
+            });
+            for (int w = 0; w < numWriters; w++)
+            {
+                failures += (counts[w] != highest[w] + 1);
+            }
+        }
+        failures += (seen[0] != seen[1]);
+        bPTree.end_read(view);
+    }
+    for (thread &writer : writers)
+    {
+        writer.join();
+    }
+    if (failures > 0)
+    {
+        cout << "Read view check failed: " << failures << " inconsistent views" << endl;
+    }
+    return failures;
+}
+
+int checkConcurrentBPlusTree()
+{
+    CheckFailures failures("Concurrent BPlusTree");
+    const int threads = 4;
+    const int perThread = 20000;
+    BPlusTree<int, int> bPlusTree(5, true);
+
+    // Each thread inserts its own keys in random order while finding keys it already inserted and scanning from
+    // them; the scans must come back in order and inside their bounds whatever the other threads split
+    atomic<int> missing{0};
+    atomic<int> misordered{0};
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            vector<int> keys;
+            for (int i = 0; i < perThread; i++)
+                keys.push_back(i * threads + t);
+            shuffle(keys.begin(), keys.end(), mt19937(t));
+
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                bPlusTree.insert(keys[i], 2 * keys[i]);
+                if (bPlusTree.find(keys[i / 2]) == nullptr)
+                    missing++;
+                if (i % 64 != 0)
+                    continue;
+
+                int previous = keys[i] - 1;
+                int visited = 0;
+                bPlusTree.iterate_range(keys[i], 100, [&](const int &key, int &)
+                {
+                    misordered += key <= previous;
+                    previous = key;
+                    visited++;
+                });
+                misordered += visited == 0 || visited > 100;
+
+                previous = keys[i] - 1;
+                bPlusTree.map_range(keys[i], keys[i] + 400, [&](const int &key, int &)
+                {
+                    misordered += key <= previous || key >= keys[i] + 400;
+                    previous = key;
+                });
+            }
+        });
+    }
+    for (thread &worker : workers)
+        worker.join();
+    failures.expect(missing == 0, "find of an inserted key while others insert");
+    failures.expect(misordered == 0, "scans while others insert");
+
+    map<int, int> reference;
+    for (int key = 0; key < threads * perThread; key++)
+        reference[key] = 2 * key;
+
+    bool found = true;
+    for (auto &entry : reference)
+    {
+        BPlusTreeNode<int, int> *leaf = bPlusTree.find(entry.first);
+        size_t index = (leaf == nullptr) ? 0 : lower_bound(leaf->keys.begin(), leaf->keys.end(), entry.first) - leaf->keys.begin();
+        found = found && leaf != nullptr && index < leaf->keys.size() && leaf->keys[index] == entry.first && leaf->values[index] == entry.second;
+    }
+    failures.expect(found, "find after the inserts");
+    failures.expect(bPlusTree.find(threads * perThread) == nullptr, "find past the last key");
+
+    vector<pair<int, int>> scanned;
+    bPlusTree.iterate_range(INT_MIN, threads * perThread + 10, [&](const int &key, int &value) { scanned.push_back({key, value}); });
+    failures.expect(scanned == vector<pair<int, int>>(reference.begin(), reference.end()), "iterate_range after the inserts");
+
+    // Wide enough to cross many leaves
+    scanned.clear();
+    bPlusTree.map_range(1000, 50000, [&](const int &key, int &value) { scanned.push_back({key, value}); });
+    failures.expect(scanned == vector<pair<int, int>>(reference.lower_bound(1000), reference.lower_bound(50000)), "map_range after the inserts");
+    return failures.count;
+}
+
+int checkBPlusTreeArray()
+{
+    CheckFailures failures("BPlusTreeArray");
+
+    // Small orders split and empty leaves constantly; removes leave the emptied leaves in the chain
+    for (int order : {3, 4, 5})
+    {
+        for (bool concurrent : {false, true})
+        {
+            const string name = "order " + to_string(order) + (concurrent ? " concurrent" : "");
+            BPlusTreeArray<int, int> arrayTree(order, concurrent);
+            map<int, int> reference;
+            mt19937 gen(order);
+            uniform_int_distribution<int> keyDistr(0, 3000);
+            uniform_int_distribution<int> opDistr(0, 9);
+
+            bool finds = true;
+            bool ranges = true;
+            for (int i = 0; i < 30000; i++)
+            {
+                const int key = keyDistr(gen);
+                const int op = opDistr(gen);
+                if (op < 4)
+                {
+                    // The tree keeps duplicates, so a present key is rewritten in place instead
+                    if (reference.count(key) == 0)
+                        arrayTree.insert(key, i);
+                    else
+                        arrayTree.map_range(key, key + 1, [i](const int &, int &value) { value = i; });
+                    reference[key] = i;
+                }
+                else if (op < 7)
+                {
+                    arrayTree.remove(key);
+                    reference.erase(key);
+                }
+                else if (op < 9)
+                {
+                    // find returns the leaf holding the smallest key at or above the one asked for
+                    auto expected = reference.lower_bound(key);
+                    BPlusTreeArrayNode<int, int> *leaf = arrayTree.find(key);
+                    if (expected == reference.end())
+                    {
+                        finds = finds && leaf == nullptr;
+                        continue;
+                    }
+                    int index = (leaf == nullptr) ? 0 : lower_bound(leaf->keys, leaf->keys + leaf->count, expected->first) - leaf->keys;
+                    finds = finds && leaf != nullptr && index < leaf->count && leaf->keys[index] == expected->first
+                        && leaf->values[index] == expected->second;
+                }
+                else
+                {
+                    vector<pair<int, int>> scanned;
+                    arrayTree.iterate_range(key, 20, [&](const int &k, int &v) { scanned.push_back({k, v}); });
+                    vector<pair<int, int>> expected;
+                    for (auto it = reference.lower_bound(key); it != reference.end() && expected.size() < 20; ++it)
+                        expected.push_back(*it);
+                    ranges = ranges && scanned == expected;
+
+                    scanned.clear();
+                    arrayTree.map_range(key, key + 150, [&](const int &k, int &v) { scanned.push_back({k, v}); });
+                    ranges = ranges && scanned == vector<pair<int, int>>(reference.lower_bound(key), reference.lower_bound(key + 150));
+                }
+            }
+            failures.expect(finds, name + " find");
+            failures.expect(ranges, name + " iterate_range and map_range");
+
+            vector<pair<int, int>> scanned;
+            arrayTree.map_range(INT_MIN, INT_MAX, [&](const int &k, int &v) { scanned.push_back({k, v}); });
+            failures.expect(scanned == vector<pair<int, int>>(reference.begin(), reference.end()), name + " contents");
+
+            // Remove everything, the tree must read as empty while its emptied leaves remain
+            for (auto &entry : reference)
+                arrayTree.remove(entry.first);
+            int left = 0;
+            arrayTree.iterate_range(INT_MIN, INT_MAX, [&](const int &, int &) { left++; });
+            failures.expect(left == 0 && arrayTree.find(INT_MIN) == nullptr, name + " remove everything");
+        }
+    }
+    return failures.count;
+}
+
+int checkPageSlab()
+{
+    CheckFailures failures("PageSlab");
+    PageSlabOptions options;
+    options.huge_pages = false;
+    PageSlab slab(options);
+    {
+        BPTree<int, int> slabTree(8, 4, 8, 8, &slab);
+        BPTree<int, int> heapTree(8, 4, 8, 8);
+        mt19937 gen(38);
+        uniform_int_distribution<int> distr(0, 100000);
+        for (int i = 0; i < 60000; i++)
+        {
+            const int key = distr(gen);
+            slabTree.insert(key, i);
+            heapTree.insert(key, i);
+        }
+        failures.expect(treeContents(slabTree) == treeContents(heapTree), "contents after inserts");
+
+        // Leaf objects are carved from the slab next to their BPA arrays
+        size_t leaves = slabTree.stats().leaf_count;
+        failures.expect(slab.get_stats().bytes_in_use >= leaves * sizeof(BPTreeNode_Leaf<int, int>), "leaves placed in the slab");
+
+        // Merged leaves are retired and then freed back to the slab
+        slabTree.compact_leaves(0.8, 1.0);
+        slabTree.compact_leaves(0.8, 1.0);
+        failures.expect(treeContents(slabTree) == treeContents(heapTree), "contents after compaction");
+    }
+    failures.expect(slab.get_stats().bytes_in_use == 0, "every byte given back once the tree is gone");
+    return failures.count;
+}
+
+int checkTraceRoundTrip()
+{
+    CheckFailures failures("Trace");
+    const char* path = "check.trace";
+
+    // Records from this thread and from a second one, with negative and extreme fields
+    vector<TraceRecord<int, int>> expected;
+    BPTreeTraceRecorder<int, int> recorder;
+    failures.expect(recorder.open(path), "recorder opened");
+    auto record = [&](TraceOp op, int key, int value, int length)
+    {
+        if (op == TraceOp::Insert)
+            recorder.record_insert(key, value);
+        else if (op == TraceOp::Find)
+            recorder.record_find(key);
+        else
+            recorder.record_range(key, length);
+        expected.push_back({op, 0, 0, key, op == TraceOp::Insert ? value : 0, op == TraceOp::Range ? length : 0});
+    };
+    for (int i = 0; i < 5000; i++)
+        record((TraceOp) (i % 3), i * 7919 - 20000000, -i, i % 500);
+    record(TraceOp::Insert, INT_MIN, INT_MAX, 0);
+    record(TraceOp::Range, INT_MAX, 0, INT_MAX);
+    thread([&]() { record(TraceOp::Find, 42, 0, 0); }).join();
+    record(TraceOp::Insert, 7, 8, 0);
+    recorder.close();
+
+    vector<TraceRecord<int, int>> loaded;
+    failures.expect(load_trace(path, loaded) && loaded.size() == expected.size(), "trace loaded");
+    bool fields = loaded.size() == expected.size();
+    bool threads = fields;
+    uint64_t previous = 0;
+    for (size_t i = 0; fields && i < loaded.size(); i++)
+    {
+        fields = loaded[i].op == expected[i].op && loaded[i].key == expected[i].key && loaded[i].value == expected[i].value
+            && loaded[i].length == expected[i].length && loaded[i].time_us >= previous;
+        previous = loaded[i].time_us;
+        // Only the record made on the second thread carries another thread number
+        threads = threads && (loaded[i].thread == loaded[0].thread) == (i != loaded.size() - 2);
+    }
+    failures.expect(fields, "op, key, value, length and time survive");
+    failures.expect(threads, "thread numbers survive");
+
+    // Cutting into the last record drops it and keeps everything before it
+    ifstream saved(path, ios::binary);
+    const string bytes((istreambuf_iterator<char>(saved)), istreambuf_iterator<char>());
+    saved.close();
+    ofstream(path, ios::binary | ios::trunc).write(bytes.data(), bytes.size() - 1);
+    vector<TraceRecord<int, int>> truncated;
+    failures.expect(load_trace(path, truncated) && truncated.size() == expected.size() - 1
+        && truncated.back().key == expected[expected.size() - 2].key, "record cut short at the end dropped");
+
+    vector<TraceRecord<int64_t, int>> otherKeys;
+    failures.expect(!load_trace(path, otherKeys), "trace of other key types rejected");
+    remove(path);
+    return failures.count;
+}
+
 int main()
 {
+    if (checkRangeApis() + checkContentApis() + checkStreamErrors() + checkLeafFilter() + checkShardedTree() + checkMaintainer()
+        + checkGeometryPolicy() + checkStats() + checkWalReplay() + checkKeyArenas() + checkPackedKeys() + checkReadViews()
+        + checkConcurrentBPlusTree() + checkBPlusTreeArray() + checkPageSlab() + checkTraceRoundTrip() > 0)
+    {
+        return 1;
+    }
+
     // Setup experiments by initializing values to arrays.
     int num_blocks[5] = {4,8,16,32,64};
     int block_size[5] = {4,8,16,32,64};
     int bplus_size[5] = {256,1024,4096,16384,65536};
 
+    // Per-operation latencies of every phase, also written to latency.csv for plotting.
+    LatencyHistogram latency;
+    ofstream latencyCsv("latency.csv");
+    latencyCsv << "experiment,tree,phase," << LatencyHistogram::csv_columns() << "\n";
+
     // Loop through the experiments.
     for (int k = 0; k < 5; k++)
     {
@@ -25,6 +1241,20 @@ int main()
         random_device rand;
         mt19937 gen(rand());
 
+        // Times count operations one by one, each on a key drawn before its clock starts, then prints their
+        // percentiles and starts the next phase afresh.
+        auto measureLatency = [&](const string &tree, const string &phase, int count, auto drawKey, auto op)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                const int key = drawKey(i);
+                time_op(latency, [&]() { op(key, i); });
+            }
+            latency.print(cout, tree + " " + phase);
+            latency.write_csv(latencyCsv, to_string(k) + "," + tree + "," + phase);
+            latency.reset();
+        };
+
         // Create BP tree.
         cout << "Testing BP Tree with header size: " << num_blocks[k] << " and block_size: " << block_size[k] << endl;
         cout << "Testing B+ Tree with size: " << bplus_size[k] << endl;
@@ -67,6 +1297,25 @@ int main()
         duration = duration_cast<microseconds>(stop-start);
         cout << " Duration of B+ Tree for inserts: " << duration.count() << " microseconds." <<endl;
 
+        // Create array-node B+ tree.
+        BPlusTreeArray<int, int> bPlusArrayTree(bplus_size[k]);
+
+        // Populate initial data set.
+        for (int i = 0; i < 10000000; i++)
+        {
+            bPlusArrayTree.insert(distr(gen), i);
+        }
+
+        // Insert another 10M entries.
+        start = high_resolution_clock::now();
+        for (int i = 0; i < 10000000; i++)
+        {
+            bPlusArrayTree.insert(distr(gen), i);
+        }
+        stop = high_resolution_clock::now();
+        duration = duration_cast<microseconds>(stop-start);
+        cout << " Duration of array B+ Tree for inserts: " << duration.count() << " microseconds." <<endl;
+
 
         // Point find queries on BP tree.
         start = high_resolution_clock::now();
@@ -96,6 +1345,16 @@ int main()
         duration = duration_cast<microseconds>(stop-start);
         cout << " Duration of B+ Tree for finds: " << duration.count() << " microseconds." << endl;
 
+        // Point find queries on array B+ tree.
+        start = high_resolution_clock::now();
+        for (int i = 0; i < 10000; i++)
+        {
+            bPlusArrayTree.find(distr(gen));
+        }
+        stop = high_resolution_clock::now();
+        duration = duration_cast<microseconds>(stop-start);
+        cout << " Duration of array B+ Tree for finds: " << duration.count() << " microseconds." << endl;
+
 
         // Time range queries.
         // Generate random max_range.
@@ -110,7 +1369,7 @@ int main()
 
         // Perform queries at randomly determined ranges for BP tree.
         start = high_resolution_clock::now();
-        for (int i = 0; i < sizeof(range_lengths); i++)
+        for (size_t i = 0; i < sizeof(range_lengths) / sizeof(range_lengths[0]); i++)
         {
             bPTree.iterate_range(distr(gen), range_lengths[i], &add_five);
         }
@@ -120,16 +1379,28 @@ int main()
 
         // Perform queries at randomly determined ranges for B+ tree.
         start = high_resolution_clock::now();
-        for (int i = 0; i < sizeof(range_lengths); i++)
+        for (size_t i = 0; i < sizeof(range_lengths) / sizeof(range_lengths[0]); i++)
         {
             const int key = distr(gen);
-            bPlusTree.iterate_range(key, range_lengths[i], [](const int &key,  int &value)
+            bPlusTree.iterate_range(key, range_lengths[i], [](const int &,  int &value)
             {value += 5;});
         }
         stop = high_resolution_clock::now();
         duration = duration_cast<microseconds>(stop-start);
         cout << " Duration of B+ Tree for range queries: " << duration.count() << " microseconds." << endl;
 
+        // Perform queries at randomly determined ranges for array B+ tree.
+        start = high_resolution_clock::now();
+        for (size_t i = 0; i < sizeof(range_lengths) / sizeof(range_lengths[0]); i++)
+        {
+            const int key = distr(gen);
+            bPlusArrayTree.iterate_range(key, range_lengths[i], [](const int &,  int &value)
+            {value += 5;});
+        }
+        stop = high_resolution_clock::now();
+        duration = duration_cast<microseconds>(stop-start);
+        cout << " Duration of array B+ Tree for range queries: " << duration.count() << " microseconds." << endl;
+
         // Insert monotonically increasing values.
         start = high_resolution_clock::now();
         for (int i = 0; i < 1000000; i++)
@@ -149,5 +1420,45 @@ int main()
         stop = high_resolution_clock::now();
         duration = duration_cast<microseconds>(stop-start);
         cout << " Duration of B+ Tree for monotonically increasing inserts: " << duration.count() << " microseconds." << endl;
+
+        // Insert monotonically increasing values.
+        start = high_resolution_clock::now();
+        for (int i = 0; i < 1000000; i++)
+        {
+            bPlusArrayTree.insert(i + i, i);
+        }
+        stop = high_resolution_clock::now();
+        duration = duration_cast<microseconds>(stop-start);
+        cout << " Duration of array B+ Tree for monotonically increasing inserts: " << duration.count() << " microseconds." << endl;
+
+        // Per-operation latencies come from a pass of their own once every phase above is timed, so that the
+        // clock reads around each operation stay out of the durations. Inserts are sampled with a tenth as
+        // many fresh keys as their phase; finds and range queries run as many operations as theirs.
+        cout << " Per-operation latencies, measured separately:" << endl;
+        auto randomKey = [&](int) { return distr(gen); };
+        auto nextEven = [](int i) { return 2 * (1000000 + i); };
+        auto rangeStart = [&](int) { return distr(gen); };
+        measureLatency("BP Tree", "inserts", 1000000, randomKey, [&](int key, int i) { bPTree.insert(key, i); });
+        measureLatency("B+ Tree", "inserts", 1000000, randomKey, [&](int key, int i) { bPlusTree.insert(key, i); });
+        measureLatency("array B+ Tree", "inserts", 1000000, randomKey, [&](int key, int i) { bPlusArrayTree.insert(key, i); });
+        measureLatency("BP Tree", "finds", 10000, randomKey, [&](int key, int) { bPTree.find(key); });
+        measureLatency("B+ Tree", "finds", 10000, randomKey, [&](int key, int) { bPlusTree.find(key); });
+        measureLatency("array B+ Tree", "finds", 10000, randomKey, [&](int key, int) { bPlusArrayTree.find(key); });
+        measureLatency("BP Tree", "range queries", 1000, rangeStart, [&](int key, int i)
+        {
+            bPTree.iterate_range(key, range_lengths[i], &add_five);
+        });
+        measureLatency("B+ Tree", "range queries", 1000, rangeStart, [&](int key, int i)
+        {
+            bPlusTree.iterate_range(key, range_lengths[i], [](const int &,  int &value) {value += 5;});
+        });
+        measureLatency("array B+ Tree", "range queries", 1000, rangeStart, [&](int key, int i)
+        {
+            bPlusArrayTree.iterate_range(key, range_lengths[i], [](const int &,  int &value) {value += 5;});
+        });
+        // Continues the monotonic phase above its last key
+        measureLatency("BP Tree", "monotonically increasing inserts", 100000, nextEven, [&](int key, int i) { bPTree.insert(key, i); });
+        measureLatency("B+ Tree", "monotonically increasing inserts", 100000, nextEven, [&](int key, int i) { bPlusTree.insert(key, i); });
+        measureLatency("array B+ Tree", "monotonically increasing inserts", 100000, nextEven, [&](int key, int i) { bPlusArrayTree.insert(key, i); });
     }
 }
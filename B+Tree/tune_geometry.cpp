@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "bp_tree.cpp"
+#include "workload.cpp"
+#include "latency_histogram.cpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Searches BPTree shapes (order and BPA log size, block count and block size) for a workload with short
+// single-threaded runs, and reports the configurations that are Pareto-best for throughput, p99 latency and
+// memory per element: those that no other configuration beats on all three at once.
+//
+//   tune_geometry [--workload=A..F] [--distribution=uniform|zipfian|latest|hotspot] [--theta=T] [--ordered]
+//                 [--read=P] [--update=P] [--insert=P] [--scan=P] [--rmw=P] [--scan-length=N]
+//                 [--preload=N] [--ops=N] [--repeats=N] [--budget=N] [--seed=N] [--csv=PATH] [--trace=PATH]
+//
+// The workload flags are those of bench_mt. With --trace the workload is instead a sample of a trace written
+// by BPTreeTraceRecorder: its first --preload records build the tree and the --ops records after them are
+// timed, all on one thread. The search first measures half of --budget configurations drawn
+// at random from the grid, then spends the rest on untried grid neighbours of whatever is on the front at the
+// time, so that it refines around the good shapes instead of sweeping the whole grid. Each configuration is
+// run --repeats times on a fresh tree and scored by the median throughput and p99. Memory is what the leaves
+// take, BPA arrays included, after the run. --csv writes every configuration measured.
+
+struct TuneConfig
+{
+    WorkloadSpec workload = default_workload();
+    long preload = 200000;
+    long ops = 100000;
+    int repeats = 3;
+    int budget = 40;
+    uint64_t seed = 42;
+    string csv_path;
+    string trace_path;
+    vector<TraceRecord<int, int>> trace;
+
+    static WorkloadSpec default_workload() {
+        WorkloadSpec spec;
+        spec.insert = 50;
+        spec.read = 40;
+        spec.update = 0;
+        spec.scan = 10;
+        spec.distribution = KeyDistribution::Uniform;
+        return spec;
+    }
+};
+
+// Values tried for each parameter. A neighbour differs from a point by one step along one of them.
+const vector<int> order_values = {8, 16, 32, 64};
+const vector<int> log_size_values = {2, 3, 4, 8, 16};
+const vector<int> num_blocks_values = {4, 8, 16, 32};
+const vector<int> block_size_values = {4, 8, 16, 32, 64};
+
+// A point of the grid, as indexes into the value lists
+struct GridPoint
+{
+    int order;
+    int log_size;
+    int num_blocks;
+    int block_size;
+
+    bool operator<(const GridPoint& other) const {
+        return tie(order, log_size, num_blocks, block_size) < tie(other.order, other.log_size, other.num_blocks, other.block_size);
+    }
+
+    // A log larger than half the blocks would flush into blocks it can overfill on its own
+    bool valid() const {
+        return log_size_values[log_size] * 2 <= num_blocks_values[num_blocks] * block_size_values[block_size];
+    }
+};
+
+struct TuneResult
+{
+    GridPoint point;
+    double throughput = 0;       // Operations per second
+    uint64_t p99_ns = 0;
+    double bytes_per_element = 0;
+    int height = 0;
+    double average_fill = 0;
+
+    int order() const { return order_values[point.order]; }
+    int log_size() const { return log_size_values[point.log_size]; }
+    int num_blocks() const { return num_blocks_values[point.num_blocks]; }
+    int block_size() const { return block_size_values[point.block_size]; }
+
+    // At least as good on every objective and better on one
+    bool dominates(const TuneResult& other) const {
+        bool no_worse = throughput >= other.throughput && p99_ns <= other.p99_ns && bytes_per_element <= other.bytes_per_element;
+        bool better = throughput > other.throughput || p99_ns < other.p99_ns || bytes_per_element < other.bytes_per_element;
+        return no_worse && better;
+    }
+};
+
+struct RunSample
+{
+    double throughput;
+    uint64_t p99_ns;
+    double bytes_per_element;
+    BPTreeStats stats;
+};
+
+// Rewrites the value of the first element at or after key in place, the update bench_mt times
+void update_value(BPTree<int, int>& tree, int key, int value) {
+    tree.iterate_range(key, 1, [value](int) { return value; });
+}
+
+// Copies the elements into scratch columns with scan_into, the read-only scan bench_mt times, continuing a
+// batch that stops early on empty leaves from its resume key
+int scan_range(BPTree<int, int>& tree, int start, int length) {
+    static vector<int> keys, values;
+    if (keys.size() < (size_t) length) {
+        keys.resize(length);
+        values.resize(length);
+    }
+    int visited = 0;
+    while (visited < length) {
+        BPTreeScanBatch<int> batch = tree.scan_into(start, length - visited, keys.data(), values.data());
+        visited += (int) batch.count;
+        if (!batch.more)
+            break;
+        start = batch.resume;
+    }
+    return visited;
+}
+
+// Preloads the workload's records, then times config.ops operations. Returns the seconds taken.
+double run_workload(BPTree<int, int>& tree, const TuneConfig& config, LatencyHistogram& latency) {
+    WorkloadGenerator workload(config.workload);
+    for (long i = 0; i < config.preload; i++)
+        tree.insert(workload.key_of(workload.next_record()), (int) i);
+
+    WorkloadStream stream(workload, config.seed);
+    auto start = steady_clock::now();
+    for (long i = 0; i < config.ops; i++) {
+        WorkloadRequest request = stream.next();
+        int value = (int) i;
+        time_op(latency, [&]() {
+            switch (request.op) {
+            case WorkloadOp::Read:
+                tree.find(request.key);
+                break;
+            case WorkloadOp::Update:
+                update_value(tree, request.key, value);
+                break;
+            case WorkloadOp::Insert:
+                tree.insert(request.key, value);
+                break;
+            case WorkloadOp::Scan:
+                scan_range(tree, request.key, request.scan_length);
+                break;
+            case WorkloadOp::ReadModifyWrite:
+                tree.find(request.key);
+                update_value(tree, request.key, value);
+                break;
+            }
+        });
+    }
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+// Applies the first config.preload records of the trace, then times the config.ops after them
+double run_trace(BPTree<int, int>& tree, const TuneConfig& config, LatencyHistogram& latency) {
+    const vector<TraceRecord<int, int>>& trace = config.trace;
+    size_t preload = min((size_t) config.preload, trace.size());
+    size_t end = min(preload + (size_t) config.ops, trace.size());
+    auto apply = [&tree](const TraceRecord<int, int>& record) {
+        switch (record.op) {
+        case TraceOp::Insert:
+            tree.insert(record.key, record.value);
+            break;
+        case TraceOp::Find:
+            tree.find(record.key);
+            break;
+        case TraceOp::Range:
+            if (record.length > 0)
+                scan_range(tree, record.key, record.length);
+            break;
+        }
+    };
+
+    for (size_t i = 0; i < preload; i++)
+        apply(trace[i]);
+    auto start = steady_clock::now();
+    for (size_t i = preload; i < end; i++)
+        time_op(latency, [&]() { apply(trace[i]); });
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+// One run of the workload against a fresh tree of the point's shape. Every run replays the same records and
+// operations, so configurations are compared on identical work.
+RunSample run_once(const GridPoint& point, const TuneConfig& config) {
+    RunSample sample;
+    {
+        BPTree<int, int> tree(order_values[point.order], log_size_values[point.log_size], num_blocks_values[point.num_blocks],
+                              block_size_values[point.block_size]);
+        LatencyHistogram latency;
+        double seconds = config.trace.empty() ? run_workload(tree, config, latency) : run_trace(tree, config, latency);
+
+        sample.stats = tree.stats();
+        sample.throughput = latency.count() / max(seconds, 1e-9);
+        sample.p99_ns = latency.percentile(99);
+        sample.bytes_per_element = tree.space_report().bytes_per_entry();
+    }
+    return sample;
+}
+
+template <typename T>
+T median_of(vector<T> values) {
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+TuneResult evaluate(const GridPoint& point, const TuneConfig& config) {
+    vector<double> throughputs;
+    vector<uint64_t> p99s;
+    RunSample last;
+    for (int r = 0; r < config.repeats; r++) {
+        last = run_once(point, config);
+        throughputs.push_back(last.throughput);
+        p99s.push_back(last.p99_ns);
+    }
+
+    TuneResult result;
+    result.point = point;
+    result.throughput = median_of(throughputs);
+    result.p99_ns = median_of(p99s);
+    result.bytes_per_element = last.bytes_per_element; // The same in every run, the work is identical
+    result.height = last.stats.height;
+    result.average_fill = last.stats.average_fill;
+    return result;
+}
+
+vector<TuneResult> pareto_front(const vector<TuneResult>& results) {
+    vector<TuneResult> front;
+    for (const TuneResult& candidate : results) {
+        bool dominated = false;
+        for (const TuneResult& other : results) {
+            if (other.dominates(candidate)) {
+                dominated = true;
+                break;
+            }
+        }
+        if (!dominated)
+            front.push_back(candidate);
+    }
+    sort(front.begin(), front.end(), [](const TuneResult& a, const TuneResult& b) { return a.throughput > b.throughput; });
+    return front;
+}
+
+vector<GridPoint> neighbours(const GridPoint& point) {
+    vector<GridPoint> result;
+    auto step = [&](int GridPoint::*field, int num_values) {
+        for (int delta : {-1, 1}) {
+            GridPoint next = point;
+            next.*field += delta;
+            if (next.*field >= 0 && next.*field < num_values && next.valid())
+                result.push_back(next);
+        }
+    };
+    step(&GridPoint::order, (int) order_values.size());
+    step(&GridPoint::log_size, (int) log_size_values.size());
+    step(&GridPoint::num_blocks, (int) num_blocks_values.size());
+    step(&GridPoint::block_size, (int) block_size_values.size());
+    return result;
+}
+
+void print_result(const TuneResult& result) {
+    cout << "  order " << result.order() << " log " << result.log_size() << " blocks " << result.num_blocks()
+         << "x" << result.block_size() << ": " << (long) result.throughput << " ops/s, p99 " << result.p99_ns
+         << " ns, " << result.bytes_per_element << " bytes/element (height " << result.height << ", leaves "
+         << result.average_fill * 100 << "% full)" << endl;
+}
+
+vector<TuneResult> search(const TuneConfig& config) {
+    vector<GridPoint> grid;
+    for (int o = 0; o < (int) order_values.size(); o++) {
+        for (int l = 0; l < (int) log_size_values.size(); l++) {
+            for (int n = 0; n < (int) num_blocks_values.size(); n++) {
+                for (int b = 0; b < (int) block_size_values.size(); b++) {
+                    GridPoint point = {o, l, n, b};
+                    if (point.valid())
+                        grid.push_back(point);
+                }
+            }
+        }
+    }
+
+    mt19937_64 gen(config.seed);
+    shuffle(grid.begin(), grid.end(), gen);
+    int budget = min(config.budget, (int) grid.size());
+    int initial = max(1, budget / 2);
+
+    vector<TuneResult> results;
+    set<GridPoint> tried;
+    auto measure = [&](const GridPoint& point) {
+        tried.insert(point);
+        results.push_back(evaluate(point, config));
+        cout << " [" << results.size() << "/" << budget << "]";
+        print_result(results.back());
+    };
+
+    for (int i = 0; i < initial; i++)
+        measure(grid[i]);
+
+    // Refine around the front until the budget runs out or the front has no untried neighbours left
+    while ((int) results.size() < budget) {
+        set<GridPoint> untried;
+        for (const TuneResult& result : pareto_front(results)) {
+            for (const GridPoint& next : neighbours(result.point)) {
+                if (tried.count(next) == 0)
+                    untried.insert(next);
+            }
+        }
+        if (untried.empty())
+            break;
+        vector<GridPoint> candidates(untried.begin(), untried.end());
+        shuffle(candidates.begin(), candidates.end(), gen);
+        for (size_t i = 0; i < candidates.size() && (int) results.size() < budget; i++)
+            measure(candidates[i]);
+    }
+    return results;
+}
+
+static bool parse_flag(const char* arg, const char* name, long& out) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    out = atol(arg + len + 1);
+    return true;
+}
+
+static bool parse_args(int argc, char** argv, TuneConfig& config) {
+    WorkloadSpec& spec = config.workload;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        long v;
+        if (strncmp(arg, "--workload=", 11) == 0 && strlen(arg) == 12)
+            spec = WorkloadSpec::ycsb(arg[11]);
+        else if (strncmp(arg, "--distribution=", 15) == 0) {
+            if (!parse_distribution(arg + 15, spec.distribution)) {
+                cerr << "Unknown distribution: " << arg + 15 << endl;
+                return false;
+            }
+        }
+        else if (strncmp(arg, "--theta=", 8) == 0)
+            spec.zipf_theta = atof(arg + 8);
+        else if (strcmp(arg, "--ordered") == 0)
+            spec.ordered_keys = true;
+        else if (parse_flag(arg, "--read", v))
+            spec.read = (int) max(0l, v);
+        else if (parse_flag(arg, "--update", v))
+            spec.update = (int) max(0l, v);
+        else if (parse_flag(arg, "--insert", v))
+            spec.insert = (int) max(0l, v);
+        else if (parse_flag(arg, "--scan", v))
+            spec.scan = (int) max(0l, v);
+        else if (parse_flag(arg, "--rmw", v))
+            spec.read_modify_write = (int) max(0l, v);
+        else if (parse_flag(arg, "--scan-length", v))
+            spec.max_scan_length = (int) max(1l, v);
+        else if (parse_flag(arg, "--preload", v))
+            config.preload = max(0l, v);
+        else if (parse_flag(arg, "--ops", v))
+            config.ops = max(1l, v);
+        else if (parse_flag(arg, "--repeats", v))
+            config.repeats = (int) max(1l, v);
+        else if (parse_flag(arg, "--budget", v))
+            config.budget = (int) max(1l, v);
+        else if (parse_flag(arg, "--seed", v))
+            config.seed = (uint64_t) v;
+        else if (strncmp(arg, "--csv=", 6) == 0)
+            config.csv_path = arg + 6;
+        else if (strncmp(arg, "--trace=", 8) == 0)
+            config.trace_path = arg + 8;
+        else {
+            cerr << "Unknown argument: " << arg << endl;
+            return false;
+        }
+    }
+    if (spec.read + spec.update + spec.insert + spec.scan + spec.read_modify_write == 0) {
+        cerr << "The operation mix is empty" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    TuneConfig config;
+    if (!parse_args(argc, argv, config))
+        return 1;
+
+    if (!config.trace_path.empty()) {
+        if (!load_trace(config.trace_path.c_str(), config.trace) || config.trace.size() <= (size_t) config.preload) {
+            cerr << "Cannot read " << config.trace_path << " as a trace of int keys and values with more than "
+                 << config.preload << " records" << endl;
+            return 1;
+        }
+        cout << "Tuning for " << config.trace_path << ", records " << config.preload << " to "
+             << min(config.trace.size(), (size_t) (config.preload + config.ops)) << " x " << config.repeats
+             << " per configuration, budget " << config.budget << endl;
+    } else {
+        const WorkloadSpec& spec = config.workload;
+        cout << "Tuning for " << spec.read << " read / " << spec.update << " update / " << spec.insert << " insert / "
+             << spec.scan << " scan / " << spec.read_modify_write << " read-modify-write, preload " << config.preload
+             << ", " << config.ops << " ops x " << config.repeats << " per configuration, budget " << config.budget << endl;
+    }
+
+    vector<TuneResult> results = search(config);
+
+    cout << "Pareto front (throughput, p99, bytes/element):" << endl;
+    for (const TuneResult& result : pareto_front(results))
+        print_result(result);
+
+    if (!config.csv_path.empty()) {
+        ofstream csv(config.csv_path);
+        if (!csv) {
+            cerr << "Cannot write " << config.csv_path << endl;
+            return 1;
+        }
+        csv << "order,log_size,num_blocks,block_size,ops_per_second,p99_ns,bytes_per_element,height,average_fill\n";
+        for (const TuneResult& result : results) {
+            csv << result.order() << "," << result.log_size() << "," << result.num_blocks() << "," << result.block_size()
+                << "," << result.throughput << "," << result.p99_ns << "," << result.bytes_per_element << ","
+                << result.height << "," << result.average_fill << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Runs tasks 0..num_tasks-1 on num_threads workers and returns once all of them are done. Each worker starts with
+// a contiguous slice of the task indices and works through it front to back. Once it runs dry it steals from the
+// back of another worker's slice, so neighbouring tasks tend to stay on the same thread.
+// f receives the task index and the index of the worker running it.
+inline void run_work_stealing(size_t num_tasks, int num_threads, function<void(size_t, int)> f) {
+    if (num_threads < 1)
+        num_threads = 1;
+
+    struct Queue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    vector<unique_ptr<Queue>> queues;
+    for (int i = 0; i < num_threads; i++) {
+        queues.emplace_back(new Queue());
+        for (size_t task = num_tasks * i / num_threads; task < num_tasks * (i + 1) / num_threads; task++)
+            queues[i]->tasks.push_back(task);
+    }
+
+    auto worker = [&](int id) {
+        while (true) {
+            size_t task;
+            bool found = false;
+            {
+                lock_guard<mutex> guard(queues[id]->lock);
+                if (!queues[id]->tasks.empty()) {
+                    task = queues[id]->tasks.front();
+                    queues[id]->tasks.pop_front();
+                    found = true;
+                }
+            }
+
+            for (int i = 1; i < num_threads && !found; i++) {
+                Queue& victim = *queues[(id + i) % num_threads];
+                lock_guard<mutex> guard(victim.lock);
+                if (!victim.tasks.empty()) {
+                    task = victim.tasks.back();
+                    victim.tasks.pop_back();
+                    found = true;
+                }
+            }
+
+            // Tasks are never added once the pool starts, so empty everywhere means done
+            if (!found)
+                return;
+            f(task, id);
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 1; i < num_threads; i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (thread& t : threads)
+        t.join();
+}
@@ -0,0 +1,225 @@
+#pragma once
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// YCSB style workloads for the tree benchmarks. Records are numbered in the order they are inserted and
+// WorkloadGenerator::key_of turns a record number into a tree key, so that inserts land all over the tree unless
+// ordered_keys is set. The key distributions pick record numbers, which is what makes "latest" mean recently
+// inserted regardless of where those keys sit in the tree.
+
+enum class KeyDistribution { Uniform, Zipfian, Latest, Hotspot };
+
+enum class WorkloadOp { Read, Update, Insert, Scan, ReadModifyWrite };
+
+struct WorkloadSpec
+{
+    // Proportions of each operation, need not add up to anything in particular
+    int read = 50;
+    int update = 50;
+    int insert = 0;
+    int scan = 0;
+    int read_modify_write = 0;
+
+    KeyDistribution distribution = KeyDistribution::Zipfian;
+    double zipf_theta = 0.99;       // Skew of Zipfian and Latest, in (0, 1)
+    double hotspot_fraction = 0.2;  // Share of the records that are hot
+    double hotspot_ops = 0.8;       // Share of the operations that go to them
+    int max_scan_length = 100;      // Scans cover 1..max_scan_length elements, uniformly
+    bool ordered_keys = false;      // Key of record i is i, so inserts append to the rightmost leaf
+
+    // The core YCSB workloads: A update heavy, B read mostly, C read only, D read latest, E short ranges,
+    // F read-modify-write. Anything else gives A.
+    static WorkloadSpec ycsb(char workload) {
+        WorkloadSpec spec;
+        switch (toupper(workload)) {
+        case 'B':
+            spec.read = 95;
+            spec.update = 5;
+            break;
+        case 'C':
+            spec.read = 100;
+            spec.update = 0;
+            break;
+        case 'D':
+            spec.read = 95;
+            spec.update = 0;
+            spec.insert = 5;
+            spec.distribution = KeyDistribution::Latest;
+            break;
+        case 'E':
+            spec.read = 0;
+            spec.update = 0;
+            spec.scan = 95;
+            spec.insert = 5;
+            break;
+        case 'F':
+            spec.update = 0;
+            spec.read_modify_write = 50;
+            break;
+        }
+        return spec;
+    }
+};
+
+inline bool parse_distribution(const string& name, KeyDistribution& out) {
+    if (name == "uniform")
+        out = KeyDistribution::Uniform;
+    else if (name == "zipfian")
+        out = KeyDistribution::Zipfian;
+    else if (name == "latest")
+        out = KeyDistribution::Latest;
+    else if (name == "hotspot")
+        out = KeyDistribution::Hotspot;
+    else
+        return false;
+    return true;
+}
+
+// Ranks 0..n-1 with rank 0 the most popular, after Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases", as YCSB does it. n can grow between draws; the zeta sum is then extended rather than recomputed.
+class ZipfianGenerator {
+private:
+    double theta;
+    double alpha;
+    double zeta2;
+    double zetan = 0;
+    double eta = 0;
+    long items = 0;
+
+    void grow(long n) {
+        for (long i = items + 1; i <= n; i++)
+            zetan += 1.0 / pow((double) i, theta);
+        items = n;
+        eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+public:
+    ZipfianGenerator(double theta) : theta(min(max(theta, 0.01), 0.9999)) {
+        alpha = 1.0 / (1 - this->theta);
+        zeta2 = 1 + 1.0 / pow(2.0, this->theta);
+    }
+
+    long next(long n, mt19937_64& gen) {
+        if (n <= 1)
+            return 0;
+        if (n != items) {
+            if (n < items) {
+                zetan = 0;
+                items = 0;
+            }
+            grow(n);
+        }
+        double u = uniform_real_distribution<double>(0, 1)(gen);
+        double uz = u * zetan;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + pow(0.5, theta))
+            return 1;
+        return min(n - 1, (long) (n * pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+struct WorkloadRequest
+{
+    WorkloadOp op;
+    int key;
+    int scan_length; // Only for Scan
+};
+
+// Shared by all threads of a run: the spec and the number of records inserted so far
+class WorkloadGenerator {
+private:
+    WorkloadSpec spec;
+    atomic<long> records{0};
+
+public:
+    WorkloadGenerator(const WorkloadSpec& spec) : spec(spec) {}
+
+    const WorkloadSpec& get_spec() const {
+        return spec;
+    }
+
+    // Multiplying by an odd constant is a bijection modulo 2^31, so distinct records get distinct keys
+    int key_of(long record) const {
+        if (spec.ordered_keys)
+            return (int) record;
+        return (int) (((uint64_t) record * 2654435761u) & 0x7fffffff);
+    }
+
+    // Claims the next record number for an insert
+    long next_record() {
+        return records.fetch_add(1);
+    }
+
+    long record_count() const {
+        return records.load();
+    }
+};
+
+// One thread's view of a workload, with its own random state
+class WorkloadStream {
+private:
+    WorkloadGenerator& generator;
+    mt19937_64 gen;
+    ZipfianGenerator zipf;
+    int total;
+
+    long pick_record(long n) {
+        const WorkloadSpec& spec = generator.get_spec();
+        switch (spec.distribution) {
+        case KeyDistribution::Zipfian:
+            return zipf.next(n, gen);
+        case KeyDistribution::Latest:
+            return n - 1 - zipf.next(n, gen);
+        case KeyDistribution::Hotspot: {
+            long hot = max(1l, (long) (n * spec.hotspot_fraction));
+            if (hot >= n || uniform_real_distribution<double>(0, 1)(gen) < spec.hotspot_ops)
+                return uniform_int_distribution<long>(0, hot - 1)(gen);
+            return uniform_int_distribution<long>(hot, n - 1)(gen);
+        }
+        default:
+            return uniform_int_distribution<long>(0, n - 1)(gen);
+        }
+    }
+
+public:
+    WorkloadStream(WorkloadGenerator& generator, uint64_t seed) : generator(generator), gen(seed), zipf(generator.get_spec().zipf_theta) {
+        const WorkloadSpec& spec = generator.get_spec();
+        total = spec.read + spec.update + spec.insert + spec.scan + spec.read_modify_write;
+    }
+
+    WorkloadRequest next() {
+        const WorkloadSpec& spec = generator.get_spec();
+        WorkloadRequest request;
+        request.scan_length = 0;
+
+        int roll = total > 0 ? (int) (gen() % (uint64_t) total) : 0;
+        if ((roll -= spec.read) < 0)
+            request.op = WorkloadOp::Read;
+        else if ((roll -= spec.update) < 0)
+            request.op = WorkloadOp::Update;
+        else if ((roll -= spec.insert) < 0)
+            request.op = WorkloadOp::Insert;
+        else if ((roll -= spec.scan) < 0)
+            request.op = WorkloadOp::Scan;
+        else
+            request.op = WorkloadOp::ReadModifyWrite;
+
+        long n = generator.record_count();
+        if (request.op == WorkloadOp::Insert || n == 0) {
+            request.op = WorkloadOp::Insert;
+            request.key = generator.key_of(generator.next_record());
+            return request;
+        }
+        request.key = generator.key_of(pick_record(n));
+        if (request.op == WorkloadOp::Scan)
+            request.scan_length = uniform_int_distribution<int>(1, max(1, spec.max_scan_length))(gen);
+        return request;
+    }
+};
@@ -1,10 +1,21 @@
+#pragma once
 #include <iostream>
 #include <functional>
 #include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include <new>
+#include "bpa_memory.cpp"
 
 using namespace std;
 
-const int e_size = sizeof(int);
+// Compiles statement in only when built with BPTREE_STATS, for the event counters of BPA and BPTree
+#ifdef BPTREE_STATS
+#define BPTREE_STAT(statement) statement
+#else
+#define BPTREE_STAT(statement)
+#endif
 
 // Structure for the key-value pair for the BPA
 template <typename KeyType, typename ValueType>
@@ -45,6 +56,37 @@ struct ElementBPA
     } 
 };
 
+// Count, sum, min and max of a set of values. Sums of integers are widened so that large ranges do not overflow.
+template <typename ValueType>
+struct RangeAggregate
+{
+    typedef typename conditional<is_integral<ValueType>::value, long long, ValueType>::type SumType;
+
+    uint64_t count = 0;
+    SumType sum = SumType();
+    ValueType min = ValueType();
+    ValueType max = ValueType();
+
+    void add(const ValueType& value) {
+        if (count == 0 || value < min)
+            min = value;
+        if (count == 0 || max < value)
+            max = value;
+        sum += value;
+        count++;
+    }
+
+    void merge(const RangeAggregate<ValueType>& other) {
+        if (other.count == 0)
+            return;
+        if (count == 0 || other.min < min)
+            min = other.min;
+        if (count == 0 || max < other.max)
+            max = other.max;
+        sum += other.sum;
+        count += other.count;
+    }
+};
 
 template <typename KeyType, typename ValueType>
 class BPA {
@@ -52,6 +94,60 @@ private:
     ElementBPA<KeyType, ValueType>* bpa_array;  // Actual array containing key values.
     ElementBPA<KeyType, ValueType>* temp_array; // Array used for redistributing the elements
     int* count_per_block;
+    bool owns_array = true; // False if bpa_array was handed in by the caller
+    MemoryPolicy* memory = nullptr; // Source of bpa_array and temp_array, new[] if null
+    RangeAggregate<ValueType>* block_summary; // Aggregate of header i plus block i, the log is never included
+
+    // Recomputes the summary of block b after its values changed
+    void summarize_block (int b) {
+        if constexpr (is_arithmetic<ValueType>::value) {
+            block_summary[b] = RangeAggregate<ValueType>();
+            if (header_ptr[b].isNull)
+                return;
+            block_summary[b].add(header_ptr[b].value);
+            ElementBPA<KeyType, ValueType>* block = getBlock(b);
+            for (int i = 0; i < block_size; i++) {
+                if (!block[i].isNull)
+                    block_summary[b].add(block[i].value);
+            }
+        }
+    }
+
+    int array_length () const {
+        return log_size + num_blocks + (num_blocks * block_size);
+    }
+
+    ElementBPA<KeyType, ValueType>* new_elements (int n) {
+        if (memory == nullptr)
+            return new ElementBPA<KeyType, ValueType>[n];
+        ElementBPA<KeyType, ValueType>* elts = (ElementBPA<KeyType, ValueType>*) memory->allocate(n * sizeof(ElementBPA<KeyType, ValueType>));
+        for (int i = 0; i < n; i++)
+            new (elts + i) ElementBPA<KeyType, ValueType>();
+        return elts;
+    }
+
+    void delete_elements (ElementBPA<KeyType, ValueType>* elts, int n) {
+        if (memory == nullptr) {
+            delete[] elts;
+            return;
+        }
+        if (elts == nullptr)
+            return;
+        if constexpr (!is_trivially_destructible<ElementBPA<KeyType, ValueType>>::value) {
+            for (int i = 0; i < n; i++)
+                elts[i].~ElementBPA<KeyType, ValueType>();
+        }
+        memory->deallocate(elts, n * sizeof(ElementBPA<KeyType, ValueType>));
+    }
+
+    // True if key sits in the log, which shadows any older copy in a block
+    bool in_log (const KeyType& key) {
+        for (int i = 0; i < log_size; i++) {
+            if (!log_ptr[i].isNull && log_ptr[i].key == key)
+                return true;
+        }
+        return false;
+    }
 
     
 
@@ -71,24 +167,99 @@ public:
     BPA* prev = nullptr;  //Pointer to the child BPA to the left
     BPA* next = nullptr;  //Pointer to the child BPA to the right
 
-    BPA (int log_size, int num_blocks, int block_size, ElementBPA<KeyType, ValueType>* bpa = NULL ) {
+    int redistributions = 0; // Number of full redistributions so far, lets the owner notice one happened
+
+    // Only counted with BPTREE_STATS. Written under the owner's lock like everything else, so they need no atomics.
+    uint64_t log_flushes = 0;
+    uint64_t overflow_redistributions = 0; // Flushes that found a block short of room and redistributed instead
+
+    // Element arrays come from memory if one is given, the caller keeps it alive for as long as the BPA
+    BPA (int log_size, int num_blocks, int block_size, ElementBPA<KeyType, ValueType>* bpa = NULL, MemoryPolicy* memory = nullptr) : memory(memory) {
+        allocate(log_size, num_blocks, block_size, bpa);
+    }
+
+    ~BPA () {
+        release();
+    }
+
+    // Owns its arrays, so it is never copied
+    BPA (const BPA&) = delete;
+    BPA& operator= (const BPA&) = delete;
+
+    // Sets up empty arrays for the given geometry, in bpa if one is passed in
+    void allocate (int log_size, int num_blocks, int block_size, ElementBPA<KeyType, ValueType>* bpa = NULL) {
         this->log_size = log_size;
         this->num_blocks = num_blocks;
         this->block_size = block_size;
 
+        owns_array = (bpa == NULL);
         if (bpa)
             bpa_array = bpa;
         else 
-            bpa_array = new ElementBPA<KeyType, ValueType>[log_size + num_blocks + (num_blocks * block_size)];
+            bpa_array = new_elements(array_length());
 
-        temp_array = new ElementBPA<KeyType, ValueType>[log_size + num_blocks + (num_blocks * block_size)];
+        temp_array = new_elements(array_length());
         log_ptr = bpa_array;
         header_ptr = log_ptr + log_size;
-        blocks_ptr = header_ptr + block_size;
+        blocks_ptr = header_ptr + num_blocks;
         total_size = num_blocks + (num_blocks * block_size);
 
         sorted_blocks = new bool[num_blocks];
+        fill(sorted_blocks, sorted_blocks + num_blocks, true); // Empty blocks are trivially sorted
         count_per_block = new int[num_blocks]();
+        block_summary = new RangeAggregate<ValueType>[num_blocks]();
+    }
+
+    // Moves the contents into arrays of a different geometry, sorted and evenly spread. Returns false, leaving
+    // the BPA as it was, if they would not fit.
+    bool reshape (int new_log_size, int new_num_blocks, int new_block_size) {
+        if (new_log_size == log_size && new_num_blocks == num_blocks && new_block_size == block_size)
+            return true;
+
+        vector<ElementBPA<KeyType, ValueType>> elts;
+        collect_sorted(elts);
+        if ((int) elts.size() > new_num_blocks + new_num_blocks * new_block_size)
+            return false;
+
+        reset(new_log_size, new_num_blocks, new_block_size);
+        return load_sorted(elts.data(), elts.size());
+    }
+
+    // Drops the contents and starts over, empty, with a new geometry
+    void reset (int new_log_size, int new_num_blocks, int new_block_size) {
+        if (owns_array)
+            delete_elements(bpa_array, array_length());
+        delete_elements(temp_array, array_length());
+        delete[] sorted_blocks;
+        delete[] count_per_block;
+        delete[] block_summary;
+
+        allocate(new_log_size, new_num_blocks, new_block_size);
+    }
+
+    // Bytes held by the arrays, log and redistribution buffer included. 0 once released.
+    size_t allocated_bytes () const {
+        if (temp_array == nullptr)
+            return 0;
+        size_t elements = (owns_array ? 2 : 1) * (size_t) array_length() * sizeof(ElementBPA<KeyType, ValueType>);
+        return elements + num_blocks * (sizeof(bool) + sizeof(int) + sizeof(RangeAggregate<ValueType>));
+    }
+
+    // Frees the arrays but keeps the geometry, for an owner that holds the contents elsewhere for a while.
+    // Nothing but reset may be called until then.
+    void release () {
+        if (owns_array)
+            delete_elements(bpa_array, array_length());
+        delete_elements(temp_array, array_length());
+        delete[] sorted_blocks;
+        delete[] count_per_block;
+        delete[] block_summary;
+
+        bpa_array = temp_array = log_ptr = header_ptr = blocks_ptr = nullptr;
+        sorted_blocks = nullptr;
+        count_per_block = nullptr;
+        block_summary = nullptr;
+        owns_array = true;
     }
 
     //Helper function to facilitate BPA splitting
@@ -99,135 +270,182 @@ public:
     // Inserts the key value pair, returns false if theres not enough space and the BPA needs to be split
     bool insert (KeyType ekey, ValueType eval) {
         // First check through elements in log and replace the element if they have the same key, else append it to log
+        bool placed = false;
         for(int i = 0; i < log_size; i++){
             if(bpa_array[i].isNull || bpa_array[i].key == ekey){
                 bpa_array[i].isNull = false;
                 bpa_array[i].key = ekey;
                 bpa_array[i].value = eval;
+                placed = true;
                 break;
             }
         }
-        
+
+        // Log was left full by a flush that ran out of space, try to make room once more
+        if (!placed)
+            return flush_log() && insert(ekey, eval);
+
+        sorted_log = false;
+
         //If theres still a space left in the log, can return successfully. Case 1.
-        if(bpa_array[log_size-1].isNull) {
-            sorted_log = false;
+        if(bpa_array[log_size-1].isNull)
             return true;
-        }
 
-        //If the BPA is new (theres no elements in the header) and the log is full, then move min(log size, header size) elements to the header and sort them, then return
-        int numToMove = min(log_size, num_blocks);
-        if (header_ptr->isNull){
-            for(int i = 0; i < numToMove; i++){
-                swap(log_ptr[log_size-1-i], header_ptr[i]);
-            }
-            sort(header_ptr, header_ptr+numToMove);
-            sorted_log = true;
-            return true;
-        }
+        return flush_log();
+    }
+
+    // Pushes every buffered insert out of the log into its block. Block i takes the keys from header i up to
+    // header i+1, and a key below header 0 takes over as header 0. If some block lacks the room, the whole BPA is
+    // redistributed instead. Returns false if the elements no longer fit and the BPA needs to be split.
+    bool flush_log () {
+        BPTREE_STAT(log_flushes++);
 
-        //If at this point then the log is full and there are some headers (not necessarily all)]
-        int new_destined_per_block[block_size] = {};
-        int destination_block[log_size] = {};          //Used to remember which block each element in the log should go for later use
-        new_destined_per_block[block_size-1] = log_size;
+        //If the BPA is new (theres no elements in the header) the log simply gets spread out over the blocks
+        if (header_ptr->isNull)
+            return redistribute();
+
+        int last_used = 0;
+        while (last_used + 1 < num_blocks && !header_ptr[last_used + 1].isNull)
+            last_used++;
+
+        vector<int> destined_per_block(num_blocks, 0);
+        vector<int> destination_block(log_size, -1);          //Used to remember which block each element in the log should go for later use
         //Count how many elements in log will be inserted into each block and check for overflow
         for (int i = 0; i < log_size; i++){
-            destination_block[i] = block_size-1;
+            if (log_ptr[i].isNull)
+                continue;
             //Iterate through the header until target block found
-            for(int j = 0; j < num_blocks; j++){
-                // A header might be null, indicating to look through the last used header.
-                if (log_ptr[i].key < header_ptr[j].key || header_ptr[j].isNull){
-                    //cout << "Element " << i << " belongs in block " << j-1 << endl;
-                    new_destined_per_block[j-1] += 1;
-                    new_destined_per_block[block_size-1] -= 1;
-                    destination_block[i] = j-1;
-                    break;
-                }
-            }
+            int dest = 0;
+            while (dest < last_used && !(log_ptr[i].key < header_ptr[dest + 1].key))
+                dest++;
+            destination_block[i] = dest;
+            destined_per_block[dest] += 1;
         }
 
-        //cout << "count " << new_destined_per_block[block_size-1] << endl;
-
         //Check if theres enough space in the blocks for all the target insertions
-        bool enough_space = true;
         for (int i = 0; i < num_blocks; i++){
-            if (count_per_block[i] + new_destined_per_block[i] >= block_size){
-                enough_space = false;
-                break;
+            if (count_per_block[i] + destined_per_block[i] > block_size) {
+                BPTREE_STAT(overflow_redistributions++);
+                return redistribute();
             }
         }
 
-        if (enough_space){
-            for (int i = 0; i < log_size; i++){
-                //If the subject block header has the same key, replace the value and clear the corresponding element in log
-                if (!header_ptr[destination_block[i]].isNull && header_ptr[destination_block[i]].key == log_ptr[i].key){
-                    header_ptr[destination_block[i]].value = log_ptr[i].value;
-                    log_ptr[i].isNull = true;
-                    continue;
-                }
-                //Otherwise iterate through destination blocks contents, replacing an element with the corresponding key
-                // or copying into the first null element. Unset the sorted bit when appending and not replacing.
-                ElementBPA<KeyType, ValueType>* subject_block = getBlock(destination_block[i]);
-                for (int j = 0; j < block_size; j++){
-                    if (subject_block[j].isNull){
-                        subject_block[j].isNull = false;
-                        subject_block[j].key = log_ptr[i].key;
-                        subject_block[j].value = log_ptr[i].value;
-                        log_ptr[i].isNull = true;
-                        count_per_block[destination_block[i]] += 1;
-                        sorted_blocks[destination_block[i]] = false;
-                        break;
-                    } else if (subject_block[j].key == log_ptr[i].key){
-                        subject_block[j].value = log_ptr[i].value;
-                        log_ptr[i].isNull = true;
-                        break;
-                    }
+        for (int i = 0; i < log_size; i++){
+            if (log_ptr[i].isNull)
+                continue;
+            int dest = destination_block[i];
+            ElementBPA<KeyType, ValueType> moving = log_ptr[i];
+            log_ptr[i].isNull = true;
+
+            //If the subject block header has the same key, replace the value
+            if (header_ptr[dest].key == moving.key){
+                header_ptr[dest].value = moving.value;
+                continue;
+            }
+            //A new minimum becomes the header and the old header moves down into the block
+            if (moving.key < header_ptr[dest].key)
+                swap(moving, header_ptr[dest]);
+
+            //Otherwise iterate through destination blocks contents, replacing an element with the corresponding key
+            // or copying into the first null element. Unset the sorted bit when appending and not replacing.
+            ElementBPA<KeyType, ValueType>* subject_block = getBlock(dest);
+            for (int j = 0; j < block_size; j++){
+                if (subject_block[j].isNull){
+                    subject_block[j] = moving;
+                    count_per_block[dest] += 1;
+                    sorted_blocks[dest] = false;
+                    break;
+                } else if (subject_block[j].key == moving.key){
+                    subject_block[j].value = moving.value;
+                    break;
                 }
             }
         }
 
+        for (int i = 0; i < num_blocks; i++) {
+            if (destined_per_block[i] > 0)
+                summarize_block(i);
+        }
+        sorted_log = true;
+        return true;
+    }
 
-        //If not enough space in one or more blocks, it is necessary to completely redistribute the BPA and select new headers.
-        //TODO: Implement hashmap to discard elements with duplicate keys
-        if (!enough_space){
-            int count = 0;
-            for(int i = 0; i < total_size; i++){
-                if (!bpa_array[i].isNull)
-                    count++;
+    // Sorts every element, log included, through temp_array and spreads them evenly over the blocks again, with
+    // new headers. Keys present both in the log and in a block keep only the newer log copy.
+    bool redistribute () {
+        redistributions++;
+        int count = 0;
+        for (int i = 0; i < log_size + total_size; i++) {
+            if (!bpa_array[i].isNull)
+                temp_array[count++] = bpa_array[i];
+        }
 
-                temp_array[i] = bpa_array[i];
-                bpa_array[i].isNull = true;
-            }
+        // The log sits first in bpa_array, so a stable sort keeps its copy of a key in front
+        stable_sort(temp_array, temp_array + count, [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key < b.key;
+        });
+        count = unique(temp_array, temp_array + count, [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key == b.key;
+        }) - temp_array;
 
-            sort(temp_array, temp_array + total_size);
-            int new_count_per_block = count / block_size;
-            int remains = count % block_size;
+        return load_sorted(temp_array, count);
+    }
 
-            //Copy the modified array back into the correct positions
-            for(int i = 0; i < new_count_per_block * num_blocks; i += new_count_per_block){
-                int blocknum = i / new_count_per_block;
-                header_ptr[blocknum] = temp_array[i];   //Set header of this new copied over block
+    // Number of buffered inserts currently sitting in the log
+    int log_fill () {
+        int used = 0;
+        for (int i = 0; i < log_size; i++) {
+            if (!log_ptr[i].isNull)
+                used++;
+        }
+        return used;
+    }
 
-                //Then copy over the actual elements that belong in the new block
-                ElementBPA<KeyType, ValueType>* newBlockStart = getBlock(blocknum);
-                for(int j = 1; j < new_count_per_block; j++){
-                    newBlockStart[j-1] = temp_array[i+j];
-                }
-            }
+    // True if neither the log nor any block needs sorting before an ordered scan
+    bool is_sorted () {
+        if (!sorted_log)
+            return false;
+        for (int i = 0; i < num_blocks; i++) {
+            if (!sorted_blocks[i])
+                return false;
         }
+        return true;
+    }
 
+    // Sorts the log and every unsorted block up front, so that later scans can run under a shared lock.
+    // Returns the number of blocks it had to sort.
+    int sort_blocks () {
+        if (!sorted_log) {
+            sort(log_ptr, log_ptr + log_size);
+            sorted_log = true;
+        }
 
-        return false;
+        int sorted = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            if (!sorted_blocks[i]) {
+                sort(getBlock(i), getBlock(i) + block_size);
+                sorted_blocks[i] = true;
+                sorted++;
+            }
+        }
+        return sorted;
     }
 
 
     //Finds and returns a pointer to the first value found with the matching key
     ValueType* find (KeyType element) {
+        ElementBPA<KeyType, ValueType>* found = find_element(element);
+        return (found != nullptr) ? &found->value : nullptr;
+    }
+
+    // The live element holding key, so that an owner can reuse the copy of the key it already stores
+    ElementBPA<KeyType, ValueType>* find_element (KeyType element) {
         //First iterate through log and return if found
         for(int i = 0; i < log_size; i++){
             if(bpa_array[i].isNull)
                 break;
             if (element == bpa_array[i].key)
-                return &bpa_array[i].value;
+                return &bpa_array[i];
         }
         
         int foundBlock = num_blocks-1;
@@ -239,7 +457,7 @@ public:
                 break;
             }
             if (element == header_ptr[i].key){
-                return &header_ptr[i].value;
+                return &header_ptr[i];
             }
         }
 
@@ -254,7 +472,7 @@ public:
                 return nullptr;
             }
             if (blockptr[i].key == element){
-                return &blockptr[i].value;
+                return &blockptr[i];
             }
         }
 
@@ -262,7 +480,7 @@ public:
     }
 
     // sort function recommended std::sort(bpa_array, bpa_array+4) for example to sort only the first 4 elements quickly
-    int iterate_range (int start, int length, function<ValueType(KeyType)> f) {
+    int iterate_range (KeyType start, int length, function<ValueType(KeyType)> f) {
         if (! sorted_log) {
             // Sort the log for iteration
             sort(log_ptr, log_ptr + log_size);
@@ -280,6 +498,7 @@ public:
         }
 
         ElementBPA<KeyType, ValueType> *block_ptr = getBlock(found_block);
+        int first_block = found_block;
 
         int log_spot = 0;
         int block_spot = 0;
@@ -290,22 +509,24 @@ public:
         }
 
         int iters = 0;
-        bool keep_block_iter = true;
-        ElementBPA<KeyType, ValueType> block_space;
+        bool keep_block_iter = ! header_ptr[found_block].isNull; // An empty BPA has nothing outside the log
+        ElementBPA<KeyType, ValueType>* block_space;
 
         // Do *length* iterations of the function onto the monotonically increasing elements in the BPA
         while (iters < length) {
-            block_space = (block_spot == 0) ?  header_ptr[found_block] : block_ptr[block_spot-1];
+            block_space = (block_spot == 0) ?  &header_ptr[found_block] : &block_ptr[block_spot-1];
             // Check if the item in the log is smaller than the one in the block & the start val, then perform function if so
-            if (log_spot < log_size && ! log_ptr[log_spot].isNull && (! keep_block_iter || log_ptr[log_spot].key < block_space.key)) {
+            if (log_spot < log_size && ! log_ptr[log_spot].isNull && (! keep_block_iter || ! (block_space->key < log_ptr[log_spot].key))) {
                 if (log_ptr[log_spot].key >= start) {
                     log_ptr[log_spot].value = f(log_ptr[log_spot].key);
                     iters++;
                 }
                 log_spot++;
             } else if (keep_block_iter) {
-                if (block_space.key >= start) {
-                    block_space.value = f(block_space.key);
+                // A key still in the log shadows its older copy in the block, which was visited with the log
+                bool shadowed = log_spot > 0 && log_ptr[log_spot-1].key == block_space->key;
+                if (block_space->key >= start && ! shadowed) {
+                    block_space->value = f(block_space->key);
                     iters++;
                 }
                 block_spot++;
@@ -315,14 +536,14 @@ public:
                     found_block++;
                     
                     // Final block in the BPA, can't continue iterating here!
-                    if (found_block >= num_blocks) {
+                    if (found_block >= num_blocks || header_ptr[found_block].isNull) {
                         keep_block_iter = false;
                         continue;
                     }
 
                     block_ptr = getBlock(found_block);
                     if (! sorted_blocks[found_block]) {
-                        sort(blocks_ptr, blocks_ptr + block_size);
+                        sort(block_ptr, block_ptr + block_size);
                         sorted_blocks[found_block] = true;
                     }
                     block_spot = 0;
@@ -332,60 +553,223 @@ public:
                 break;
         }
 
+        for (int i = first_block; i <= found_block && i < num_blocks; i++)
+            summarize_block(i);
         return iters;
 
     }
 
-    int map_range (int start, int length, function<ValueType(KeyType)> f) {
-        for (int i = 0; i < log_size; i++) {
-            if (log_ptr[i].key >= start && log_ptr[i].key < start + length)
-                log_ptr[i].value = f(log_ptr[i].key);
+    // Applies f to every element with a key in [start, start + length), returns how many it touched
+    int map_range (KeyType start, int length, function<ValueType(KeyType)> f) {
+        return map_between(start, start + length, f);
+    }
+
+    // Applies f to every live element with a key in [low, high), wherever it sits, and returns how many it
+    // touched. An older copy of a key still in the log is left alone, as aggregate_between skips it, so f runs
+    // once per key. Needs no sorted blocks, so a caller holding the leaf lock never has to reorganise it.
+    int map_between (KeyType low, KeyType high, function<ValueType(KeyType)> f) {
+        int touched = 0;
+        bool log_empty = log_fill() == 0;
+        for (int i = 0; i < log_size + total_size; i++) {
+            ElementBPA<KeyType, ValueType>& elt = bpa_array[i];
+            if (elt.isNull || elt.key < low || !(elt.key < high))
+                continue;
+            if (i >= log_size && !log_empty && in_log(elt.key))
+                continue;
+            elt.value = f(elt.key);
+            touched++;
         }
+        for (int i = 0; touched > 0 && i < num_blocks; i++)
+            summarize_block(i);
+        return touched;
+    }
 
-        int found_block = num_blocks - 1;
+    // Aggregate over every value in the BPA. Built from the block summaries alone while the log is empty.
+    RangeAggregate<ValueType> summary () {
+        if (log_fill() > 0)
+            return aggregate_between(nullptr, nullptr);
 
-        // We find the first block that contains the starting range
-        for (int i = 1; i < num_blocks; i++) {
-            if (start < header_ptr[i].key || header_ptr[i].isNull) {
-                found_block = i-1;
-                break;
+        RangeAggregate<ValueType> result;
+        for (int i = 0; i < num_blocks; i++)
+            result.merge(block_summary[i]);
+        return result;
+    }
+
+    // Aggregate over the values with a key in [*low, *high), a null bound leaves that side open
+    RangeAggregate<ValueType> aggregate_between (const KeyType* low, const KeyType* high) {
+        RangeAggregate<ValueType> result;
+        bool log_empty = log_fill() == 0;
+        for (int i = 0; i < log_size + total_size; i++) {
+            const ElementBPA<KeyType, ValueType>& elt = bpa_array[i];
+            if (elt.isNull || (low != nullptr && elt.key < *low) || (high != nullptr && !(elt.key < *high)))
+                continue;
+            if (i >= log_size && !log_empty && in_log(elt.key))
+                continue;
+            result.add(elt.value);
+        }
+        return result;
+    }
+
+    // Smallest key held anywhere in the BPA, returns false if it is empty
+    bool min_key (KeyType& out) {
+        bool found = false;
+        for (int i = 0; i < log_size; i++) {
+            if (!log_ptr[i].isNull && (!found || log_ptr[i].key < out)) {
+                out = log_ptr[i].key;
+                found = true;
             }
         }
+        if (!header_ptr[0].isNull && (!found || header_ptr[0].key < out)) {
+            out = header_ptr[0].key;
+            found = true;
+        }
+        return found;
+    }
 
-        // Sort the block if not already sorted
-        if (! sorted_blocks[found_block]) {
-            sort(blocks_ptr, blocks_ptr + block_size);
-            sorted_blocks[found_block] = true;
+    // Appends every live element to out in ascending key order. The log holds the newest copy of a key,
+    // so it shadows any older copy still sitting in the header or the blocks.
+    void collect_sorted (vector<ElementBPA<KeyType, ValueType>>& out) {
+        size_t first = out.size();
+        for (int i = 0; i < log_size; i++) {
+            if (!log_ptr[i].isNull)
+                out.push_back(log_ptr[i]);
+        }
+        for (int i = 0; i < num_blocks; i++) {
+            if (header_ptr[i].isNull)
+                continue;
+            out.push_back(header_ptr[i]);
+
+            ElementBPA<KeyType, ValueType>* block_ptr = getBlock(i);
+            for (int j = 0; j < block_size; j++) {
+                if (!block_ptr[j].isNull)
+                    out.push_back(block_ptr[j]);
+            }
         }
 
-        ElementBPA<KeyType, ValueType> *block_ptr = getBlock(found_block);
-        ElementBPA<KeyType, ValueType> block_space = header_ptr[found_block];
-        int block_iterator = 0;
-        int iters = 0;
+        // Stable so that the log copy stays in front of any duplicate and survives the unique pass
+        stable_sort(out.begin() + first, out.end(), [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key < b.key;
+        });
+        out.erase(unique(out.begin() + first, out.end(), [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key == b.key;
+        }), out.end());
+    }
 
-        while (block_space.key < start + length) {
-            if (block_space.key >= start) {
-                block_space.value = f(block_space.key);
-                iters++;
+    // Writes up to limit live elements with a key of at least start to keys and values, in ascending key order,
+    // and returns how many it wrote. A sorted block is copied out as one run wherever no log entry falls inside
+    // it; the log is merged in element by element only where it does. Nothing in the BPA is written, so a shared
+    // lock is enough: a log or block that is not sorted yet is sorted in scratch instead of in place.
+    int copy_from (const KeyType& start, int limit, KeyType* keys, ValueType* values, vector<ElementBPA<KeyType, ValueType>>& scratch) {
+        auto by_key = [](const ElementBPA<KeyType, ValueType>& a, const ElementBPA<KeyType, ValueType>& b) {
+            return a.key < b.key;
+        };
+
+        // The log entries in range go first in scratch, in key order; blocks that need sorting go after them
+        scratch.clear();
+        for (int i = 0; i < log_size; i++) {
+            if (!log_ptr[i].isNull && !(log_ptr[i].key < start))
+                scratch.push_back(log_ptr[i]);
+        }
+        if (!sorted_log)
+            sort(scratch.begin(), scratch.end(), by_key);
+        size_t log_end = scratch.size();
+        size_t log_pos = 0;
+        int written = 0;
+
+        auto emit = [&](const ElementBPA<KeyType, ValueType>& elt) {
+            keys[written] = elt.key;
+            values[written] = elt.value;
+            written++;
+        };
+
+        // Copies the part of a sorted run from start on, taking the log entries that fall inside it in order. The
+        // log copy of a key is the newer one and replaces the run's.
+        auto merge_run = [&](const ElementBPA<KeyType, ValueType>* run, int len) {
+            int i = lower_bound(run, run + len, start, [](const ElementBPA<KeyType, ValueType>& elt, const KeyType& key) {
+                return elt.key < key;
+            }) - run;
+            while (i < len && written < limit) {
+                if (log_pos == log_end || run[len-1].key < scratch[log_pos].key) {
+                    int take = min(len - i, limit - written);
+                    for (int j = 0; j < take; j++) {
+                        keys[written + j] = run[i + j].key;
+                        values[written + j] = run[i + j].value;
+                    }
+                    written += take;
+                    return;
+                }
+                if (run[i].key < scratch[log_pos].key) {
+                    emit(run[i++]);
+                } else {
+                    if (run[i].key == scratch[log_pos].key)
+                        i++;
+                    emit(scratch[log_pos++]);
+                }
+            }
+        };
+
+        // Same search for the first block as iterate_range
+        int b = 0;
+        while (b + 1 < num_blocks && !header_ptr[b+1].isNull && !(start < header_ptr[b+1].key))
+            b++;
+        for (; b < num_blocks && !header_ptr[b].isNull && written < limit; b++) {
+            merge_run(&header_ptr[b], 1);
+
+            ElementBPA<KeyType, ValueType>* block_ptr = getBlock(b);
+            if (sorted_blocks[b]) {
+                int len = 0;
+                while (len < block_size && !block_ptr[len].isNull)
+                    len++;
+                merge_run(block_ptr, len);
+            } else {
+                scratch.resize(log_end);
+                for (int j = 0; j < block_size; j++) {
+                    if (!block_ptr[j].isNull)
+                        scratch.push_back(block_ptr[j]);
+                }
+                sort(scratch.begin() + log_end, scratch.end(), by_key);
+                merge_run(scratch.data() + log_end, scratch.size() - log_end);
             }
+        }
 
-            block_space = block_ptr[block_iterator];
-            block_iterator++;
+        while (log_pos < log_end && written < limit)
+            emit(scratch[log_pos++]);
+        return written;
+    }
+
+    // Replaces the contents with n elements already in ascending key order, spread evenly over the blocks
+    // so that every block starts out sorted. Returns false if the elements do not fit.
+    bool load_sorted (const ElementBPA<KeyType, ValueType>* elts, int n) {
+        if (n > total_size)
+            return false;
 
-            if (block_iterator >= block_size) {
-                found_block++;
-                block_ptr = getBlock(found_block);
-                block_space = header_ptr[found_block];
-                block_iterator = 0;
+        for (int i = 0; i < log_size + total_size; i++)
+            bpa_array[i].isNull = true;
 
-                if (! sorted_blocks[found_block]) {
-                    sort(block_ptr, block_ptr + block_size);
-                    sorted_blocks[found_block] = true;
-                }
+        int pos = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            int take = n / num_blocks + (i < n % num_blocks ? 1 : 0);
+            count_per_block[i] = 0;
+            sorted_blocks[i] = true;
+            if (take == 0)
+                continue;
+
+            header_ptr[i] = elts[pos];
+            header_ptr[i].isNull = false;
+
+            ElementBPA<KeyType, ValueType>* block_ptr = getBlock(i);
+            for (int j = 1; j < take; j++) {
+                block_ptr[j-1] = elts[pos+j];
+                block_ptr[j-1].isNull = false;
             }
+            count_per_block[i] = take - 1;
+            pos += take;
         }
 
-        return iters;
+        for (int i = 0; i < num_blocks; i++)
+            summarize_block(i);
+        sorted_log = true;
+        return true;
     }
 
     // Small helper function, returns pointer to first element in block i
@@ -0,0 +1,227 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Where the element arrays of a BPA come from. A BPA without one uses new[].
+class MemoryPolicy {
+public:
+    virtual ~MemoryPolicy() = default;
+
+    // Returns bytes of memory aligned to at least 64 bytes, never null
+    virtual void* allocate(size_t bytes) = 0;
+
+    // Gives back memory from allocate, with the same size
+    virtual void deallocate(void* ptr, size_t bytes) = 0;
+
+    // Bytes taken from the system, freed arrays kept for reuse included, or 0 if the policy does not know
+    virtual size_t footprint() {
+        return 0;
+    }
+};
+
+struct PageSlabOptions
+{
+    bool huge_pages = true;          // Back regions with 2MB pages where the system allows it
+    int numa_node = -1;              // Bind regions to this node, -1 leaves placement to first touch
+    size_t region_bytes = 32 << 20;  // Size of each mapping that allocations are carved from
+};
+
+// What a PageSlab managed to get from the system
+struct PageSlabStats
+{
+    size_t bytes_mapped = 0;
+    size_t bytes_in_use = 0;
+    int hugetlb_regions = 0;   // Mapped from the reserved huge page pool
+    int thp_regions = 0;       // Ordinary mappings the kernel was asked to back with transparent huge pages
+    int plain_regions = 0;     // Neither worked, small pages
+    int numa_bound_regions = 0;
+};
+
+// Carves BPA arrays out of a few large 2MB aligned mappings instead of one heap allocation each, so that a
+// tree of millions of elements is covered by a few hundred TLB entries rather than tens of thousands. Each
+// region first tries MAP_HUGETLB, then madvise(MADV_HUGEPAGE), then settles for small pages; with a numa_node
+// set it is also bound there with mbind before anything touches it. Freed arrays go on a free list by size,
+// which suits BPAs since a tree's arrays come in very few sizes. Regions are only unmapped with the slab.
+// On systems other than Linux every region comes from the heap.
+class PageSlab: public MemoryPolicy {
+private:
+    static constexpr size_t huge_page = 2 << 20;
+    static constexpr size_t granule = 64;
+
+    struct Region
+    {
+        char* base;
+        size_t bytes;
+    };
+
+    PageSlabOptions options;
+    mutex slab_mutex;
+    vector<Region> regions;
+    unordered_map<size_t, vector<void*>> free_lists; // Rounded size -> freed blocks
+    char* cursor = nullptr;
+    size_t remaining = 0;
+    PageSlabStats stats;
+
+    static size_t round_up(size_t n, size_t to) {
+        return (n + to - 1) / to * to;
+    }
+
+    // Maps bytes (a multiple of huge_page) aligned to huge_page
+    Region map_region(size_t bytes) {
+#ifdef __linux__
+        void* addr = MAP_FAILED;
+        if (options.huge_pages) {
+            addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (addr != MAP_FAILED)
+                stats.hugetlb_regions++;
+        }
+        if (addr == MAP_FAILED) {
+            // Over-map and trim, so that the region starts on a huge page boundary
+            char* raw = (char*) mmap(nullptr, bytes + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == (char*) MAP_FAILED)
+                throw bad_alloc();
+            char* aligned = (char*) round_up((uintptr_t) raw, huge_page);
+            if (aligned > raw)
+                munmap(raw, aligned - raw);
+            munmap(aligned + bytes, raw + huge_page - aligned);
+            addr = aligned;
+
+            if (options.huge_pages && madvise(addr, bytes, MADV_HUGEPAGE) == 0)
+                stats.thp_regions++;
+            else
+                stats.plain_regions++;
+        }
+
+        if (options.numa_node >= 0 && options.numa_node < 64) {
+            const int mpol_preferred = 1; // Falls back to other nodes when this one is full, unlike MPOL_BIND
+            unsigned long mask = 1ul << options.numa_node;
+            if (syscall(SYS_mbind, addr, bytes, mpol_preferred, &mask, sizeof(mask) * 8, 0) == 0)
+                stats.numa_bound_regions++;
+        }
+        stats.bytes_mapped += bytes;
+        return {(char*) addr, bytes};
+#else
+        stats.plain_regions++;
+        stats.bytes_mapped += bytes;
+        return {(char*) ::operator new(bytes), bytes};
+#endif
+    }
+
+    void unmap_region(const Region& region) {
+#ifdef __linux__
+        munmap(region.base, region.bytes);
+#else
+        ::operator delete(region.base);
+#endif
+    }
+
+public:
+    PageSlab(PageSlabOptions opts = PageSlabOptions()) : options(opts) {
+        options.region_bytes = round_up(max(options.region_bytes, huge_page), huge_page);
+    }
+
+    PageSlab(const PageSlab&) = delete;
+    PageSlab& operator=(const PageSlab&) = delete;
+
+    ~PageSlab() {
+        for (const Region& region : regions)
+            unmap_region(region);
+    }
+
+    void* allocate(size_t bytes) override {
+        size_t size = round_up(max<size_t>(bytes, 1), granule);
+        lock_guard<mutex> guard(slab_mutex);
+        stats.bytes_in_use += size;
+
+        vector<void*>& reusable = free_lists[size];
+        if (!reusable.empty()) {
+            void* ptr = reusable.back();
+            reusable.pop_back();
+            return ptr;
+        }
+
+        // Arrays too large to share a region get one to themselves
+        if (size > options.region_bytes / 4) {
+            regions.push_back(map_region(round_up(size, huge_page)));
+            return regions.back().base;
+        }
+        if (size > remaining) {
+            regions.push_back(map_region(options.region_bytes));
+            cursor = regions.back().base;
+            remaining = options.region_bytes;
+        }
+        void* ptr = cursor;
+        cursor += size;
+        remaining -= size;
+        return ptr;
+    }
+
+    void deallocate(void* ptr, size_t bytes) override {
+        if (ptr == nullptr)
+            return;
+        size_t size = round_up(max<size_t>(bytes, 1), granule);
+        lock_guard<mutex> guard(slab_mutex);
+        stats.bytes_in_use -= size;
+        free_lists[size].push_back(ptr);
+    }
+
+    PageSlabStats get_stats() {
+        lock_guard<mutex> guard(slab_mutex);
+        return stats;
+    }
+
+    size_t footprint() override {
+        lock_guard<mutex> guard(slab_mutex);
+        return stats.bytes_mapped;
+    }
+};
+
+// Plain heap allocations with a running count of the bytes handed out, for measuring what a tree's BPAs cost
+class CountingMemory: public MemoryPolicy {
+private:
+    atomic<size_t> in_use{0};
+    atomic<size_t> peak{0};
+
+public:
+    void* allocate(size_t bytes) override {
+        void* ptr = ::operator new(max<size_t>(bytes, 1), align_val_t(64));
+        size_t now = in_use.fetch_add(bytes) + bytes;
+        size_t seen = peak.load();
+        while (now > seen && !peak.compare_exchange_weak(seen, now)) {}
+        return ptr;
+    }
+
+    void deallocate(void* ptr, size_t bytes) override {
+        if (ptr == nullptr)
+            return;
+        in_use.fetch_sub(bytes);
+        ::operator delete(ptr, align_val_t(64));
+    }
+
+    size_t bytes_in_use() const {
+        return in_use.load();
+    }
+
+    size_t peak_bytes() const {
+        return peak.load();
+    }
+
+    size_t footprint() override {
+        return in_use.load();
+    }
+};
@@ -0,0 +1,335 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "bpa.cpp"
+
+using namespace std;
+
+// Sorted run of integral keys stored as offsets from the first one, each 1, 2, 4 or 8 bytes wide depending on
+// the spread of the run. Dense or clustered 64 bit keys usually pack into 2 or 4 bytes apiece.
+// Searches compare against the narrow offsets directly; decode is a plain widening loop the compiler vectorizes.
+template <typename KeyType>
+class PackedKeyRun {
+private:
+    vector<uint64_t> storage; // Offsets, count * width bytes, 8 byte aligned
+    KeyType base = KeyType();
+    uint32_t count = 0;
+    uint8_t width = 0;
+
+    template <typename Narrow>
+    const Narrow* offsets() const {
+        return reinterpret_cast<const Narrow*>(storage.data());
+    }
+
+    template <typename Narrow>
+    void decode_as(KeyType* out, uint32_t from, uint32_t n) const {
+        typedef typename make_unsigned<KeyType>::type Unsigned;
+        const Narrow* in = offsets<Narrow>() + from;
+        Unsigned b = (Unsigned) base;
+        for (uint32_t i = 0; i < n; i++)
+            out[i] = (KeyType) (b + (Unsigned) in[i]);
+    }
+
+    // First position whose offset is above (or, if inclusive, at least) delta
+    template <typename Narrow>
+    uint32_t search_as(uint64_t delta, bool inclusive) const {
+        if (delta > (uint64_t) (Narrow) ~(Narrow) 0)
+            return count;
+        const Narrow* in = offsets<Narrow>();
+        Narrow d = (Narrow) delta;
+        return (inclusive ? lower_bound(in, in + count, d) : upper_bound(in, in + count, d)) - in;
+    }
+
+    uint32_t search(const KeyType& key, bool inclusive) const {
+        typedef typename make_unsigned<KeyType>::type Unsigned;
+        if (count == 0 || key < base)
+            return 0;
+        uint64_t delta = (uint64_t) ((Unsigned) key - (Unsigned) base);
+        switch (width) {
+        case 1: return search_as<uint8_t>(delta, inclusive);
+        case 2: return search_as<uint16_t>(delta, inclusive);
+        case 4: return search_as<uint32_t>(delta, inclusive);
+        default: return search_as<uint64_t>(delta, inclusive);
+        }
+    }
+
+public:
+    // Packs n keys in ascending order
+    void encode(const KeyType* keys, uint32_t n) {
+        static_assert(is_integral<KeyType>::value, "packed key runs hold integral keys");
+        typedef typename make_unsigned<KeyType>::type Unsigned;
+        count = n;
+        base = (n > 0) ? keys[0] : KeyType();
+        uint64_t spread = (n > 0) ? (uint64_t) ((Unsigned) keys[n-1] - (Unsigned) base) : 0;
+        width = (spread <= 0xff) ? 1 : (spread <= 0xffff) ? 2 : (spread <= 0xffffffffull) ? 4 : 8;
+
+        storage.assign(((size_t) n * width + 7) / 8, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t delta = (uint64_t) ((Unsigned) keys[i] - (Unsigned) base);
+            memcpy(reinterpret_cast<char*>(storage.data()) + (size_t) i * width, &delta, width); // Little endian
+        }
+    }
+
+    uint32_t size() const {
+        return count;
+    }
+
+    int key_width() const {
+        return width;
+    }
+
+    // Bytes taken by the packed offsets, base and header included
+    size_t bytes() const {
+        return storage.size() * sizeof(uint64_t) + sizeof(*this);
+    }
+
+    KeyType at(uint32_t i) const {
+        KeyType key;
+        decode(&key, i, 1);
+        return key;
+    }
+
+    // Writes keys from .. from + n - 1 to out
+    void decode(KeyType* out, uint32_t from, uint32_t n) const {
+        switch (width) {
+        case 1: decode_as<uint8_t>(out, from, n); break;
+        case 2: decode_as<uint16_t>(out, from, n); break;
+        case 4: decode_as<uint32_t>(out, from, n); break;
+        default: decode_as<uint64_t>(out, from, n); break;
+        }
+    }
+
+    // Position of the first key not below key
+    uint32_t lower_bound_of(const KeyType& key) const {
+        return search(key, true);
+    }
+
+    // Position of the first key above key, which is the child an internal node routes key to
+    uint32_t upper_bound_of(const KeyType& key) const {
+        return search(key, false);
+    }
+};
+
+// Read-only leaf format for integral keys: the sorted contents of a BPA cut into blocks of block_size entries,
+// each holding its keys as a PackedKeyRun based at the block's first key (the header), with the values kept
+// apart in one array. Lookups pick the block by its base key and search it without widening anything.
+template <typename KeyType, typename ValueType>
+class PackedLeaf {
+private:
+    vector<KeyType> bases;                // First key of each block
+    vector<PackedKeyRun<KeyType>> blocks;
+    vector<uint32_t> starts;              // Position of each block's first entry in values
+    vector<ValueType> values;
+
+    int block_of(const KeyType& key) const {
+        return (int) (upper_bound(bases.begin(), bases.end(), key) - bases.begin()) - 1;
+    }
+
+public:
+    // Packs n elements in ascending key order without duplicates
+    void build(const ElementBPA<KeyType, ValueType>* elts, size_t n, int block_size) {
+        size_t per_block = max(1, block_size);
+        bases.clear();
+        blocks.clear();
+        starts.clear();
+        values.resize(n);
+
+        vector<KeyType> keys(per_block);
+        for (size_t start = 0; start < n; start += per_block) {
+            size_t len = min(per_block, n - start);
+            for (size_t i = 0; i < len; i++) {
+                keys[i] = elts[start + i].key;
+                values[start + i] = elts[start + i].value;
+            }
+            bases.push_back(keys[0]);
+            starts.push_back(start);
+            blocks.emplace_back();
+            blocks.back().encode(keys.data(), len);
+        }
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    ValueType* find(const KeyType& key) {
+        int b = block_of(key);
+        if (b < 0)
+            return nullptr;
+        uint32_t pos = blocks[b].lower_bound_of(key);
+        if (pos == blocks[b].size() || blocks[b].at(pos) != key)
+            return nullptr;
+        return &values[starts[b] + pos];
+    }
+
+    // Decodes every entry with a key in [low, high) and hands it to f in key order, one block at a time
+    template <typename F>
+    size_t scan(const KeyType& low, const KeyType& high, F f) {
+        size_t visited = 0;
+        vector<KeyType> keys;
+        for (size_t b = max(0, block_of(low)); b < blocks.size() && bases[b] < high; b++) {
+            uint32_t from = blocks[b].lower_bound_of(low);
+            uint32_t to = blocks[b].lower_bound_of(high);
+            if (from >= to)
+                continue;
+            keys.resize(to - from);
+            blocks[b].decode(keys.data(), from, to - from);
+            for (uint32_t i = 0; i < to - from; i++)
+                f(keys[i], values[starts[b] + from + i]);
+            visited += to - from;
+        }
+        return visited;
+    }
+
+    // Same as scan, but for the first limit entries with a key of at least low
+    template <typename F>
+    size_t scan_from(const KeyType& low, size_t limit, F f) {
+        size_t visited = 0;
+        vector<KeyType> keys;
+        for (size_t b = max(0, block_of(low)); b < blocks.size() && visited < limit; b++) {
+            uint32_t from = blocks[b].lower_bound_of(low);
+            uint32_t to = (uint32_t) min<size_t>(blocks[b].size(), from + (limit - visited));
+            if (from >= to)
+                continue;
+            keys.resize(to - from);
+            blocks[b].decode(keys.data(), from, to - from);
+            for (uint32_t i = 0; i < to - from; i++)
+                f(keys[i], values[starts[b] + from + i]);
+            visited += to - from;
+        }
+        return visited;
+    }
+
+    // Writes up to limit entries with a key of at least low to out_keys and out_values, decoding each block
+    // straight into out_keys, and returns how many it wrote
+    size_t copy_from(const KeyType& low, size_t limit, KeyType* out_keys, ValueType* out_values) const {
+        size_t written = 0;
+        for (size_t b = max(0, block_of(low)); b < blocks.size() && written < limit; b++) {
+            uint32_t from = blocks[b].lower_bound_of(low);
+            uint32_t to = (uint32_t) min<size_t>(blocks[b].size(), from + (limit - written));
+            if (from >= to)
+                continue;
+            blocks[b].decode(out_keys + written, from, to - from);
+            copy_n(values.begin() + starts[b] + from, to - from, out_values + written);
+            written += to - from;
+        }
+        return written;
+    }
+
+    bool min_key(KeyType& out) const {
+        if (bases.empty())
+            return false;
+        out = bases[0];
+        return true;
+    }
+
+    // Expands back to elements in key order
+    void unpack(vector<ElementBPA<KeyType, ValueType>>& out) const {
+        vector<KeyType> keys;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            keys.resize(blocks[b].size());
+            blocks[b].decode(keys.data(), 0, keys.size());
+            for (size_t i = 0; i < keys.size(); i++) {
+                ElementBPA<KeyType, ValueType> elt;
+                elt.isNull = false;
+                elt.key = keys[i];
+                elt.value = values[starts[b] + i];
+                out.push_back(elt);
+            }
+        }
+    }
+
+    size_t bytes() const {
+        size_t total = sizeof(*this) + bases.size() * sizeof(KeyType) + starts.size() * sizeof(uint32_t) + values.size() * sizeof(ValueType);
+        for (const PackedKeyRun<KeyType>& block : blocks)
+            total += block.bytes();
+        return total;
+    }
+};
+
+// Read-only leaf format for keys that cannot be packed: the sorted keys and values in two plain arrays,
+// searched by bisection. Same interface as PackedLeaf.
+template <typename KeyType, typename ValueType>
+class SortedLeaf {
+private:
+    vector<KeyType> keys;
+    vector<ValueType> values;
+
+public:
+    // Copies n elements in ascending key order without duplicates, block_size is ignored
+    void build(const ElementBPA<KeyType, ValueType>* elts, size_t n, int) {
+        keys.resize(n);
+        values.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = elts[i].key;
+            values[i] = elts[i].value;
+        }
+        keys.shrink_to_fit();
+        values.shrink_to_fit();
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    ValueType* find(const KeyType& key) {
+        size_t pos = lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        if (pos == keys.size() || keys[pos] != key)
+            return nullptr;
+        return &values[pos];
+    }
+
+    template <typename F>
+    size_t scan(const KeyType& low, const KeyType& high, F f) {
+        size_t from = lower_bound(keys.begin(), keys.end(), low) - keys.begin();
+        size_t to = lower_bound(keys.begin() + from, keys.end(), high) - keys.begin();
+        for (size_t i = from; i < to; i++)
+            f(keys[i], values[i]);
+        return to - from;
+    }
+
+    template <typename F>
+    size_t scan_from(const KeyType& low, size_t limit, F f) {
+        size_t from = lower_bound(keys.begin(), keys.end(), low) - keys.begin();
+        size_t to = from + min(limit, keys.size() - from);
+        for (size_t i = from; i < to; i++)
+            f(keys[i], values[i]);
+        return to - from;
+    }
+
+    size_t copy_from(const KeyType& low, size_t limit, KeyType* out_keys, ValueType* out_values) const {
+        size_t from = lower_bound(keys.begin(), keys.end(), low) - keys.begin();
+        size_t n = min(limit, keys.size() - from);
+        copy_n(keys.begin() + from, n, out_keys);
+        copy_n(values.begin() + from, n, out_values);
+        return n;
+    }
+
+    bool min_key(KeyType& out) const {
+        if (keys.empty())
+            return false;
+        out = keys[0];
+        return true;
+    }
+
+    void unpack(vector<ElementBPA<KeyType, ValueType>>& out) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            ElementBPA<KeyType, ValueType> elt;
+            elt.isNull = false;
+            elt.key = keys[i];
+            elt.value = values[i];
+            out.push_back(elt);
+        }
+    }
+
+    size_t bytes() const {
+        return sizeof(*this) + keys.capacity() * sizeof(KeyType) + values.capacity() * sizeof(ValueType);
+    }
+};
+
+// Read-only format a BPTree leaf is frozen into: packed for integral keys, plain sorted arrays otherwise
+template <typename KeyType, typename ValueType>
+using ColdLeaf = typename conditional<is_integral<KeyType>::value, PackedLeaf<KeyType, ValueType>, SortedLeaf<KeyType, ValueType>>::type;